@@ -217,6 +217,7 @@ write_file(const char* filename, const void* data, size_t data_length){
 #endif
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #ifdef __clang__
 #pragma clang assume_nonnull begin
 #endif
@@ -652,6 +653,545 @@ write_file(const char* filename, const void* data, size_t data_length){
 }
 #endif
 
+//
+// Batched reads
+// -------------
+// Reads a batch of files, or just the start of each (enough for a header),
+// along with their size and modification time.
+//
+// On linux this goes through io_uring: the opens and statxs for the whole
+// batch are submitted at once, then the reads, then the closes, so a batch
+// costs a few syscalls rather than several per file. Reads of just the start
+// go into buffers registered with the kernel up front, so it doesn't have
+// to map the pages in each time.
+//
+// Without io_uring (other platforms, old kernels, seccomp, USE_C_STDIO or
+// FILE_UTIL_NO_URING defined) each file is stat'd and read in turn with
+// `read_bin_file`, or fread for just the start.
+//
+// A FileBatch isn't thread safe, use one per thread.
+//
+#if !defined(__wasm__)
+
+#if defined(__linux__) && !defined(USE_C_STDIO) && !defined(FILE_UTIL_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FILE_BATCH_URING 1
+#endif
+#endif
+
+#ifdef FILE_BATCH_URING
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <string.h>
+#ifndef STATX_SIZE
+// glibc only declares it with _GNU_SOURCE.
+#include <linux/stat.h>
+#endif
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#endif
+#endif
+
+enum {
+    // Files per round trip to the kernel. Longer batches are split up.
+    FILE_BATCH_MAX = 32,
+    // Reads of up to this much from the start use the registered buffers.
+    FILE_BATCH_HEAD_MAX = 64*1024,
+};
+
+typedef struct FileBatchItem FileBatchItem;
+struct FileBatchItem {
+    const char* path;
+    // How much to read from the start, 0 for the whole file.
+    size_t max_bytes;
+    // It's a regular file and file_size and mtime_ns are set already, from
+    // a stat just before, so it isn't stat'd again.
+    _Bool stat_known;
+    // The rest is filled in.
+    FileError error;
+    // From the allocator. Shorter than asked for if the file is.
+    ByteBuffer data;
+    size_t file_size;
+    int64_t mtime_ns;
+};
+
+typedef struct FileBatch FileBatch;
+struct FileBatch {
+    #ifdef FILE_BATCH_URING
+    // -1 if there's no ring, everything else is unused.
+    int ring_fd;
+    void*_Nullable sq_ring;
+    void*_Nullable cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe*_Nullable sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    // Our copy of the submission tail, published when submitting.
+    unsigned tail;
+    // Submitted and not reaped yet.
+    unsigned inflight;
+    // Here rather than on the stack, so it outlives a batch that couldn't
+    // be waited for.
+    struct statx stx[FILE_BATCH_MAX];
+    // FILE_BATCH_MAX buffers of FILE_BATCH_HEAD_MAX.
+    char*_Nullable heads;
+    _Bool heads_tried, heads_registered;
+    #else
+    int unused;
+    #endif
+};
+
+static inline
+void
+file_batch_destroy(FileBatch* b){
+    #ifdef FILE_BATCH_URING
+    if(b->ring_fd < 0) return;
+    if(b->heads)
+        munmap(b->heads, (size_t)FILE_BATCH_MAX*FILE_BATCH_HEAD_MAX);
+    if(b->sqes)
+        munmap(b->sqes, b->sqes_size);
+    if(b->cq_ring && b->cq_ring != b->sq_ring)
+        munmap(b->cq_ring, b->cq_ring_size);
+    if(b->sq_ring)
+        munmap(b->sq_ring, b->sq_ring_size);
+    close(b->ring_fd);
+    b->ring_fd = -1;
+    #else
+    (void)b;
+    #endif
+}
+
+#ifdef FILE_BATCH_URING
+//
+// Returns whether the ring can do everything a batch needs. Kernels from
+// before these ops were added don't know the probe either.
+//
+static inline
+_Bool
+file_batch_supported(int ring_fd){
+    union {
+        struct io_uring_probe probe;
+        char bytes[sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op)];
+    } u;
+    memset(&u, 0, sizeof u);
+    if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, &u.probe, 256) != 0)
+        return 0;
+    static const unsigned char needed[] = {
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+        IORING_OP_READ_FIXED, IORING_OP_CLOSE,
+    };
+    for(size_t i = 0; i < sizeof needed; i++){
+        if(needed[i] >= u.probe.ops_len) return 0;
+        if(!(u.probe.ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) return 0;
+    }
+    return 1;
+}
+#endif
+
+//
+// Sets up the batch. Can't fail, without io_uring files are read one at a
+// time.
+//
+static inline
+void
+file_batch_init(FileBatch* b){
+    memset(b, 0, sizeof *b);
+    #ifdef FILE_BATCH_URING
+    b->ring_fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // Room for an open and a statx for every file.
+    int fd = (int)syscall(__NR_io_uring_setup, 2*FILE_BATCH_MAX, &p);
+    if(fd < 0) return;
+    b->ring_fd = fd;
+    if(!file_batch_supported(fd)) goto fail;
+    b->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    b->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    _Bool single_mmap = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+    if(single_mmap){
+        if(b->cq_ring_size > b->sq_ring_size) b->sq_ring_size = b->cq_ring_size;
+        b->cq_ring_size = b->sq_ring_size;
+    }
+    void* sq = mmap(NULL, b->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) goto fail;
+    b->sq_ring = sq;
+    void* cq = sq;
+    if(!single_mmap){
+        cq = mmap(NULL, b->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) goto fail;
+    }
+    b->cq_ring = cq;
+    b->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, b->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) goto fail;
+    b->sqes = sqes;
+    char* sqc = sq;
+    char* cqc = cq;
+    b->sq_head = (unsigned*)(sqc + p.sq_off.head);
+    b->sq_tail = (unsigned*)(sqc + p.sq_off.tail);
+    b->sq_mask = (unsigned*)(sqc + p.sq_off.ring_mask);
+    b->sq_array = (unsigned*)(sqc + p.sq_off.array);
+    b->cq_head = (unsigned*)(cqc + p.cq_off.head);
+    b->cq_tail = (unsigned*)(cqc + p.cq_off.tail);
+    b->cq_mask = (unsigned*)(cqc + p.cq_off.ring_mask);
+    b->cqes = (struct io_uring_cqe*)(cqc + p.cq_off.cqes);
+    b->tail = *b->sq_tail;
+    return;
+
+    fail:
+    file_batch_destroy(b);
+    #endif
+}
+
+#ifdef FILE_BATCH_URING
+enum {FILE_BATCH_OPEN, FILE_BATCH_STAT, FILE_BATCH_READ, FILE_BATCH_CLOSE};
+
+//
+// Sets up the buffers for reading the start of files the first time it's
+// done, they're pinned in memory from then on.
+//
+static inline
+void
+file_batch_register_heads(FileBatch* b){
+    if(b->heads_tried) return;
+    b->heads_tried = 1;
+    size_t size = (size_t)FILE_BATCH_MAX*FILE_BATCH_HEAD_MAX;
+    void* heads = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(heads == MAP_FAILED) return;
+    b->heads = heads;
+    struct iovec iov = {heads, size};
+    // Can fail on the locked memory limit, plain reads work too.
+    b->heads_registered = syscall(__NR_io_uring_register, b->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+
+static inline
+struct io_uring_sqe*
+file_batch_sqe(FileBatch* b, int op, size_t index){
+    unsigned i = b->tail++ & *b->sq_mask;
+    b->sq_array[i] = i;
+    struct io_uring_sqe* sqe = &b->sqes[i];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uint64_t)index << 2 | (uint64_t)op;
+    return sqe;
+}
+
+//
+// Submits the n queued entries and waits for all of them to complete.
+// Returns non-zero if the ring is unusable.
+//
+static inline
+int
+file_batch_submit(FileBatch* b, unsigned n){
+    __atomic_store_n(b->sq_tail, b->tail, __ATOMIC_RELEASE);
+    unsigned submitted = 0;
+    for(;;){
+        unsigned ready = __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE) - *b->cq_head;
+        if(submitted == n && ready >= n) return 0;
+        long r = syscall(__NR_io_uring_enter, b->ring_fd, n - submitted, n, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(r < 0){
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        submitted += (unsigned)r;
+        b->inflight += (unsigned)r;
+    }
+}
+
+// Takes the next completion, returns 0 if there isn't one.
+static inline
+int
+file_batch_reap(FileBatch* b, int* op, size_t* index, int* res){
+    unsigned head = *b->cq_head;
+    if(head == __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe* cqe = &b->cqes[head & *b->cq_mask];
+    *op = (int)(cqe->user_data & 3);
+    *index = (size_t)(cqe->user_data >> 2);
+    *res = cqe->res;
+    __atomic_store_n(b->cq_head, head+1, __ATOMIC_RELEASE);
+    b->inflight--;
+    return 1;
+}
+
+//
+// Waits for everything submitted to complete, after a submit failed.
+// Records the fds of opens that completed meanwhile into `fds`.
+// Returns non-zero if it couldn't wait, so some may still be going.
+//
+static inline
+int
+file_batch_drain(FileBatch* b, int* fds){
+    int op, res;
+    size_t i;
+    for(;;){
+        while(file_batch_reap(b, &op, &i, &res))
+            if(op == FILE_BATCH_OPEN && res >= 0)
+                fds[i] = res;
+        if(!b->inflight) return 0;
+        // Doesn't submit anything, what's still queued is dropped with the
+        // ring.
+        long r = syscall(__NR_io_uring_enter, b->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return 1;
+    }
+}
+
+//
+// Reads up to FILE_BATCH_MAX files.
+// Returns non-zero if the ring broke partway, the items are left for
+// reading without it once what was in flight has been waited for and the
+// files it opened closed.
+//
+static inline
+int
+file_batch_read_uring(FileBatch* b, FileBatchItem* items, size_t count, Allocator a){
+    int fds[FILE_BATCH_MAX];
+    struct statx* stx = b->stx;
+    size_t want[FILE_BATCH_MAX], done[FILE_BATCH_MAX];
+    _Bool fixed[FILE_BATCH_MAX];
+    int op, res;
+    size_t i;
+    unsigned nstat = 0;
+    for(i = 0; i < count; i++){
+        FileBatchItem* it = &items[i];
+        fds[i] = -1;
+        fixed[i] = 0;
+        want[i] = done[i] = 0;
+        it->data = (ByteBuffer){0};
+        struct io_uring_sqe* sqe = file_batch_sqe(b, FILE_BATCH_OPEN, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)it->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        if(it->stat_known) continue;
+        nstat++;
+        sqe = file_batch_sqe(b, FILE_BATCH_STAT, i);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)it->path;
+        sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+        sqe->off = (uint64_t)(uintptr_t)&stx[i];
+    }
+    if(file_batch_submit(b, (unsigned)count + nstat)) goto fail;
+    for(i = 0; i < count; i++)
+        items[i].error = (FileError){0};
+    while(file_batch_reap(b, &op, &i, &res)){
+        FileBatchItem* it = &items[i];
+        if(op == FILE_BATCH_OPEN){
+            if(res < 0)
+                it->error = (FileError){.errored=FILE_NOT_OPENED, .native_error=-res};
+            else
+                fds[i] = res;
+        }
+        else if(res < 0 && !it->error.errored)
+            it->error = (FileError){.errored=FILE_ERROR, .native_error=-res};
+    }
+    unsigned pending = 0;
+    for(i = 0; i < count; i++){
+        FileBatchItem* it = &items[i];
+        if(it->error.errored) continue;
+        if(!it->stat_known){
+            if(!S_ISREG(stx[i].stx_mode)){
+                it->error.errored = FILE_IS_NOT_A_FILE;
+                continue;
+            }
+            it->file_size = (size_t)stx[i].stx_size;
+            it->mtime_ns = (int64_t)stx[i].stx_mtime.tv_sec*1000000000 + stx[i].stx_mtime.tv_nsec;
+        }
+        want[i] = it->max_bytes && it->max_bytes < it->file_size? it->max_bytes : it->file_size;
+        if(it->max_bytes && it->max_bytes <= FILE_BATCH_HEAD_MAX){
+            file_batch_register_heads(b);
+            fixed[i] = b->heads_registered;
+        }
+        if(!want[i]) continue;
+        it->data.buff = Allocator_alloc(a, want[i]);
+        if(!it->data.buff){
+            it->error.errored = FILE_RESULT_ALLOC_FAILURE;
+            continue;
+        }
+        pending++;
+    }
+    // Reads can come up short, keep going until they're all done.
+    while(pending){
+        unsigned n = 0;
+        for(i = 0; i < count; i++){
+            FileBatchItem* it = &items[i];
+            if(it->error.errored || done[i] == want[i]) continue;
+            struct io_uring_sqe* sqe = file_batch_sqe(b, FILE_BATCH_READ, i);
+            sqe->fd = fds[i];
+            sqe->off = done[i];
+            sqe->len = (unsigned)(want[i] - done[i]);
+            if(fixed[i]){
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->addr = (uint64_t)(uintptr_t)(b->heads + i*FILE_BATCH_HEAD_MAX + done[i]);
+                sqe->buf_index = 0;
+            }
+            else {
+                sqe->opcode = IORING_OP_READ;
+                sqe->addr = (uint64_t)(uintptr_t)((char*)it->data.buff + done[i]);
+            }
+            n++;
+        }
+        if(file_batch_submit(b, n)) goto fail;
+        while(file_batch_reap(b, &op, &i, &res)){
+            FileBatchItem* it = &items[i];
+            if(res == -EINTR || res == -EAGAIN) continue;
+            if(res < 0){
+                Allocator_free(a, it->data.buff, want[i]);
+                it->data.buff = NULL;
+                it->error = (FileError){.errored=FILE_ERROR, .native_error=-res};
+                pending--;
+                continue;
+            }
+            done[i] += (size_t)res;
+            // Got shorter since the statx.
+            if(!res) want[i] = done[i];
+            if(done[i] == want[i]) pending--;
+        }
+    }
+    unsigned n = 0;
+    for(i = 0; i < count; i++){
+        FileBatchItem* it = &items[i];
+        if(!it->error.errored){
+            if(fixed[i] && done[i])
+                memcpy(it->data.buff, b->heads + i*FILE_BATCH_HEAD_MAX, done[i]);
+            it->data.n_bytes = done[i];
+        }
+        if(fds[i] < 0) continue;
+        struct io_uring_sqe* sqe = file_batch_sqe(b, FILE_BATCH_CLOSE, i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fds[i];
+        n++;
+    }
+    if(n && file_batch_submit(b, n) == 0)
+        while(file_batch_reap(b, &op, &i, &res))
+            ;
+    return 0;
+
+    fail:;
+    // Reads may still land in the buffers if it can't be waited for, they're
+    // leaked then rather than handed back.
+    _Bool stuck = file_batch_drain(b, fds) != 0;
+    for(i = 0; i < count; i++){
+        if(fds[i] >= 0)
+            close(fds[i]);
+        FileBatchItem* it = &items[i];
+        if(it->data.buff && !stuck)
+            Allocator_free(a, it->data.buff, want[i]);
+        it->data = (ByteBuffer){0};
+    }
+    return 1;
+}
+#endif
+
+static inline
+void
+file_batch_read_one(FileBatchItem* it, Allocator a){
+    it->error = (FileError){0};
+    it->data = (ByteBuffer){0};
+    if(!it->stat_known){
+        struct stat st;
+        if(stat(it->path, &st) != 0){
+            it->error = (FileError){.errored=FILE_NOT_OPENED, .native_error=errno};
+            return;
+        }
+        if(!S_ISREG(st.st_mode)){
+            it->error.errored = FILE_IS_NOT_A_FILE;
+            return;
+        }
+        it->file_size = (size_t)st.st_size;
+        #if defined(__APPLE__)
+            it->mtime_ns = (int64_t)st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+        #elif defined(__linux__)
+            it->mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+        #else
+            it->mtime_ns = (int64_t)st.st_mtime*1000000000;
+        #endif
+    }
+    if(!it->max_bytes || it->max_bytes >= it->file_size){
+        it->error = read_bin_file(it->path, a, &it->data);
+        return;
+    }
+    FILE* fp = fopen(it->path, "rb");
+    if(!fp){
+        it->error = (FileError){.errored=FILE_NOT_OPENED, .native_error=errno};
+        return;
+    }
+    void* data = Allocator_alloc(a, it->max_bytes);
+    if(!data){
+        it->error.errored = FILE_RESULT_ALLOC_FAILURE;
+        fclose(fp);
+        return;
+    }
+    size_t n = fread(data, 1, it->max_bytes, fp);
+    fclose(fp);
+    it->data = (ByteBuffer){n, data};
+}
+
+//
+// Reads the items, setting each one's error and filling in the rest if
+// there wasn't one. Successfully read data is allocated with `a`.
+//
+static inline
+void
+file_batch_read(FileBatch* b, FileBatchItem* items, size_t count, Allocator a){
+    #ifdef FILE_BATCH_URING
+    while(count && b->ring_fd >= 0){
+        size_t n = count < FILE_BATCH_MAX? count : FILE_BATCH_MAX;
+        if(file_batch_read_uring(b, items, n, a)){
+            // Whatever was in flight is lost, don't try it again.
+            file_batch_destroy(b);
+            break;
+        }
+        items += n;
+        count -= n;
+    }
+    #else
+    (void)b;
+    #endif
+    for(size_t i = 0; i < count; i++)
+        file_batch_read_one(&items[i], a);
+}
+
+//
+// Tells the kernel the whole file will be read soon, so it can start
+// reading it into the page cache while we do something else. Doesn't wait
+// for that. Does nothing where there's no way to say so.
+// Returns non-zero if the file can't be opened.
+//
+static inline
+int
+file_will_need(const char* path){
+    #if !defined(USE_C_STDIO) && (defined(__linux__) || defined(__APPLE__))
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if(fd < 0) return 1;
+    #ifdef __APPLE__
+    struct stat st;
+    if(fstat(fd, &st) == 0){
+        struct radvisory ra = {
+            .ra_offset = 0,
+            .ra_count = st.st_size < INT_MAX? (int)st.st_size : INT_MAX,
+        };
+        fcntl(fd, F_RDADVISE, &ra);
+    }
+    #else
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    #endif
+    close(fd);
+    return 0;
+    #else
+    (void)path;
+    return 0;
+    #endif
+}
+#endif
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
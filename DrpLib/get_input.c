@@ -26,6 +26,9 @@
 
 #include <termios.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 
@@ -83,6 +86,13 @@ struct TermState;
 static void enable_raw(struct TermState*);
 static void disable_raw(struct TermState*);
 
+#ifndef _WIN32
+// The input session, if one has begun. While there is one the terminal
+// stays raw and lines are read through it.
+static GiInput*_Nullable gi_session;
+static ssize_t gi_session_read_one(GiInput*, char*);
+#endif
+
 static void change_history(GetInputCtx*, int magnitude);
 static void redisplay(GetInputCtx*);
 static void delete_right(GetInputCtx*);
@@ -164,6 +174,8 @@ read_one(char* buff){
     }
     return 1;
 #else
+    if(gi_session)
+        return gi_session_read_one(gi_session, buff);
     return read(STDIN_FILENO, buff, 1);
 #endif
 }
@@ -236,6 +248,9 @@ struct TermState {
 static
 void
 enable_raw(struct TermState*ts){
+    // Already raw, and anything typed ahead is for us.
+    if(gi_session)
+        return;
     if(tcgetattr(STDIN_FILENO, &ts->orig) == -1)
         return;
     ts->raw = ts->orig;
@@ -269,8 +284,537 @@ enable_raw(struct TermState*ts){
 static
 void
 disable_raw(struct TermState*ts){
+    if(gi_session)
+        return;
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &ts->orig);
 }
+
+// How the terminal was before the session.
+static struct termios gi_session_orig;
+static _Bool gi_session_have_orig;
+
+GET_INPUT_API
+int
+gi_input_begin(GiInput* in, int fd){
+    if(gi_session)
+        return 1;
+    *in = (GiInput){.fd = fd};
+    gi_session_have_orig = tcgetattr(fd, &gi_session_orig) == 0;
+    if(gi_session_have_orig){
+        struct termios raw = gi_session_orig;
+        raw.c_iflag &= ~(0lu | BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        raw.c_cflag |= CS8;
+        // Unlike enable_raw, output is left alone: the program is still
+        // printing lines with \n.
+        raw.c_lflag &= ~(0lu | ECHO | ICANON | IEXTEN | ISIG);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        // TCSANOW, keys typed meanwhile are wanted.
+        tcsetattr(fd, TCSANOW, &raw);
+    }
+    gi_session = in;
+    return 0;
+}
+
+GET_INPUT_API
+void
+gi_input_end(GiInput* in){
+    if(gi_session != in)
+        return;
+    if(gi_session_have_orig)
+        tcsetattr(in->fd, TCSANOW, &gi_session_orig);
+    gi_session = NULL;
+}
+
+static inline
+int64_t
+gi_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static
+GiEvent*
+gi_push_event(GiInput* in, GiEventType type){
+    GiEvent* ev = &in->events[(in->event_head + in->event_count++) % GI_EVENT_QUEUE];
+    ev->type = type;
+    ev->key = 0;
+    ev->mods = 0;
+    ev->release = 0;
+    ev->x = ev->y = 0;
+    ev->reply_length = 0;
+    return ev;
+}
+
+static
+void
+gi_push_key(GiInput* in, int key, unsigned mods, _Bool release){
+    GiEvent* ev = gi_push_event(in, GI_EVENT_KEY);
+    ev->key = key;
+    ev->mods = mods;
+    ev->release = release;
+}
+
+static
+void
+gi_push_reply(GiInput* in, const unsigned char* seq, size_t length){
+    GiEvent* ev = gi_push_event(in, GI_EVENT_REPLY);
+    if(length > GI_REPLY_MAX) length = GI_REPLY_MAX;
+    memcpy(ev->reply, seq, length);
+    ev->reply_length = length;
+}
+
+//
+// Decodes the utf-8 character at the start of `s`.
+// Returns how many bytes it is, 0 if it's cut short.
+//
+static
+size_t
+gi_decode_utf8(const unsigned char* s, size_t length, int* codepoint){
+    unsigned char c = s[0];
+    size_t n;
+    int cp;
+    if(c < 0x80){
+        *codepoint = c;
+        return 1;
+    }
+    else if((c & 0xe0) == 0xc0){ n = 2; cp = c & 0x1f; }
+    else if((c & 0xf0) == 0xe0){ n = 3; cp = c & 0x0f; }
+    else if((c & 0xf8) == 0xf0){ n = 4; cp = c & 0x07; }
+    else goto invalid;
+    for(size_t i = 1; i < n; i++){
+        if(i >= length) return 0;
+        if((s[i] & 0xc0) != 0x80) goto invalid;
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    if(cp >= 0x110000)
+        goto invalid;
+    *codepoint = cp;
+    return n;
+
+    invalid:
+    *codepoint = 0xfffd;
+    return 1;
+}
+
+// Modifiers as sent in CSI parameters: 1 + the bits.
+static inline
+unsigned
+gi_csi_mods(int param){
+    return param > 1? (unsigned)(param - 1) & 0xf : 0;
+}
+
+enum {GI_CSI_PARAMS = 8};
+typedef struct GiCsi GiCsi;
+struct GiCsi {
+    // '<', '=', '>' or '?' at the start, 0 if none.
+    char marker;
+    _Bool intermediate;
+    char final;
+    int count;
+    // The first and second of any colon separated parts, -1 if missing.
+    int params[GI_CSI_PARAMS];
+    int sub[GI_CSI_PARAMS];
+};
+
+//
+// Parses the CSI sequence starting at s[2].
+// Returns its length including the ESC [, 0 if it's cut short.
+//
+static
+size_t
+gi_parse_csi(const unsigned char* s, size_t length, GiCsi* csi){
+    *csi = (GiCsi){0};
+    for(int i = 0; i < GI_CSI_PARAMS; i++)
+        csi->params[i] = csi->sub[i] = -1;
+    size_t i = 2;
+    if(i < length && s[i] >= '<' && s[i] <= '?')
+        csi->marker = (char)s[i++];
+    int colons = 0;
+    for(; i < length; i++){
+        unsigned char c = s[i];
+        if(c >= 0x40 && c <= 0x7e){
+            csi->final = (char)c;
+            if(csi->count || i > 2 + !!csi->marker)
+                csi->count++;
+            return i + 1;
+        }
+        if(c >= 0x20 && c <= 0x2f){
+            csi->intermediate = 1;
+            continue;
+        }
+        int p = csi->count < GI_CSI_PARAMS? csi->count : GI_CSI_PARAMS - 1;
+        if(c >= '0' && c <= '9'){
+            int* v = colons == 0? &csi->params[p] : colons == 1? &csi->sub[p] : NULL;
+            if(v){
+                if(*v < 0) *v = 0;
+                if(*v < 100000) *v = *v * 10 + (c - '0');
+            }
+        }
+        else if(c == ';'){
+            csi->count++;
+            colons = 0;
+        }
+        else if(c == ':')
+            colons++;
+        else if(c >= 0x30 && c <= 0x3f)
+            ; // Private parameter bytes, nothing uses them.
+        else {
+            // Not part of a sequence: whatever this was has been cut off.
+            csi->final = 0;
+            return i;
+        }
+    }
+    return 0;
+}
+
+static
+int
+gi_tilde_key(int code){
+    switch(code){
+        case 1: case 7: return GI_KEY_HOME;
+        case 4: case 8: return GI_KEY_END;
+        case 2: return GI_KEY_INSERT;
+        case 3: return GI_KEY_DELETE;
+        case 5: return GI_KEY_PAGE_UP;
+        case 6: return GI_KEY_PAGE_DOWN;
+        case 11: case 12: case 13: case 14: case 15:
+            return GI_KEY_F1 + code - 11;
+        case 17: case 18: case 19: case 20: case 21:
+            return GI_KEY_F1 + 5 + code - 17;
+        case 23: case 24:
+            return GI_KEY_F1 + 10 + code - 23;
+        default: return 0;
+    }
+}
+
+static
+int
+gi_letter_key(char final){
+    switch(final){
+        case 'A': return GI_KEY_UP;
+        case 'B': return GI_KEY_DOWN;
+        case 'C': return GI_KEY_RIGHT;
+        case 'D': return GI_KEY_LEFT;
+        case 'H': return GI_KEY_HOME;
+        case 'F': return GI_KEY_END;
+        case 'P': return GI_KEY_F1;
+        case 'Q': return GI_KEY_F1 + 1;
+        case 'S': return GI_KEY_F1 + 3;
+        default: return 0;
+    }
+}
+
+static
+void
+gi_push_mouse(GiInput* in, int b, int x, int y, _Bool release){
+    GiEvent* ev = gi_push_event(in, GI_EVENT_MOUSE);
+    ev->mods = (b & 4? GI_MOD_SHIFT : 0) | (b & 8? GI_MOD_ALT : 0) | (b & 16? GI_MOD_CTRL : 0);
+    ev->key = b & ~(4 | 8 | 16);
+    ev->release = release;
+    ev->x = x;
+    ev->y = y;
+}
+
+//
+// Turns the CSI sequence `s` into an event.
+//
+static
+void
+gi_push_csi(GiInput* in, const unsigned char* s, size_t length, const GiCsi* csi){
+    int first = csi->params[0];
+    unsigned mods = gi_csi_mods(csi->params[1]);
+    // Kitty's event type: 1 pressed, 2 repeated, 3 released.
+    _Bool release = csi->sub[1] == 3;
+    if(csi->intermediate)
+        goto reply;
+    if(csi->marker == '<' && (csi->final == 'M' || csi->final == 'm') && csi->count == 3){
+        gi_push_mouse(in, first, csi->params[1], csi->params[2], csi->final == 'm');
+        return;
+    }
+    if(csi->marker)
+        goto reply;
+    int key = 0;
+    switch(csi->final){
+        case 'A': case 'B': case 'C': case 'D': case 'H': case 'F':
+        case 'P': case 'Q': case 'S':
+            // Modified keys are sent as CSI 1 ; mods X. Anything else with
+            // parameters is something else.
+            if(first > 1 || (csi->count > 1 && first != 1))
+                goto reply;
+            key = gi_letter_key(csi->final);
+            break;
+        case '~':
+            key = gi_tilde_key(first);
+            break;
+        case 'Z':
+            key = '\t';
+            mods |= GI_MOD_SHIFT;
+            break;
+        case 'u':
+            // Kitty keyboard protocol: CSI code[:alternates] ; mods[:event] u
+            if(first < 0)
+                goto reply;
+            key = first;
+            // Ctrl with a letter is what it always was.
+            if(mods & GI_MOD_CTRL && key >= 'a' && key <= 'z')
+                key &= 0x1f;
+            break;
+        default:
+            break;
+    }
+    if(!key)
+        goto reply;
+    gi_push_key(in, key, mods, release);
+    return;
+
+    reply:
+    gi_push_reply(in, s, length);
+}
+
+//
+// Parses one event from the start of the buffer.
+// Returns how many bytes it took, 0 if they're cut short.
+//
+static
+size_t
+gi_parse_one(GiInput* in, const unsigned char* s, size_t length){
+    int cp;
+    if(s[0] != '\033'){
+        size_t n = gi_decode_utf8(s, length, &cp);
+        if(n) gi_push_key(in, cp, 0, 0);
+        return n;
+    }
+    if(length < 2)
+        return 0;
+    switch(s[1]){
+        case '[':{
+            // X10 mouse: CSI M and three bytes, each offset by 32.
+            if(length >= 3 && s[2] == 'M'){
+                if(length < 6) return 0;
+                int b = s[3] - 32;
+                gi_push_mouse(in, (b & 3) == 3? 0 : b, s[4] - 32, s[5] - 32, (b & 3) == 3 && !(b & 64));
+                return 6;
+            }
+            GiCsi csi;
+            size_t n = gi_parse_csi(s, length, &csi);
+            if(!n) return 0;
+            if(csi.final)
+                gi_push_csi(in, s, n, &csi);
+            else
+                gi_push_reply(in, s, n);
+            return n;
+        }
+        case 'O':{
+            if(length < 3) return 0;
+            int key = 0;
+            switch(s[2]){
+                case 'P': case 'Q': case 'R': case 'S':
+                    key = GI_KEY_F1 + s[2] - 'P';
+                    break;
+                default:
+                    key = gi_letter_key((char)s[2]);
+                    break;
+            }
+            if(!key){
+                // Alt-O and whatever comes next.
+                gi_push_key(in, 'O', GI_MOD_ALT, 0);
+                return 2;
+            }
+            gi_push_key(in, key, 0, 0);
+            return 3;
+        }
+        // Strings: DCS, SOS, OSC, PM and APC, ended by ST (or BEL).
+        case 'P': case 'X': case ']': case '^': case '_':
+            for(size_t i = 2; i < length; i++){
+                if(s[i] == '\a'){
+                    gi_push_reply(in, s, i + 1);
+                    return i + 1;
+                }
+                if(s[i] == '\033' && i + 1 < length && s[i+1] == '\\'){
+                    gi_push_reply(in, s, i + 2);
+                    return i + 2;
+                }
+            }
+            return 0;
+        // Two escapes, the first is the key.
+        case '\033':
+            gi_push_key(in, '\033', 0, 0);
+            return 1;
+        default:{
+            size_t n = gi_decode_utf8(s+1, length-1, &cp);
+            if(!n) return 0;
+            gi_push_key(in, cp, GI_MOD_ALT, 0);
+            return n + 1;
+        }
+    }
+}
+
+//
+// Parses as much of the buffer as there's room for in the queue. If
+// `expire`, anything cut short is taken as it is.
+//
+static
+void
+gi_parse(GiInput* in, _Bool expire){
+    size_t used = 0;
+    while(used < in->buff_count && in->event_count < GI_EVENT_QUEUE){
+        const unsigned char* s = in->buff + used;
+        size_t length = in->buff_count - used;
+        size_t n = gi_parse_one(in, s, length);
+        if(!n){
+            // It won't fit, so it isn't going to be finished either.
+            if(!expire && length < GI_INPUT_BUFF)
+                break;
+            if(s[0] == '\033')
+                gi_push_key(in, '\033', 0, 0);
+            else
+                gi_push_key(in, 0xfffd, 0, 0);
+            n = 1;
+        }
+        used += n;
+    }
+    if(used){
+        in->buff_count -= used;
+        memmove(in->buff, in->buff + used, in->buff_count);
+    }
+    if(in->buff_count && in->event_count < GI_EVENT_QUEUE){
+        if(!in->waiting_since)
+            in->waiting_since = gi_now_ms();
+    }
+    else
+        in->waiting_since = 0;
+}
+
+GET_INPUT_API
+int
+gi_input_read(GiInput* in){
+    if(in->eof)
+        return -1;
+    if(in->buff_count < GI_INPUT_BUFF){
+        ssize_t n = read(in->fd, in->buff + in->buff_count, GI_INPUT_BUFF - in->buff_count);
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+            return 0;
+        if(n <= 0){
+            in->eof = 1;
+            gi_parse(in, 1);
+            return -1;
+        }
+        in->buff_count += (size_t)n;
+    }
+    gi_parse(in, 0);
+    return 0;
+}
+
+GET_INPUT_API
+int
+gi_input_next(GiInput* in, GiEvent* event){
+    // Left for want of room.
+    if(!in->event_count && in->buff_count)
+        gi_parse(in, in->eof);
+    if(!in->event_count)
+        return 1;
+    *event = in->events[in->event_head];
+    in->event_head = (in->event_head + 1) % GI_EVENT_QUEUE;
+    in->event_count--;
+    return 0;
+}
+
+GET_INPUT_API
+int
+gi_input_timeout(const GiInput* in){
+    if(!in->waiting_since)
+        return -1;
+    int64_t left = in->waiting_since + GI_ESC_TIMEOUT_MS - gi_now_ms();
+    return left > 0? (int)left : 0;
+}
+
+GET_INPUT_API
+void
+gi_input_expire(GiInput* in){
+    gi_parse(in, 1);
+}
+
+//
+// Puts the bytes the line editor expects for a key in `replay`.
+//
+static
+void
+gi_replay_key(GiInput* in, const GiEvent* ev){
+    char* out = in->replay;
+    size_t n = 0;
+    const char* seq = NULL;
+    switch(ev->key){
+        case GI_KEY_UP: seq = "\033[A"; break;
+        case GI_KEY_DOWN: seq = "\033[B"; break;
+        case GI_KEY_RIGHT: seq = "\033[C"; break;
+        case GI_KEY_LEFT: seq = "\033[D"; break;
+        case GI_KEY_HOME: seq = "\033[H"; break;
+        case GI_KEY_END: seq = "\033[F"; break;
+        case GI_KEY_DELETE: seq = "\033[3~"; break;
+        case '\t': if(ev->mods & GI_MOD_SHIFT) seq = "\033[Z"; break;
+        default: break;
+    }
+    if(seq){
+        n = strlen(seq);
+        memcpy(out, seq, n);
+    }
+    else if(ev->key < 0x80){
+        if(ev->mods & GI_MOD_ALT)
+            out[n++] = '\033';
+        out[n++] = (char)ev->key;
+    }
+    else if(ev->key < 0x800){
+        out[n++] = (char)(0xc0 | ev->key >> 6);
+        out[n++] = (char)(0x80 | (ev->key & 0x3f));
+    }
+    else if(ev->key < 0x10000){
+        out[n++] = (char)(0xe0 | ev->key >> 12);
+        out[n++] = (char)(0x80 | (ev->key >> 6 & 0x3f));
+        out[n++] = (char)(0x80 | (ev->key & 0x3f));
+    }
+    else if(ev->key < 0x110000){
+        out[n++] = (char)(0xf0 | ev->key >> 18);
+        out[n++] = (char)(0x80 | (ev->key >> 12 & 0x3f));
+        out[n++] = (char)(0x80 | (ev->key >> 6 & 0x3f));
+        out[n++] = (char)(0x80 | (ev->key & 0x3f));
+    }
+    in->replay_head = 0;
+    in->replay_count = n;
+}
+
+//
+// read_one during a session: keys are turned back into the bytes the line
+// editor knows. Mouse reports and replies are of no use to it and dropped.
+//
+static
+ssize_t
+gi_session_read_one(GiInput* in, char* buff){
+    for(;;){
+        if(in->replay_count){
+            *buff = in->replay[in->replay_head++];
+            in->replay_count--;
+            return 1;
+        }
+        GiEvent ev;
+        if(gi_input_next(in, &ev) == 0){
+            if(ev.type == GI_EVENT_KEY && !ev.release)
+                gi_replay_key(in, &ev);
+            continue;
+        }
+        int timeout = gi_input_timeout(in);
+        if(timeout >= 0){
+            struct pollfd pfd = {.fd = in->fd, .events = POLLIN};
+            if(poll(&pfd, 1, timeout) == 0){
+                gi_input_expire(in);
+                continue;
+            }
+        }
+        if(gi_input_read(in) != 0 && !in->event_count && !in->replay_count)
+            return 0;
+    }
+}
 #endif
 
 static
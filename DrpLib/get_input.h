@@ -279,6 +279,161 @@ GET_INPUT_API
 int
 gi_get_one_char(void);
 
+//
+// Input sessions
+// --------------
+// For programs that take keys as they're typed for as long as they run,
+// rather than a line at a time.
+//
+// `gi_input_begin` puts the terminal in raw mode once, without discarding
+// anything already typed, and it stays that way until `gi_input_end`.
+// Meanwhile `gi_get_input` and friends leave the terminal mode alone and
+// read through the session, so keys typed ahead of a prompt go to it.
+//
+// `gi_input_read` reads as much as there is in one go and parses it into
+// events, which queue up until taken with `gi_input_next`:
+//
+//   - keys, including the escape sequences for arrows, Home/End,
+//     PgUp/PgDn, Insert/Delete and F1-F12, with modifiers, and keys in the
+//     kitty keyboard protocol (CSI ... u)
+//   - mouse reports, SGR (CSI < ... M/m) or X10 (CSI M)
+//   - replies from the terminal to queries: any other CSI, and DCS, APC,
+//     OSC, PM and SOS strings, given whole
+//
+// A lone ESC can't be told from the start of a sequence until nothing more
+// comes. `gi_input_timeout` says how long to wait for more, after which
+// `gi_input_expire` makes it a key.
+//
+// Only one session at a time. Not on windows.
+//
+
+enum {GI_INPUT_BUFF = 4096, GI_EVENT_QUEUE = 64, GI_REPLY_MAX = 256};
+enum {GI_ESC_TIMEOUT_MS = 50};
+
+typedef enum GiEventType {
+    GI_EVENT_KEY,
+    GI_EVENT_MOUSE,
+    GI_EVENT_REPLY,
+} GiEventType;
+
+// Keys that aren't characters, beyond unicode.
+enum {
+    GI_KEY_UP = 0x110000,
+    GI_KEY_DOWN,
+    GI_KEY_RIGHT,
+    GI_KEY_LEFT,
+    GI_KEY_HOME,
+    GI_KEY_END,
+    GI_KEY_PAGE_UP,
+    GI_KEY_PAGE_DOWN,
+    GI_KEY_INSERT,
+    GI_KEY_DELETE,
+    GI_KEY_F1,
+    // F2 to F12 follow.
+    GI_KEY_F12 = GI_KEY_F1 + 11,
+};
+
+enum {
+    GI_MOD_SHIFT = 1,
+    GI_MOD_ALT   = 2,
+    GI_MOD_CTRL  = 4,
+    GI_MOD_SUPER = 8,
+};
+
+enum {
+    GI_MOUSE_LEFT = 0,
+    GI_MOUSE_MIDDLE = 1,
+    GI_MOUSE_RIGHT = 2,
+    GI_MOUSE_WHEEL_UP = 64,
+    GI_MOUSE_WHEEL_DOWN = 65,
+};
+
+typedef struct GiEvent GiEvent;
+struct GiEvent {
+    GiEventType type;
+    // Keys: a unicode codepoint (control characters as themselves, Enter is
+    // '\r') or a GI_KEY_*. Mouse: a GI_MOUSE_*, or another button number.
+    int key;
+    // GI_MOD_*.
+    unsigned mods;
+    // A key or button let go of (kitty reports these if asked, and mice).
+    _Bool release;
+    // Mouse: the cell, from 1.
+    int x, y;
+    // Replies: the sequence as sent, cut short at GI_REPLY_MAX.
+    size_t reply_length;
+    char reply[GI_REPLY_MAX];
+};
+
+typedef struct GiInput GiInput;
+struct GiInput {
+    int fd;
+    // Read but not parsed.
+    unsigned char buff[GI_INPUT_BUFF];
+    size_t buff_count;
+    GiEvent events[GI_EVENT_QUEUE];
+    size_t event_head, event_count;
+    // When an incomplete sequence at the start of buff was first seen, in
+    // milliseconds, 0 if there isn't one.
+    int64_t waiting_since;
+    // Bytes of a key handed back to the line editor.
+    char replay[8];
+    size_t replay_head, replay_count;
+    _Bool eof;
+};
+
+GET_INPUT_API
+int
+gi_input_begin(GiInput* in, int fd);
+// --------------
+// Starts a session reading from `fd`, putting it in raw mode if it's a
+// terminal.
+//
+// Returns non-zero if there's already a session.
+//
+
+GET_INPUT_API
+void
+gi_input_end(GiInput* in);
+// --------------
+// Ends the session and puts the terminal back how it was.
+//
+
+GET_INPUT_API
+int
+gi_input_read(GiInput* in);
+// --------------
+// Reads what's available (blocking if nothing is) and parses it into
+// events.
+//
+// Returns -1 at end of input or on an error, 0 otherwise.
+//
+
+GET_INPUT_API
+int
+gi_input_next(GiInput* in, GiEvent* event);
+// --------------
+// Takes the next event.
+//
+// Returns non-zero if there isn't one.
+//
+
+GET_INPUT_API
+int
+gi_input_timeout(const GiInput* in);
+// --------------
+// Returns how many milliseconds to wait for the rest of a sequence before
+// calling `gi_input_expire`, -1 if there's nothing waiting.
+//
+
+GET_INPUT_API
+void
+gi_input_expire(GiInput* in);
+// --------------
+// Gives up waiting for the rest of a sequence: an ESC on its own is the
+// Escape key, and the rest is parsed as what it is.
+//
+
 #ifdef __clang__
 #pragma clang assume_nonnull end
 #endif
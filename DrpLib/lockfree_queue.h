@@ -0,0 +1,291 @@
+#ifndef LOCKFREE_QUEUE_H
+#define LOCKFREE_QUEUE_H
+// lockfree_queue.h
+// ----------------
+// Bounded lock-free queues of pointers, for handing work between threads.
+//
+//   SpscRing: one producer thread and one consumer thread. Each side keeps
+//   its own index and a cached copy of the other's, so most operations don't
+//   touch the other side's cache line at all.
+//
+//   MpmcQueue: any number of producers and consumers. Each slot has a
+//   sequence number that says whose turn it is, a thread claims a slot with
+//   a compare and swap on the position (Dmitry Vyukov's bounded queue).
+//
+// Capacities are rounded up to a power of two. Pushing to a full queue or
+// popping an empty one fails straight away rather than waiting. NULL can't
+// be pushed, popping returns it for empty.
+//
+// To sleep until there's something in a queue, pair it with a QueueNotify:
+// a file descriptor (an eventfd on linux, a pipe elsewhere) that becomes
+// readable when signalled, so it can go in a poll() with everything else.
+// Signals that arrive before the consumer has cleared it are coalesced into
+// one write.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {LOCKFREE_CACHE_LINE = 64};
+
+static inline
+size_t
+lockfree_round_capacity(size_t capacity){
+    size_t cap = 2;
+    while(cap < capacity) cap *= 2;
+    return cap;
+}
+
+typedef struct SpscRing SpscRing;
+struct SpscRing {
+    void*_Nullable*_Nullable items;
+    size_t mask;
+    // The consumer's.
+    _Alignas(LOCKFREE_CACHE_LINE) atomic_size_t head;
+    size_t cached_tail;
+    // The producer's.
+    _Alignas(LOCKFREE_CACHE_LINE) atomic_size_t tail;
+    size_t cached_head;
+};
+
+//
+// Returns non-zero if it can't be allocated.
+//
+static inline
+int
+spsc_init(SpscRing* r, size_t capacity){
+    size_t cap = lockfree_round_capacity(capacity);
+    r->items = calloc(cap, sizeof *r->items);
+    if(!r->items) return 1;
+    r->mask = cap - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->cached_head = r->cached_tail = 0;
+    return 0;
+}
+
+static inline
+void
+spsc_destroy(SpscRing* r){
+    free(r->items);
+    r->items = NULL;
+}
+
+//
+// Only from the producer.
+// Returns non-zero if it's full.
+//
+static inline
+int
+spsc_push(SpscRing* r, void* item){
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if(tail - r->cached_head > r->mask){
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if(tail - r->cached_head > r->mask) return 1;
+    }
+    r->items[tail & r->mask] = item;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+//
+// Only from the consumer.
+// Returns NULL if it's empty.
+//
+static inline
+void*_Nullable
+spsc_pop(SpscRing* r){
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if(head == r->cached_tail){
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if(head == r->cached_tail) return NULL;
+    }
+    void* item = r->items[head & r->mask];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return item;
+}
+
+typedef struct MpmcCell MpmcCell;
+struct MpmcCell {
+    // pos when it's free for the push at pos, pos+1 once that push is done
+    // and it's the pop at pos's turn.
+    atomic_size_t seq;
+    void*_Nullable item;
+};
+
+typedef struct MpmcQueue MpmcQueue;
+struct MpmcQueue {
+    MpmcCell*_Nullable cells;
+    size_t mask;
+    _Alignas(LOCKFREE_CACHE_LINE) atomic_size_t push_pos;
+    _Alignas(LOCKFREE_CACHE_LINE) atomic_size_t pop_pos;
+};
+
+//
+// Returns non-zero if it can't be allocated.
+//
+static inline
+int
+mpmc_init(MpmcQueue* q, size_t capacity){
+    size_t cap = lockfree_round_capacity(capacity);
+    q->cells = malloc(cap * sizeof *q->cells);
+    if(!q->cells) return 1;
+    for(size_t i = 0; i < cap; i++){
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].item = NULL;
+    }
+    q->mask = cap - 1;
+    atomic_init(&q->push_pos, 0);
+    atomic_init(&q->pop_pos, 0);
+    return 0;
+}
+
+static inline
+void
+mpmc_destroy(MpmcQueue* q){
+    free(q->cells);
+    q->cells = NULL;
+}
+
+//
+// Returns non-zero if it's full.
+//
+static inline
+int
+mpmc_push(MpmcQueue* q, void* item){
+    size_t pos = atomic_load_explicit(&q->push_pos, memory_order_relaxed);
+    MpmcCell* cell;
+    for(;;){
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(!diff){
+            if(atomic_compare_exchange_weak_explicit(&q->push_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        // The pop from a lap ago hasn't happened.
+        else if(diff < 0)
+            return 1;
+        else
+            pos = atomic_load_explicit(&q->push_pos, memory_order_relaxed);
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+//
+// Returns NULL if it's empty.
+//
+static inline
+void*_Nullable
+mpmc_pop(MpmcQueue* q){
+    size_t pos = atomic_load_explicit(&q->pop_pos, memory_order_relaxed);
+    MpmcCell* cell;
+    for(;;){
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(!diff){
+            if(atomic_compare_exchange_weak_explicit(&q->pop_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        // Nothing pushed here yet.
+        else if(diff < 0)
+            return NULL;
+        else
+            pos = atomic_load_explicit(&q->pop_pos, memory_order_relaxed);
+    }
+    void* item = cell->item;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return item;
+}
+
+typedef struct QueueNotify QueueNotify;
+struct QueueNotify {
+    // Poll this one for reading.
+    int fd;
+    // The same as fd for an eventfd.
+    int write_fd;
+    // Signalled and not cleared since.
+    atomic_bool pending;
+};
+
+//
+// Returns non-zero if there's no fd to be had.
+//
+static inline
+int
+queue_notify_init(QueueNotify* n){
+    atomic_init(&n->pending, 0);
+    #if defined(__linux__)
+    n->fd = n->write_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(n->fd >= 0) return 0;
+    #endif
+    int fds[2];
+    if(pipe(fds) != 0) return 1;
+    for(int i = 0; i < 2; i++){
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    n->fd = fds[0];
+    n->write_fd = fds[1];
+    return 0;
+}
+
+static inline
+void
+queue_notify_destroy(QueueNotify* n){
+    if(n->write_fd != n->fd) close(n->write_fd);
+    close(n->fd);
+    n->fd = n->write_fd = -1;
+}
+
+//
+// Makes the fd readable, after pushing whatever it's about. Any thread.
+//
+static inline
+void
+queue_notify_signal(QueueNotify* n){
+    if(atomic_exchange(&n->pending, 1)) return;
+    uint64_t one = 1;
+    // Full or interrupted both mean it's readable already, or nearly.
+    ssize_t w = write(n->write_fd, &one, n->write_fd == n->fd? sizeof one : 1);
+    (void)w;
+}
+
+//
+// Makes the fd unreadable again, before popping what it was about. Only
+// from the consumer.
+//
+static inline
+void
+queue_notify_clear(QueueNotify* n){
+    char buff[64];
+    while(read(n->fd, buff, n->write_fd == n->fd? sizeof(uint64_t) : sizeof buff) > 0)
+        ;
+    // Only after draining, or a signal from in between would be drained
+    // with pending left set, and nothing would signal again. Anything
+    // pushed before this is popped after it anyway.
+    atomic_store(&n->pending, 0);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -20,6 +20,12 @@ typedef struct TermSize {
 //
 static inline TermSize get_terminal_size(void);
 
+//
+// Like `get_terminal_size`, but if the pixel size of the terminal is
+// unavailable it is estimated using the given cell size instead of 8x16.
+//
+static inline TermSize get_terminal_size_cell(int cell_width, int cell_height);
+
 #ifdef _WIN32
 
 #include <io.h>
@@ -39,21 +45,21 @@ int isatty(int fd){
 #include "windowsheader.h"
 static inline
 TermSize
-get_terminal_size(void){
+get_terminal_size_cell(int cell_width, int cell_height){
     CONSOLE_SCREEN_BUFFER_INFO csbi;
     BOOL success = GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
     if(success){
         int columns = csbi.srWindow.Right - csbi.srWindow.Left + 1;
         int rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-        return (TermSize){columns, rows};
+        return (TermSize){columns, rows, columns*cell_width, rows*cell_height};
     }
-    return (TermSize){80, 24};
+    return (TermSize){80, 24, 80*cell_width, 24*cell_height};
 }
 #elif defined(WASM)
 static inline
 TermSize
-get_terminal_size(void){
-    return (TermSize){80, 24};
+get_terminal_size_cell(int cell_width, int cell_height){
+    return (TermSize){80, 24, 80*cell_width, 24*cell_height};
 }
 #else
 #include <unistd.h>
@@ -61,8 +67,8 @@ get_terminal_size(void){
 
 static inline
 TermSize
-get_terminal_size(void){
-    struct TermSize result = {80,24, 80*8, 24*16};
+get_terminal_size_cell(int cell_width, int cell_height){
+    struct TermSize result = {80,24, 80*cell_width, 24*cell_height};
     struct winsize w;
     int err = ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
     if(err == -1){
@@ -78,15 +84,15 @@ get_terminal_size(void){
         int rows = atoi(rows_s);
         if(!rows)
             goto err;
-        result = (TermSize){cols, rows, 8*cols, 16*rows};
+        result = (TermSize){cols, rows, cell_width*cols, cell_height*rows};
     }
     else {
         if(!w.ws_col || !w.ws_row)
             goto err;
-        if(w.ws_xpixel == 65535){
-            // assume invalid (ssh?)
-            w.ws_xpixel = w.ws_col * 8;
-            w.ws_ypixel = w.ws_row * 16;
+        if(w.ws_xpixel == 65535 || !w.ws_xpixel || !w.ws_ypixel){
+            // assume invalid (ssh?), or the terminal doesn't report it.
+            w.ws_xpixel = w.ws_col * cell_width;
+            w.ws_ypixel = w.ws_row * cell_height;
         }
         result = (TermSize){w.ws_col, w.ws_row, w.ws_xpixel, w.ws_ypixel};
     }
@@ -95,5 +101,11 @@ get_terminal_size(void){
 }
 #endif
 
+static inline
+TermSize
+get_terminal_size(void){
+    return get_terminal_size_cell(8, 16);
+}
+
 
 #endif
@@ -0,0 +1,291 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+// daemon.h
+// --------
+// The wire protocol between `imgpgr --client` and `imgpgr --daemon`.
+//
+// The client connects to a unix socket and sends one DaemonRequest followed
+// by the path of the file to show, passing its own stdout along as
+// SCM_RIGHTS. The daemon draws into that fd and replies with a single byte,
+// 0 if the image was shown. The client waits for the reply so whatever
+// spawned it doesn't draw over the image.
+//
+// Client and daemon are the same binary, so the request is just the struct.
+//
+// Both ends check the other is running as the same user before trusting
+// it: the daemon opens whatever files it's asked to, and the client hands
+// over its terminal. Without $XDG_RUNTIME_DIR the socket goes in a 0700
+// directory of our own under /tmp, never straight into /tmp.
+//
+// A client can ask for the image to go in a pane of its terminal (a file
+// manager's preview), in which case nothing outside it is touched.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum {DAEMON_MAGIC = 0x69706764}; // "ipgd"
+
+typedef struct DaemonRequest DaemonRequest;
+struct DaemonRequest {
+    uint32_t magic;
+    uint32_t struct_size;
+    // A BackendKind.
+    int32_t backend;
+    int32_t cell_width, cell_height;
+    int32_t width, height;
+    double scale;
+    uint8_t auto_width, auto_height, auto_scale;
+    uint8_t placeholders;
+    // A Multiplexer.
+    uint8_t mux;
+    // Where to draw, in cells from the top left. 0 columns is the whole
+    // screen.
+    int32_t pane_x, pane_y, pane_cols, pane_rows;
+    // Identifies the terminal the client is in. Images the daemon left in
+    // one terminal can't be reused in another.
+    char term_key[256];
+    uint32_t path_length;
+};
+
+//
+// Where the daemon listens if not told otherwise:
+// $XDG_RUNTIME_DIR/imgpgr.sock, or /tmp/imgpgr-$UID/sock. If `create` is
+// set the directory in /tmp is made if it isn't there, and either way it
+// has to be ours and private.
+// Returns non-zero if it doesn't fit or the directory won't do.
+//
+static inline
+int
+daemon_socket_path(char* buff, size_t bufflen, _Bool create){
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if(dir && *dir)
+        n = snprintf(buff, bufflen, "%s/imgpgr.sock", dir);
+    else {
+        n = snprintf(buff, bufflen, "/tmp/imgpgr-%d", (int)getuid());
+        if(n < 0 || (size_t)n >= bufflen) goto too_long;
+        if(create && mkdir(buff, 0700) != 0 && errno != EEXIST) return 1;
+        // Anyone could have made it first, so check what's there rather
+        // than trusting what we meant to make.
+        struct stat st;
+        if(lstat(buff, &st) == 0){
+            if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)){
+                errno = EPERM;
+                return 1;
+            }
+        }
+        else if(create)
+            return 1;
+        n += snprintf(buff+n, bufflen-(size_t)n, "/sock");
+    }
+    if(n < 0 || (size_t)n >= bufflen) goto too_long;
+    return 0;
+
+    too_long:
+    errno = ENAMETOOLONG;
+    return 1;
+}
+
+//
+// Returns non-zero unless whoever is at the other end of `sock` is running
+// as us.
+//
+static inline
+int
+daemon_check_peer(int sock){
+    #ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) return 1;
+    return cred.uid != getuid();
+    #else
+    uid_t uid;
+    gid_t gid;
+    if(getpeereid(sock, &uid, &gid) != 0) return 1;
+    return uid != getuid();
+    #endif
+}
+
+static inline
+int
+daemon_fill_addr(struct sockaddr_un* addr, const char* path){
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    size_t len = strlen(path);
+    if(len >= sizeof addr->sun_path) return 1;
+    memcpy(addr->sun_path, path, len);
+    return 0;
+}
+
+static inline
+int
+daemon_connect(const char* path){
+    struct sockaddr_un addr;
+    if(daemon_fill_addr(&addr, path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof addr)){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// Creates the listening socket. If something is already there, it's only
+// replaced if it's a socket of ours nobody is listening on, what's left
+// after a daemon died.
+// Returns the fd or -1.
+//
+static inline
+int
+daemon_listen(const char* path){
+    struct sockaddr_un addr;
+    if(daemon_fill_addr(&addr, path)) return -1;
+    int running = daemon_connect(path);
+    if(running >= 0){
+        close(running);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    struct stat st;
+    if(lstat(path, &st) == 0){
+        if(!S_ISSOCK(st.st_mode) || st.st_uid != getuid()){
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    // Only we get to ask the daemon to open files.
+    mode_t old = umask(0077);
+    int err = bind(fd, (struct sockaddr*)&addr, sizeof addr);
+    umask(old);
+    if(err || listen(fd, 16)){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline
+int
+daemon_write_all(int fd, const void* data, size_t len){
+    const char* p = data;
+    while(len){
+        ssize_t n = write(fd, p, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static inline
+int
+daemon_read_all(int fd, void* data, size_t len){
+    char* p = data;
+    while(len){
+        ssize_t n = read(fd, p, len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+//
+// Sends the request and path, with `tty` attached.
+// Returns non-zero on failure.
+//
+static inline
+int
+daemon_send_request(int sock, const DaemonRequest* req, const char* path, int tty){
+    struct iovec iov = {.iov_base = (void*)req, .iov_len = sizeof *req};
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof control);
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buff,
+        .msg_controllen = sizeof control.buff,
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &tty, sizeof tty);
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, 0);
+    }while(n < 0 && errno == EINTR);
+    if(n < 0) return 1;
+    if((size_t)n < sizeof *req && daemon_write_all(sock, (const char*)req+n, sizeof *req - (size_t)n))
+        return 1;
+    return daemon_write_all(sock, path, req->path_length);
+}
+
+//
+// Receives a request. On success, *tty is the client's terminal (owned by
+// the caller) and *path a malloced, nul-terminated path.
+// Returns non-zero on failure or a malformed request.
+//
+static inline
+int
+daemon_recv_request(int sock, DaemonRequest* req, char** path, int* tty){
+    *tty = -1;
+    *path = NULL;
+    struct iovec iov = {.iov_base = req, .iov_len = sizeof *req};
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buff,
+        .msg_controllen = sizeof control.buff,
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, 0);
+    }while(n < 0 && errno == EINTR);
+    if(n <= 0) return 1;
+    for(struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(tty, CMSG_DATA(c), sizeof *tty);
+    }
+    if((size_t)n < sizeof *req && daemon_read_all(sock, (char*)req+n, sizeof *req - (size_t)n))
+        goto fail;
+    if(req->magic != DAEMON_MAGIC || req->struct_size != sizeof *req) goto fail;
+    if(*tty < 0 || !req->path_length || req->path_length > 4096) goto fail;
+    req->term_key[sizeof req->term_key - 1] = 0;
+    *path = malloc(req->path_length+1);
+    if(!*path) goto fail;
+    if(daemon_read_all(sock, *path, req->path_length)) goto fail;
+    (*path)[req->path_length] = 0;
+    if(strlen(*path) != req->path_length) goto fail;
+    return 0;
+    fail:
+    free(*path);
+    *path = NULL;
+    if(*tty >= 0) close(*tty);
+    *tty = -1;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+// eventloop.h
+// -----------
+// Waits for whichever of these happens first:
+//
+//   - input on stdin
+//   - the terminal being resized (SIGWINCH)
+//   - a worker finishing something (a QueueNotify's fd)
+//   - the terminal being ready for more output, while there's some queued
+//   - memory getting tight (a PSI trigger's fd, see mempressure.h)
+//
+// On linux SIGWINCH is read from a signalfd. That only works if no thread
+// can take the signal first, so loop_init blocks it and has to be called
+// before any threads are started (they inherit the mask). Elsewhere a
+// handler writes to a pipe.
+//
+// It's poll(): with at most five fds epoll would cost more to set up than
+// it saves, and poll works on macos too.
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {
+    LOOP_INPUT    = 1,
+    LOOP_RESIZE   = 2,
+    LOOP_WORKER   = 4,
+    LOOP_WRITABLE = 8,
+    LOOP_PRESSURE = 16,
+};
+
+typedef struct EventLoop EventLoop;
+struct EventLoop {
+    int input_fd;
+    // -1 if resizes can't be watched.
+    int resize_fd;
+    // Set after loop_init, -1 for none.
+    int worker_fd, output_fd, pressure_fd;
+};
+
+#if !defined(__linux__)
+static int loop_resize_pipe[2] = {-1, -1};
+
+static inline
+void
+loop_on_resize(int sig){
+    (void)sig;
+    int saved = errno;
+    char c = 0;
+    ssize_t w = write(loop_resize_pipe[1], &c, 1);
+    (void)w;
+    errno = saved;
+}
+#endif
+
+//
+// Starts watching for resizes. Call before starting any threads.
+// Returns non-zero if resizes can't be watched, the rest still works.
+//
+static inline
+int
+loop_init(EventLoop* l, int input_fd){
+    *l = (EventLoop){
+        .input_fd = input_fd,
+        .resize_fd = -1,
+        .worker_fd = -1,
+        .output_fd = -1,
+        .pressure_fd = -1,
+    };
+    #if defined(__linux__)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) return 1;
+    l->resize_fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if(l->resize_fd < 0){
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+        return 1;
+    }
+    #else
+    if(pipe(loop_resize_pipe) != 0) return 1;
+    for(int i = 0; i < 2; i++){
+        fcntl(loop_resize_pipe[i], F_SETFL, fcntl(loop_resize_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(loop_resize_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    struct sigaction sa = {.sa_handler = loop_on_resize, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+    l->resize_fd = loop_resize_pipe[0];
+    #endif
+    return 0;
+}
+
+// Reads whatever says a resize happened, several count as one.
+static inline
+void
+loop_drain_resize(EventLoop* l){
+    #if defined(__linux__)
+    struct signalfd_siginfo info[4];
+    #else
+    char info[64];
+    #endif
+    while(read(l->resize_fd, info, sizeof info) > 0)
+        ;
+}
+
+// The sooner of two timeouts for loop_wait, -1 being never.
+static inline
+int
+loop_sooner(int a, int b){
+    if(a < 0) return b;
+    if(b < 0) return a;
+    return a < b? a : b;
+}
+
+//
+// Waits up to `timeout_ms` (-1 for no limit) for something to happen, and
+// for output_fd to be writable too if `writing`. Resizes are dealt with
+// here, the worker's fd is left for the caller to clear.
+// A pressure trigger that fires needs nothing cleared, it fires again after
+// the next window.
+// Returns which of the LOOP_* happened, 0 on timeout or a signal.
+//
+static inline
+unsigned
+loop_wait(EventLoop* l, _Bool writing, int timeout_ms){
+    struct pollfd pfds[5];
+    unsigned kinds[5];
+    nfds_t n = 0;
+    pfds[n] = (struct pollfd){.fd = l->input_fd, .events = POLLIN};
+    kinds[n++] = LOOP_INPUT;
+    if(l->resize_fd >= 0){
+        pfds[n] = (struct pollfd){.fd = l->resize_fd, .events = POLLIN};
+        kinds[n++] = LOOP_RESIZE;
+    }
+    if(l->worker_fd >= 0){
+        pfds[n] = (struct pollfd){.fd = l->worker_fd, .events = POLLIN};
+        kinds[n++] = LOOP_WORKER;
+    }
+    if(writing && l->output_fd >= 0){
+        pfds[n] = (struct pollfd){.fd = l->output_fd, .events = POLLOUT};
+        kinds[n++] = LOOP_WRITABLE;
+    }
+    if(l->pressure_fd >= 0){
+        pfds[n] = (struct pollfd){.fd = l->pressure_fd, .events = POLLPRI};
+        kinds[n++] = LOOP_PRESSURE;
+    }
+    if(poll(pfds, n, timeout_ms) <= 0) return 0;
+    unsigned happened = 0;
+    for(nfds_t i = 0; i < n; i++){
+        if(kinds[i] == LOOP_PRESSURE && pfds[i].revents & (POLLERR|POLLNVAL)){
+            // Nobody reads it to find out, and it would wake every poll.
+            close(l->pressure_fd);
+            l->pressure_fd = -1;
+            continue;
+        }
+        // Errors and hangups are for whoever reads or writes it to find out.
+        if(pfds[i].revents)
+            happened |= kinds[i];
+    }
+    if(happened & LOOP_RESIZE)
+        loop_drain_resize(l);
+    return happened;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
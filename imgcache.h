@@ -0,0 +1,247 @@
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+// imgcache.h
+// ----------
+// Keeps decoded (and resized) images around so showing one again doesn't
+// need the file decoded again.
+//
+// Entries are keyed by the file's path, its size and mtime (so a file that
+// changed on disk isn't served stale) and the size it was resized to.
+// The least recently used entries are evicted once the cache holds more
+// than its budget in bytes.
+//
+// The data doesn't have to be pixels, `variant` distinguishes other things
+// derived from the same image at the same size (like the escape sequences
+// for showing it).
+//
+// Evicted buffers are big and malloc often keeps them on its heap rather
+// than unmapping them, so their pages are marked MADV_FREE before freeing.
+// The kernel takes them back when it needs to instead of us holding on to
+// memory that only looks used.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+typedef struct ImgCacheKey ImgCacheKey;
+struct ImgCacheKey {
+    const char* path;
+    size_t path_length;
+    // Of the file.
+    int64_t file_size, mtime_ns;
+    // What it was resized to.
+    int w, h;
+    // 0 for decoded pixels.
+    uint32_t variant;
+};
+
+typedef struct ImgCacheEntry ImgCacheEntry;
+struct ImgCacheEntry {
+    uint64_t hash;
+    char* path;
+    size_t path_length;
+    int64_t file_size, mtime_ns;
+    int w, h;
+    uint32_t variant;
+    // Channels, if it's pixels.
+    int n;
+    uint8_t*_Nullable pixels;
+    size_t size;
+    uint64_t last_used;
+};
+
+typedef struct ImgCache ImgCache;
+struct ImgCache {
+    ImgCacheEntry* entries;
+    size_t count, capacity;
+    // Bytes held.
+    size_t bytes;
+    // Evict down to this many bytes.
+    size_t budget;
+    uint64_t clock;
+    // For seeing if the cache is doing anything.
+    size_t hits, misses;
+    // Called with entries evicted to make room. It can take the data by
+    // setting e->pixels to NULL.
+    void (*_Nullable evicted)(void*_Nullable ctx, ImgCacheEntry* e);
+    void*_Nullable evicted_ctx;
+};
+
+static inline
+uint64_t
+imgcache_hash(const ImgCacheKey* key){
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < key->path_length; i++){
+        h ^= (unsigned char)key->path[i];
+        h *= 0x100000001b3ull;
+    }
+    uint64_t rest[4] = {(uint64_t)key->file_size, (uint64_t)key->mtime_ns, (uint64_t)(uint32_t)key->w << 32 | (uint32_t)key->h, key->variant};
+    for(int i = 0; i < 4; i++){
+        h ^= rest[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static inline
+_Bool
+imgcache_matches(const ImgCacheEntry* e, uint64_t hash, const ImgCacheKey* key){
+    return e->hash == hash
+        && e->w == key->w && e->h == key->h && e->variant == key->variant
+        && e->file_size == key->file_size && e->mtime_ns == key->mtime_ns
+        && e->path_length == key->path_length
+        && !memcmp(e->path, key->path, key->path_length);
+}
+
+//
+// Looks up an image. The returned entry's pixels stay valid until the next
+// `imgcache_put`.
+// Returns NULL if it isn't cached.
+//
+static inline
+const ImgCacheEntry*_Nullable
+imgcache_get(ImgCache* cache, const ImgCacheKey* key){
+    uint64_t hash = imgcache_hash(key);
+    for(size_t i = 0; i < cache->count; i++){
+        ImgCacheEntry* e = &cache->entries[i];
+        if(!imgcache_matches(e, hash, key)) continue;
+        e->last_used = ++cache->clock;
+        cache->hits++;
+        return e;
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// Like `imgcache_get`, but doesn't count as a use.
+static inline
+_Bool
+imgcache_contains(const ImgCache* cache, const ImgCacheKey* key){
+    uint64_t hash = imgcache_hash(key);
+    for(size_t i = 0; i < cache->count; i++)
+        if(imgcache_matches(&cache->entries[i], hash, key)) return 1;
+    return 0;
+}
+
+//
+// Frees a buffer, first letting the kernel reclaim the whole pages in it.
+//
+static inline
+void
+imgcache_release(void*_Nullable p, size_t size){
+    if(!p) return;
+    #ifdef MADV_FREE
+    static size_t page;
+    if(!page){
+        long ps = sysconf(_SC_PAGESIZE);
+        page = ps > 0? (size_t)ps : 4096;
+    }
+    if(size >= 16*page){
+        uintptr_t begin = ((uintptr_t)p + page - 1) & ~(uintptr_t)(page-1);
+        uintptr_t end = ((uintptr_t)p + size) & ~(uintptr_t)(page-1);
+        if(end > begin)
+            madvise((void*)begin, end - begin, MADV_FREE);
+    }
+    #endif
+    free(p);
+}
+
+static inline
+void
+imgcache_remove_at(ImgCache* cache, size_t i){
+    ImgCacheEntry* e = &cache->entries[i];
+    cache->bytes -= e->size;
+    imgcache_release(e->pixels, e->size);
+    free(e->path);
+    cache->entries[i] = cache->entries[--cache->count];
+}
+
+//
+// Evicts the least recently used entries until the cache is within
+// `budget` bytes.
+//
+static inline
+void
+imgcache_shrink(ImgCache* cache, size_t budget){
+    while(cache->count && cache->bytes > budget){
+        size_t oldest = 0;
+        for(size_t i = 1; i < cache->count; i++)
+            if(cache->entries[i].last_used < cache->entries[oldest].last_used)
+                oldest = i;
+        if(cache->evicted) cache->evicted(cache->evicted_ctx, &cache->entries[oldest]);
+        imgcache_remove_at(cache, oldest);
+    }
+}
+
+//
+// Adds `size` bytes of data, taking ownership of it (it must be from malloc).
+// Anything bigger than the whole budget isn't kept.
+// Returns non-zero (and frees the data) if it wasn't added.
+//
+static inline
+int
+imgcache_put(ImgCache* cache, const ImgCacheKey* key, uint8_t* pixels, size_t size, int n){
+    if(size > cache->budget) goto fail;
+    uint64_t hash = imgcache_hash(key);
+    for(size_t i = 0; i < cache->count; i++){
+        if(imgcache_matches(&cache->entries[i], hash, key)){
+            imgcache_remove_at(cache, i);
+            break;
+        }
+    }
+    imgcache_shrink(cache, cache->budget - size);
+    if(cache->count == cache->capacity){
+        size_t newcap = cache->capacity? cache->capacity*2 : 32;
+        ImgCacheEntry* p = realloc(cache->entries, newcap*sizeof *p);
+        if(!p) goto fail;
+        cache->entries = p;
+        cache->capacity = newcap;
+    }
+    char* path = malloc(key->path_length+1);
+    if(!path) goto fail;
+    memcpy(path, key->path, key->path_length);
+    path[key->path_length] = 0;
+    cache->entries[cache->count++] = (ImgCacheEntry){
+        .hash = hash,
+        .path = path,
+        .path_length = key->path_length,
+        .file_size = key->file_size,
+        .mtime_ns = key->mtime_ns,
+        .w = key->w,
+        .h = key->h,
+        .variant = key->variant,
+        .n = n,
+        .pixels = pixels,
+        .size = size,
+        .last_used = ++cache->clock,
+    };
+    cache->bytes += size;
+    return 0;
+    fail:
+    free(pixels);
+    return 1;
+}
+
+static inline
+void
+imgcache_clear(ImgCache* cache){
+    while(cache->count)
+        imgcache_remove_at(cache, cache->count-1);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -1,13 +1,20 @@
 #define _DARWIN_BETTER_REALPATH 1
+// fopencookie
+#define _GNU_SOURCE 1
 #include <signal.h>
 #include "DrpLib/term_util.h"
 #include "DrpLib/argument_parsing.h"
 #include "DrpLib/file_util.h"
+#include "DrpLib/Allocators/mallocator.h"
 #include "DrpLib/long_string.h"
 #include "DrpLib/get_input.h"
 #include "DrpLib/parse_numbers.h"
 #include "DrpLib/base64.h"
+#include "DrpLib/lockfree_queue.h"
 #include <time.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
 #ifdef __ARM_NEON
 #define STBI_NEON 1
 #endif
@@ -17,110 +24,4021 @@
 #include "stb/stb_image_resize.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+#include "sixel.h"
+#include "textrender.h"
+#include "termprobe.h"
+#include "imgcache.h"
+#include "daemon.h"
+#include "payloadcache.h"
+#include "pacedwrite.h"
+#include "scheduler.h"
+#include "prefetch.h"
+#include "mempressure.h"
+#include "qoi.h"
+#include "resolve.h"
+#include "eventloop.h"
+#include "kittyack.h"
+#include "trigram.h"
 
+// Sized for the command line, each argument could be a path. The daemon
+// keeps the paths it's asked for in them too, at least DAEMON_MAX_PATHS.
+enum {DAEMON_MAX_PATHS = 1024*8};
 static
-StringView imgpaths[1024*8];
+StringView* imgpaths;
 static
-StringView realpaths[1024*8];
+StringView* realpaths;
+static
+int maxpaths = 0;
+
+static
+int npaths = 0;
+
+// realpaths are resolved in the background, and only filled in (by the
+// main thread) as they're needed.
+static PathResolver resolver;
+static ResolvedPath* resolved;
+static _Bool resolving = 0;
+
+//
+// The resolved path of image `index`, as given if it can't be resolved.
+//
+static
+StringView
+image_path(int index){
+    if(!realpaths[index].text && resolving){
+        const ResolvedPath* r = resolve_get(&resolver, index);
+        realpaths[index] = (StringView){r->length, r->path};
+    }
+    return realpaths[index];
+}
+
+// errno for what's wrong with image `index`'s path, 0 if nothing is.
+static
+int
+image_path_error(int index){
+    return resolving? resolve_get(&resolver, index)->error : 0;
+}
+
+static
+int current = 0;
+static int width = 0, height = 0;
+
+static double scale=0;
+static _Bool auto_height = 0, auto_width = 0, auto_scale = 0;
+static _Bool need_rescale = 1;
+static _Bool dither = 0;
+// Bumped whenever the display size of images may have changed.
+static int geometry_generation = 0;
+// Decoded images, already resized for display.
+static ImgCache decode_cache = {.budget = (size_t)128 << 20};
+// Ones evicted from decode_cache, compressed. Far cheaper to get back than
+// decoding the file again.
+static ImgCache compressed_cache = {.budget = (size_t)128 << 20};
+// What was written to the terminal to show them.
+static ImgCache payload_cache = {.budget = (size_t)64 << 20};
+// The most the two caches may hold between them. What they actually get
+// depends on how much memory is to spare, see `adjust_cache_budgets`.
+static size_t cache_max = (size_t)320 << 20;
+// Also keep those on disk.
+static _Bool disk_cache = 1;
+enum {DISK_CACHE_MAX = 512 << 20};
+// Running as a daemon and drawing for a client.
+static _Bool serving = 0;
+// Everything for the terminal is written to this, see `frame_begin`.
+static FILE* out;
+
+typedef enum BackendKind {
+    BACKEND_KITTY,
+    BACKEND_SIXEL,
+    BACKEND_BLOCKS,
+    BACKEND_BRAILLE,
+    BACKEND_ITERM,
+    BACKEND_COUNT,
+    // Pick based on what the terminal supports.
+    BACKEND_AUTO = BACKEND_COUNT,
+} BackendKind;
+
+static const StringView backend_names[BACKEND_COUNT+1] = {
+    [BACKEND_KITTY] = SVI("kitty"),
+    [BACKEND_SIXEL] = SVI("sixel"),
+    [BACKEND_BLOCKS] = SVI("blocks"),
+    [BACKEND_BRAILLE] = SVI("braille"),
+    [BACKEND_ITERM] = SVI("iterm"),
+    [BACKEND_AUTO] = SVI("auto"),
+};
+
+static BackendKind backend = BACKEND_AUTO;
+
+// Used when the pty doesn't know its size in pixels.
+static int cell_width = 8, cell_height = 16;
+
+//
+// Where images go, in cells from the top left. A client can ask for a pane
+// (a file manager's preview), otherwise it's the whole screen and `cols` is
+// 0. Nothing outside a pane is written to, there's no status line in one.
+//
+typedef struct Pane Pane;
+struct Pane {
+    int x, y, cols, rows;
+};
+static Pane pane;
+
+//
+// The size of the screen, or of the pane if there is one.
+//
+static
+TermSize
+term_size(void){
+    TermSize sz = get_terminal_size_cell(cell_width, cell_height);
+    if(!pane.cols) return sz;
+    int cw = sz.columns? sz.xpix / sz.columns : 0;
+    int ch = sz.rows? sz.ypix / sz.rows : 0;
+    if(cw <= 0) cw = cell_width;
+    if(ch <= 0) ch = cell_height;
+    return (TermSize){pane.cols, pane.rows, pane.cols*cw, pane.rows*ch};
+}
+
+//
+// Picks the fastest way to get pixels onto this terminal.
+//
+static
+BackendKind
+choose_backend(const TermCaps* caps){
+    if(caps->kitty) return BACKEND_KITTY;
+    if(caps->iterm) return BACKEND_ITERM;
+    if(caps->sixel) return BACKEND_SIXEL;
+    return BACKEND_BLOCKS;
+}
+// Send raw pixels instead of a png with the kitty backend.
+static _Bool kitty_raw = 0;
+// Ask kitty to acknowledge images, see kittyack.h.
+static _Bool kitty_acks = 0;
+
+//
+// How an image actually gets onto the terminal.
+//
+typedef struct Backend Backend;
+struct Backend {
+    // Writes (through the gfx functions) the escape sequences for showing
+    // decoded (and possibly resized) pixels. Nothing else, the output is
+    // kept to be shown again with `present`.
+    // For kitty, `id` is the image id to transmit as.
+    // Returns non-zero on failure.
+    // NULL if the output depends on what's on screen.
+    int (*_Nullable encode)(const uint8_t* pixels, int w, int h, int n, int id);
+    // Puts the output of `encode` on screen.
+    void (*_Nullable present)(const char* data, size_t length, int id, int w, int h);
+    // Displays decoded pixels, for backends without `encode`.
+    void (*_Nullable show_pixels)(const uint8_t* pixels, int w, int h, int n);
+    // Displays the file without us decoding it. w and h are 0 to show it at
+    // its native size, otherwise only given if `file_scales` is set.
+    // Returns non-zero if it couldn't, in which case we fall back to
+    // decoding and `show_pixels`.
+    // NULL if the backend always needs pixels.
+    int (*_Nullable show_file)(StringView path, int w, int h);
+    // The terminal can scale the file itself, so `show_file` can be used
+    // even when resizing.
+    _Bool file_scales;
+    // Adjusts the requested display size (in pixels) to the resolution the
+    // backend wants its pixels in. NULL if that is the same thing.
+    void (*_Nullable fit)(int* w, int* h);
+    // Called when whatever is on screen can no longer be trusted.
+    void (*_Nullable invalidate)(void);
+    // Shows the image at `index` again if the terminal still has it from
+    // earlier, without decoding or transmitting anything.
+    // Returns non-zero if it doesn't.
+    int (*_Nullable show_resident)(int index);
+};
+static const Backend backends[BACKEND_COUNT];
+
+
+static
+void
+sighandler(int sig){
+    if(sig == SIGWINCH)
+        return need_rescale = 1, (void)0;
+}
+
+// What the terminal has said about the cell size since it was last asked.
+static TermCaps resize_caps;
+
+//
+// Takes the cell size from a reply to `termcaps_request_cell_size`.
+// Returns whether it changed.
+//
+static
+_Bool
+cell_size_reply(const char* reply, size_t length){
+    termcaps_parse_replies(&resize_caps, reply, length);
+    if(resize_caps.cell_width <= 0 || resize_caps.cell_height <= 0) return 0;
+    if(resize_caps.cell_width == cell_width && resize_caps.cell_height == cell_height) return 0;
+    cell_width = resize_caps.cell_width;
+    cell_height = resize_caps.cell_height;
+    return 1;
+}
+
+static
+void rescale(void){
+    TermSize sz = term_size();
+    int old_width = width, old_height = height;
+    static int old_cellw, old_cellh;
+    int cellw = sz.columns? sz.xpix / sz.columns : 0;
+    int cellh = sz.rows? sz.ypix / sz.rows : 0;
+    if(auto_width || auto_scale) width = sz.xpix;
+    // Leave room for the status lines.
+    int status_rows = pane.cols? 0 : 2;
+    if(auto_height || auto_scale) height = sz.ypix*(sz.rows-status_rows)/sz.rows;
+    need_rescale = 0;
+    if(width != old_width || height != old_height || cellw != old_cellw || cellh != old_cellh)
+        geometry_generation++;
+    old_cellw = cellw;
+    old_cellh = cellh;
+    if(backends[backend].invalidate) backends[backend].invalidate();
+}
+
+static void begin_synchronized_update(void){ fprintf(out, "\033[?2026h"); }
+static void end_synchronized_update(void){ fprintf(out, "\033[?2026l"); }
+static
+void
+go_to_topleft(void){
+    if(pane.cols)
+        fprintf(out, "\033[%d;%dH", pane.y+1, pane.x+1);
+    else
+        fprintf(out, "\033[H");
+}
+
+// Clears the screen, or just the pane, leaving the cursor at its top left.
+static
+void
+clear_screen(void){
+    if(!pane.cols){
+        fprintf(out, "\033[2J");
+        return;
+    }
+    for(int r = 0; r < pane.rows; r++)
+        fprintf(out, "\033[%d;%dH\033[%dX", pane.y+r+1, pane.x+1, pane.cols);
+    go_to_topleft();
+}
+
+// Moves under what was just drawn, for the status. Not in a pane, where
+// there's no status and a newline at the bottom would scroll the screen.
+static
+void
+below_image(void){
+    if(!pane.cols) fprintf(out, "\n\r");
+}
+
+static
+void
+restore_buff(void){
+    end_synchronized_update();
+    fprintf(out, "\033[?1049l");
+    fflush(out);
+}
+FILE* flog = NULL;
+#define LOG(mess, ...) do { \
+    if(!flog) \
+        flog = fopen("debug.txt", "w"); \
+    fprintf(flog, "%d: " mess "\n", __LINE__,##__VA_ARGS__); \
+}while(0);
+
+static void
+show_status(void){
+    if(pane.cols) return;
+    // The index is meaningless for a client showing a single file.
+    if(!serving)
+        fprintf(out, "\033[2K%d/%d\n", current+1, npaths);
+    // Not always on a cleared screen, a longer path can be left behind.
+    fprintf(out, "%.*s\033[K\n", (int)imgpaths[current].length, imgpaths[current].text);
+}
+
+typedef enum Multiplexer {
+    MUX_NONE,
+    MUX_TMUX,
+    MUX_SCREEN,
+} Multiplexer;
+
+static Multiplexer mux = MUX_NONE;
+
+static
+Multiplexer
+detect_multiplexer(void){
+    if(getenv("TMUX")) return MUX_TMUX;
+    if(getenv("STY")) return MUX_SCREEN;
+    return MUX_NONE;
+}
+
+//
+// Graphics escapes are written with these so that inside tmux they get
+// wrapped in a DCS passthrough (with the escapes doubled) and reach the
+// real terminal.
+//
+// Every DCS is something tmux has to buffer and parse, so rather than wrap
+// each kitty chunk separately, whole commands are batched into one DCS until
+// it reaches TMUX_DCS_BATCH. It is only closed on a command boundary, as tmux
+// can write its own output between two passthroughs. Nothing big goes out as
+// one command (kitty chunks and OSC 1337 parts are 4096 bytes of base64), so
+// the last one can't take it past the TMUX_DCS_LIMIT tmux will pass through.
+//
+// Call `gfx_end()` before writing ordinary text.
+//
+// Between `gfx_begin_capture()` and `gfx_end_capture()` the output goes into
+// a buffer instead of `out`, so it can be kept and written again later.
+// The state is per thread.
+//
+enum {TMUX_DCS_LIMIT = 64*1024, TMUX_DCS_BATCH = TMUX_DCS_LIMIT - 8*1024};
+static _Thread_local _Bool gfx_in_dcs = 0;
+static _Thread_local size_t gfx_dcs_len = 0;
+static _Thread_local PayloadBuffer*_Nullable gfx_sink = NULL;
+static _Thread_local _Bool gfx_sink_failed = 0;
+
+static
+void
+gfx_raw(const char* data, size_t len){
+    if(gfx_sink){
+        if(payload_append(gfx_sink, data, len))
+            gfx_sink_failed = 1;
+    }
+    else
+        fwrite(data, len, 1, out);
+}
+
+static
+void
+gfx_write(const char* data, size_t len){
+    if(mux != MUX_TMUX){
+        gfx_raw(data, len);
+        return;
+    }
+    if(!gfx_in_dcs){
+        gfx_raw("\033Ptmux;", 7);
+        gfx_in_dcs = 1;
+        gfx_dcs_len = 0;
+    }
+    gfx_dcs_len += len;
+    while(len){
+        const char* esc = memchr(data, '\033', len);
+        size_t run = esc? (size_t)(esc - data) + 1 : len;
+        gfx_raw(data, run);
+        if(esc) gfx_raw("\033", 1);
+        data += run;
+        len -= run;
+    }
+}
+
+#ifdef __GNUC__
+__attribute__((format(printf, 1, 2)))
+#endif
+static
+void
+gfx_printf(const char* fmt, ...){
+    char buff[512];
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(buff, sizeof buff, fmt, va);
+    va_end(va);
+    if(n < 0) return;
+    if((size_t)n >= sizeof buff) n = sizeof buff - 1;
+    gfx_write(buff, (size_t)n);
+}
+
+// Marks the end of a complete escape sequence.
+static
+void
+gfx_command_done(void){
+    if(gfx_in_dcs && gfx_dcs_len >= TMUX_DCS_BATCH){
+        gfx_raw("\033\\", 2);
+        gfx_in_dcs = 0;
+    }
+}
+
+static
+void
+gfx_end(void){
+    if(gfx_in_dcs){
+        gfx_raw("\033\\", 2);
+        gfx_in_dcs = 0;
+    }
+}
+
+static
+void
+gfx_begin_capture(PayloadBuffer* buf){
+    gfx_end();
+    gfx_sink = buf;
+    gfx_sink_failed = 0;
+}
+
+//
+// Stops capturing, leaving the buffer as a complete sequence.
+// Returns non-zero if the buffer couldn't hold it all.
+//
+static
+int
+gfx_end_capture(void){
+    gfx_end();
+    gfx_sink = NULL;
+    return gfx_sink_failed;
+}
+
+// Place kitty images with unicode placeholders (U=1) instead of directly.
+// Placeholders are ordinary text, so they survive a multiplexer redrawing
+// the pane.
+static _Bool use_placeholders = 0;
+
+//
+// Diacritics that encode row and column numbers for unicode placeholders,
+// all of kitty's rowcolumn-diacritics.txt.
+//
+static const uint32_t kitty_diacritics[] = {
+    0x0305, 0x030D, 0x030E, 0x0310, 0x0312, 0x033D, 0x033E, 0x033F,
+    0x0346, 0x034A, 0x034B, 0x034C, 0x0350, 0x0351, 0x0352, 0x0357,
+    0x035B, 0x0363, 0x0364, 0x0365, 0x0366, 0x0367, 0x0368, 0x0369,
+    0x036A, 0x036B, 0x036C, 0x036D, 0x036E, 0x036F, 0x0483, 0x0484,
+    0x0485, 0x0486, 0x0487, 0x0592, 0x0593, 0x0594, 0x0595, 0x0597,
+    0x0598, 0x0599, 0x059C, 0x059D, 0x059E, 0x059F, 0x05A0, 0x05A1,
+    0x05A8, 0x05A9, 0x05AB, 0x05AC, 0x05AF, 0x05C4, 0x0610, 0x0611,
+    0x0612, 0x0613, 0x0614, 0x0615, 0x0616, 0x0617, 0x0657, 0x0658,
+    0x0659, 0x065A, 0x065B, 0x065D, 0x065E, 0x06D6, 0x06D7, 0x06D8,
+    0x06D9, 0x06DA, 0x06DB, 0x06DC, 0x06DF, 0x06E0, 0x06E1, 0x06E2,
+    0x06E4, 0x06E7, 0x06E8, 0x06EB, 0x06EC, 0x0730, 0x0732, 0x0733,
+    0x0735, 0x0736, 0x073A, 0x073D, 0x073F, 0x0740, 0x0741, 0x0743,
+    0x0745, 0x0747, 0x0749, 0x074A, 0x07EB, 0x07EC, 0x07ED, 0x07EE,
+    0x07EF, 0x07F0, 0x07F1, 0x07F3, 0x0816, 0x0817, 0x0818, 0x0819,
+    0x081B, 0x081C, 0x081D, 0x081E, 0x081F, 0x0820, 0x0821, 0x0822,
+    0x0823, 0x0825, 0x0826, 0x0827, 0x0829, 0x082A, 0x082B, 0x082C,
+    0x082D, 0x0951, 0x0953, 0x0954, 0x0F82, 0x0F83, 0x0F86, 0x0F87,
+    0x135D, 0x135E, 0x135F, 0x17DD, 0x193A, 0x1A17, 0x1A75, 0x1A76,
+    0x1A77, 0x1A78, 0x1A79, 0x1A7A, 0x1A7B, 0x1A7C, 0x1B6B, 0x1B6D,
+    0x1B6E, 0x1B6F, 0x1B70, 0x1B71, 0x1B72, 0x1B73, 0x1CD0, 0x1CD1,
+    0x1CD2, 0x1CDA, 0x1CDB, 0x1CE0, 0x1DC0, 0x1DC1, 0x1DC3, 0x1DC4,
+    0x1DC5, 0x1DC6, 0x1DC7, 0x1DC8, 0x1DC9, 0x1DCB, 0x1DCC, 0x1DD1,
+    0x1DD2, 0x1DD3, 0x1DD4, 0x1DD5, 0x1DD6, 0x1DD7, 0x1DD8, 0x1DD9,
+    0x1DDA, 0x1DDB, 0x1DDC, 0x1DDD, 0x1DDE, 0x1DDF, 0x1DE0, 0x1DE1,
+    0x1DE2, 0x1DE3, 0x1DE4, 0x1DE5, 0x1DE6, 0x1DFE, 0x20D0, 0x20D1,
+    0x20D4, 0x20D5, 0x20D6, 0x20D7, 0x20DB, 0x20DC, 0x20E1, 0x20E7,
+    0x20E9, 0x20F0, 0x2CEF, 0x2CF0, 0x2CF1, 0x2DE0, 0x2DE1, 0x2DE2,
+    0x2DE3, 0x2DE4, 0x2DE5, 0x2DE6, 0x2DE7, 0x2DE8, 0x2DE9, 0x2DEA,
+    0x2DEB, 0x2DEC, 0x2DED, 0x2DEE, 0x2DEF, 0x2DF0, 0x2DF1, 0x2DF2,
+    0x2DF3, 0x2DF4, 0x2DF5, 0x2DF6, 0x2DF7, 0x2DF8, 0x2DF9, 0x2DFA,
+    0x2DFB, 0x2DFC, 0x2DFD, 0x2DFE, 0x2DFF, 0xA66F, 0xA67C, 0xA67D,
+    0xA6F0, 0xA6F1, 0xA8E0, 0xA8E1, 0xA8E2, 0xA8E3, 0xA8E4, 0xA8E5,
+    0xA8E6, 0xA8E7, 0xA8E8, 0xA8E9, 0xA8EA, 0xA8EB, 0xA8EC, 0xA8ED,
+    0xA8EE, 0xA8EF, 0xA8F0, 0xA8F1, 0xAAB0, 0xAAB2, 0xAAB3, 0xAAB7,
+    0xAAB8, 0xAABE, 0xAABF, 0xAAC1, 0xFE20, 0xFE21, 0xFE22, 0xFE23,
+    0xFE24, 0xFE25, 0xFE26, 0x10A0F, 0x10A38, 0x1D185, 0x1D186, 0x1D187,
+    0x1D188, 0x1D189, 0x1D1AA, 0x1D1AB, 0x1D1AC, 0x1D1AD, 0x1D242, 0x1D243,
+    0x1D244,
+};
+
+// The number of cells an image of w by h pixels covers.
+static
+void
+cell_extent(int w, int h, int* cols, int* rows){
+    TermSize sz = term_size();
+    int cw = sz.columns? sz.xpix / sz.columns : 0;
+    int ch = sz.rows? sz.ypix / sz.rows : 0;
+    if(cw <= 0) cw = cell_width;
+    if(ch <= 0) ch = cell_height;
+    *cols = (w + cw - 1) / cw;
+    *rows = (h + ch - 1) / ch;
+    // There are only so many diacritics to number cells with. Shrink both
+    // alike, the terminal stretches the image to whatever it's given.
+    int limit = (int)arrlen(kitty_diacritics);
+    if(*cols > limit && *cols >= *rows){
+        *rows = (int)((int64_t)*rows * limit / *cols);
+        *cols = limit;
+    }
+    else if(*rows > limit){
+        *cols = (int)((int64_t)*cols * limit / *rows);
+        *rows = limit;
+    }
+    if(*cols < 1) *cols = 1;
+    if(*rows < 1) *rows = 1;
+}
+
+// Writes a code point as utf-8.
+static
+void
+put_utf8(uint32_t cp){
+    if(cp < 0x80)
+        fputc((int)cp, out);
+    else if(cp < 0x800){
+        fputc((int)(0xc0 | cp >> 6), out);
+        fputc((int)(0x80 | (cp & 0x3f)), out);
+    }
+    else if(cp < 0x10000){
+        fputc((int)(0xe0 | cp >> 12), out);
+        fputc((int)(0x80 | (cp >> 6 & 0x3f)), out);
+        fputc((int)(0x80 | (cp & 0x3f)), out);
+    }
+    else {
+        fputc((int)(0xf0 | cp >> 18), out);
+        fputc((int)(0x80 | (cp >> 12 & 0x3f)), out);
+        fputc((int)(0x80 | (cp >> 6 & 0x3f)), out);
+        fputc((int)(0x80 | (cp & 0x3f)), out);
+    }
+}
+
+//
+// Prints the grid of placeholder cells for a virtual placement of the given
+// image at the top left of the screen. Only the first cell of each row
+// carries diacritics, the terminal infers the rest.
+//
+static
+void
+kitty_print_placeholders(int id, int cols, int rows){
+    // The image id goes in the foreground color.
+    go_to_topleft();
+    fprintf(out, "\033[38;2;%d;%d;%dm", (id>>16)&0xff, (id>>8)&0xff, id&0xff);
+    for(int r = 0; r < rows; r++){
+        if(pane.cols && r)
+            fprintf(out, "\033[%d;%dH", pane.y+r+1, pane.x+1);
+        put_utf8(0x10EEEE);
+        put_utf8(kitty_diacritics[r]);
+        put_utf8(kitty_diacritics[0]);
+        for(int c = 1; c < cols; c++)
+            put_utf8(0x10EEEE);
+        // Whatever was there before might be wider. A pane was cleared
+        // instead, what's to the right of it isn't ours.
+        if(!pane.cols)
+            fputs("\033[K\r\n", out);
+    }
+    fputs("\033[39m", out);
+}
+
+static int kitty_id = 13337;
+
+//
+// In placeholder mode, images stay in the terminal after being shown and
+// showing one again is just printing its placeholders. Keep the most
+// recently shown ones, the terminal has a storage quota.
+//
+// Images uploaded ahead of being shown (see `preupload_next`) are kept here
+// too, in either mode, until they're placed.
+//
+enum {KITTY_MAX_RESIDENT = 16};
+typedef struct KittyResident KittyResident;
+struct KittyResident {
+    // Index into imgpaths, -1 if the slot is free.
+    int index;
+    // The `geometry_generation` it was sized for.
+    int generation;
+    int id;
+    int cols, rows;
+    // Transmitted but not placed yet, and its size in pixels.
+    _Bool unplaced;
+    int w, h;
+    unsigned long long last_used;
+};
+static KittyResident kitty_resident[KITTY_MAX_RESIDENT] = {
+    [0 ... KITTY_MAX_RESIDENT-1] = {.index = -1},
+};
+static unsigned long long kitty_clock = 0;
+
+// A payload was made that might be worth uploading ahead, see
+// `preupload_next`.
+static _Bool preupload_wanted = 0;
+static size_t preuploads, preuploads_used;
+
+static
+KittyResident*_Nullable
+kitty_find_resident(int index){
+    for(int i = 0; i < KITTY_MAX_RESIDENT; i++)
+        if(kitty_resident[i].index == index)
+            return &kitty_resident[i];
+    return NULL;
+}
+
+//
+// Records that image `index` was transmitted as `id`, replacing an older
+// copy of it or evicting the least recently shown image.
+//
+static
+KittyResident*
+kitty_claim_resident(int index, int id){
+    KittyResident* slot = kitty_find_resident(index);
+    if(!slot){
+        slot = &kitty_resident[0];
+        for(int i = 1; i < KITTY_MAX_RESIDENT && slot->index != -1; i++)
+            if(kitty_resident[i].index == -1 || kitty_resident[i].last_used < slot->last_used)
+                slot = &kitty_resident[i];
+    }
+    if(slot->index != -1 && slot->id != id)
+        gfx_printf("\033_Ga=d,d=I,i=%d,q=2\033\\", slot->id);
+    *slot = (KittyResident){
+        .index = index,
+        .generation = geometry_generation,
+        .id = id,
+        .last_used = ++kitty_clock,
+    };
+    return slot;
+}
+
+// The current image was placed with placeholders.
+static
+void
+kitty_add_resident(int id, int cols, int rows){
+    KittyResident* slot = kitty_claim_resident(current, id);
+    slot->cols = cols;
+    slot->rows = rows;
+}
+
+// Forgets what the terminal has without telling it, for when we're no
+// longer talking to that terminal.
+static
+void
+kitty_drop_resident(void){
+    for(int i = 0; i < KITTY_MAX_RESIDENT; i++)
+        kitty_resident[i].index = -1;
+}
+
+// Frees everything we left in the terminal.
+static
+void
+kitty_forget_resident(void){
+    for(int i = 0; i < KITTY_MAX_RESIDENT; i++){
+        if(kitty_resident[i].index == -1) continue;
+        gfx_printf("\033_Ga=d,d=I,i=%d,q=2\033\\", kitty_resident[i].id);
+        gfx_command_done();
+        kitty_resident[i].index = -1;
+    }
+    gfx_end();
+    fflush(out);
+}
+
+// The image last placed directly (not with placeholders), 0 if none.
+static int kitty_placed_id = 0;
+
+static KittyAcks acks;
+static void kitty_expect_ack(int id);
+// When the key that the current frame is for was pressed.
+static double last_key_time;
+// The image whose placement in the current frame asked for an ack, 0 if
+// none, and how far into the output that placement ends.
+static int frame_ack_id = 0;
+static uint64_t frame_ack_end = 0;
+
+// The image was deleted from the terminal.
+static
+void
+kitty_forget_id(int id){
+    for(int i = 0; i < KITTY_MAX_RESIDENT; i++)
+        if(kitty_resident[i].index != -1 && kitty_resident[i].id == id)
+            kitty_resident[i].index = -1;
+    if(kitty_placed_id == id)
+        kitty_placed_id = 0;
+}
+
+// ctx points to the id to transmit the png as.
+static void
+write_func(void* ctx, void* d, int size){
+    char* data = d;
+    char b64buff[4096];
+    _Bool first = 1;
+    int m = 1;
+    int id = *(int*)ctx;
+    while(size > 0){
+        int chunk = (sizeof b64buff)/4*3;
+        if(chunk > size) {
+            chunk = size;
+            m = 0;
+        }
+        int b64_size = base64_encode_size(chunk);
+        int ch = base64_encode(b64buff, sizeof b64buff, data, chunk);
+        if(m == 0 && b64_size < sizeof b64buff){
+            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
+            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
+            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
+        }
+        if(first){
+            gfx_printf("\033_Gf=100,a=t,i=%d,m=%d,q=1;", id, m);
+            first = 0;
+        }
+        else {
+            gfx_printf("\033_Gm=%d;", m);
+        }
+        gfx_write(b64buff, b64_size);
+        gfx_write("\033\\", 2);
+        gfx_command_done();
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+//
+// Puts an (already transmitted) image on screen.
+//
+static
+void
+kitty_place(int id, int w, int h){
+    // No q, so the terminal replies once it's been placed.
+    const char* quiet = acks.enabled? "" : use_placeholders? ",q=2" : ",q=1";
+    if(use_placeholders){
+        int cols, rows;
+        cell_extent(w, h, &cols, &rows);
+        gfx_printf("\033_Ga=p,U=1,i=%d,c=%d,r=%d%s\033\\", id, cols, rows, quiet);
+        kitty_add_resident(id, cols, rows);
+        gfx_end();
+        kitty_expect_ack(id);
+        kitty_print_placeholders(id, cols, rows);
+    }
+    else {
+        gfx_printf("\033_Ga=p,i=%d%s\033\\", id, quiet);
+        if(kitty_placed_id && kitty_placed_id != id)
+            gfx_printf("\033_Ga=d,d=i,i=%d,q=1\033\\", kitty_placed_id);
+        kitty_placed_id = id;
+        gfx_end();
+        kitty_expect_ack(id);
+        below_image();
+    }
+}
+
+//
+// Transmits the pixels as a png as image `id`.
+//
+static
+int
+kitty_encode(const uint8_t* pixels, int w, int h, int n, int id){
+    return !stbi_write_png_to_func(write_func, &id, w, h, n, pixels, 0);
+}
+
+//
+// Paced output. While a frame (everything for showing one image) is going
+// out, `out` points at the paced writer's stream so the terminal is written
+// to without blocking and the frame can be abandoned if the user moves on.
+// Otherwise it's stdout.
+//
+static PacedWriter pacer;
+static _Bool pacing = 0;
+static FILE*_Nullable paced_fp;
+// The kitty image the current frame transmits, 0 if none.
+static int frame_kitty_id = 0;
+
+static
+void
+enable_pacing(void){
+    if(!isatty(STDOUT_FILENO)) return;
+    const char* tty = ttyname(STDOUT_FILENO);
+    if(!tty) return;
+    // Its own open file description, so non-blocking doesn't leak into
+    // stdin and stdout.
+    int fd = open(tty, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+    if(fd < 0) return;
+    paced_init(&pacer, fd);
+    paced_fp = paced_stream(&pacer);
+    if(!paced_fp){
+        close(fd);
+        return;
+    }
+    pacing = 1;
+}
+
+static
+void
+frame_begin(void){
+    frame_kitty_id = 0;
+    frame_ack_id = 0;
+    if(!pacing) return;
+    fflush(out);
+    out = paced_fp;
+    paced_frame_begin(&pacer);
+}
+
+// Waits for the current frame to be written and goes back to stdout.
+static
+void
+frame_finish(void){
+    if(!pacing || out != paced_fp) return;
+    fflush(out);
+    paced_drain(&pacer);
+    out = stdout;
+}
+
+//
+// Abandons whatever of the current frame hasn't been written yet, leaving the
+// terminal in a sane state.
+//
+static
+void
+frame_abort(void){
+    if(!pacing || out != paced_fp) return;
+    fflush(out);
+    PacedAbort cut = paced_abort(&pacer);
+    // The placement didn't make it out, there won't be a reply.
+    if(cut != PACED_ABORT_NONE && frame_ack_id && paced_queued(&pacer) < frame_ack_end)
+        kitty_ack_cancel(&acks, frame_ack_id);
+    if(cut != PACED_ABORT_NONE){
+        if(frame_kitty_id){
+            // Finish the chunked transfer so the terminal isn't left waiting
+            // for the rest, then throw it away.
+            if(cut == PACED_ABORT_BEFORE_MARK)
+                gfx_printf("\033_Gm=0,q=2;\033\\");
+            gfx_printf("\033_Ga=d,d=I,i=%d,q=2\033\\", frame_kitty_id);
+            gfx_end();
+            kitty_forget_id(frame_kitty_id);
+        }
+        if(backends[backend].invalidate) backends[backend].invalidate();
+        end_synchronized_update();
+    }
+    frame_finish();
+}
+
+//
+// Waits for the placement of `id` just written to be acknowledged, if acks
+// are on.
+//
+static
+void
+kitty_expect_ack(int id){
+    if(!acks.enabled) return;
+    fflush(out);
+    frame_ack_id = id;
+    frame_ack_end = pacing && out == paced_fp? paced_queued(&pacer) : 0;
+    kitty_ack_expect(&acks, id, last_key_time, paced_now());
+}
+
+//
+// Writes some more of the current frame, as much as the terminal takes in
+// about PACED_CHUNK_MS, and goes back to stdout once it's all out.
+// Returns non-zero while there's more to write.
+//
+static
+int
+frame_pump(void){
+    if(!pacing || out != paced_fp) return 0;
+    fflush(out);
+    if(paced_pump(&pacer)) return 1;
+    out = stdout;
+    return 0;
+}
+
+// Keys, from the start of the main loop until exit.
+static GiInput keys;
+static _Bool keys_active = 0;
+
+static
+void
+keys_end(void){
+    if(!keys_active) return;
+    keys_active = 0;
+    // Not into the middle of a frame's escapes.
+    frame_abort();
+    fputs("\033[?1006l\033[?1000l", stdout);
+    fflush(stdout);
+    gi_input_end(&keys);
+}
+
+//
+// Has keys come in as they're typed, without echoing them, and the mouse
+// wheel reported, until exit.
+//
+static
+void
+keys_begin(void){
+    static _Bool registered = 0;
+    if(gi_input_begin(&keys, STDIN_FILENO) != 0) return;
+    keys_active = 1;
+    // Buttons and the wheel, in the SGR encoding get_input parses.
+    fputs("\033[?1000h\033[?1006h", stdout);
+    fflush(stdout);
+    // Suspending ends and begins it again, once is enough for exit.
+    if(!registered) atexit(keys_end);
+    registered = 1;
+}
+
+// What the pager does for keys that aren't characters.
+enum {
+    KEY_NONE = -1,
+    KEY_FIRST = -2,
+    KEY_LAST = -3,
+    KEY_SUSPEND = -4,
+};
+
+//
+// The key `ev` is as a character the main loop knows: 'n' and 'p' for
+// the arrows and the mouse wheel, or one of the KEY_*.
+//
+static
+int
+key_from_event(const GiEvent* ev){
+    if(ev->release) return KEY_NONE;
+    if(ev->type == GI_EVENT_MOUSE){
+        if(ev->key == GI_MOUSE_WHEEL_DOWN) return 'n';
+        if(ev->key == GI_MOUSE_WHEEL_UP) return 'p';
+        return KEY_NONE;
+    }
+    if(ev->type != GI_EVENT_KEY) return KEY_NONE;
+    if(ev->mods & (GI_MOD_ALT|GI_MOD_SUPER)) return KEY_NONE;
+    switch(ev->key){
+        case GI_KEY_RIGHT: case GI_KEY_DOWN: case GI_KEY_PAGE_DOWN:
+            return 'n';
+        case GI_KEY_LEFT: case GI_KEY_UP: case GI_KEY_PAGE_UP:
+            return 'p';
+        case GI_KEY_HOME: return KEY_FIRST;
+        case GI_KEY_END: return KEY_LAST;
+        case 3: return 'q'; // CTRL-C
+        case 26: return KEY_SUSPEND; // CTRL-Z
+        default:
+            return ev->key < 0x80? ev->key : KEY_NONE;
+    }
+}
+
+//
+// Writes a payload. Without pacing it goes straight to the terminal in one
+// write, bypassing stdio.
+//
+static
+void
+write_payload(const char* data, size_t length){
+    if(pacing && out == paced_fp){
+        fwrite(data, length, 1, out);
+        fflush(out);
+        paced_frame_mark(&pacer);
+        return;
+    }
+    fflush(out);
+    while(length){
+        ssize_t n = write(fileno(out), data, length);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return;
+        data += n;
+        length -= (size_t)n;
+    }
+}
+
+static
+void
+kitty_present(const char* data, size_t length, int id, int w, int h){
+    begin_synchronized_update();
+    go_to_topleft();
+    clear_screen();
+    frame_kitty_id = id;
+    write_payload(data, length);
+    kitty_place(id, w, h);
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+}
+
+static
+int
+kitty_show_file(StringView path, int w, int h){
+    (void)w, (void)h;
+    int x = 0, y = 0, n;
+    // Placeholders need to know how many cells to cover.
+    if(use_placeholders && !stbi_info(path.text, &x, &y, &n))
+        return 1;
+    char b64buff[4092];
+    size_t used = base64_encode(b64buff, sizeof b64buff, path.text, path.length);
+    if(used %4 != 0) b64buff[used++] = '=';
+    if(used %4 != 0) b64buff[used++] = '=';
+    if(used %4 != 0) b64buff[used++] = '=';
+    begin_synchronized_update();
+    go_to_topleft();
+    clear_screen();
+    if(use_placeholders){
+        gfx_printf("\033_Ga=t,f=100,t=f,i=%d,q=2;", ++kitty_id);
+        gfx_write(b64buff, used);
+        gfx_write("\033\\", 2);
+        gfx_command_done();
+        kitty_place(kitty_id, x, y);
+    }
+    else {
+        gfx_printf("\033_Ga=d\033\\");
+        kitty_placed_id = 0;
+        gfx_printf("\033_Ga=T,f=100,t=f,d=a,C=0;");
+        gfx_write(b64buff, used);
+        gfx_write("\033\\", 2);
+        gfx_end();
+        below_image();
+    }
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+    return 0;
+}
+
+//
+// Reprints the placeholders of an image the terminal still has. Nothing is
+// cleared first, each row erases what is after it instead.
+//
+static
+int
+kitty_show_resident(int index){
+    KittyResident* r = kitty_find_resident(index);
+    if(!r || r->generation != geometry_generation) return 1;
+    r->last_used = ++kitty_clock;
+    if(r->unplaced){
+        // Uploaded ahead, all that's left is placing it.
+        preuploads_used++;
+        begin_synchronized_update();
+        go_to_topleft();
+        clear_screen();
+        int id = r->id, w = r->w, h = r->h;
+        kitty_place(id, w, h);
+        // Placing it directly doesn't keep track of it, keep the upload.
+        if(r->index == index && r->id == id)
+            r->unplaced = !use_placeholders;
+        show_status();
+        end_synchronized_update();
+        fflush(out);
+        return 0;
+    }
+    if(!use_placeholders) return 1;
+    begin_synchronized_update();
+    if(pane.cols) clear_screen();
+    kitty_print_placeholders(r->id, r->cols, r->rows);
+    show_status();
+    if(!pane.cols) fputs("\033[J", out);
+    end_synchronized_update();
+    fflush(out);
+    return 0;
+}
+
+// Runs the encoder's parts on the render workers once they're started.
+static void (*_Nullable sixel_parallel)(void (*)(void*, int), void*, int);
+
+static
+int
+sixel_encode_pixels(const uint8_t* pixels, int w, int h, int n, int id){
+    (void)id;
+    SixelOptions opts = {.dither = dither, .parallel = sixel_parallel};
+    SixelBuffer buf = {0};
+    int err = sixel_encode(pixels, w, h, n, &opts, &buf);
+    // Not wrapped for tmux, it understands sixel itself.
+    if(!err)
+        gfx_raw(buf.data, buf.length);
+    free(buf.data);
+    return err;
+}
+
+//
+// Shows a payload that displays itself at the cursor.
+//
+static
+void
+plain_present(const char* data, size_t length, int id, int w, int h){
+    (void)id, (void)w, (void)h;
+    begin_synchronized_update();
+    go_to_topleft();
+    clear_screen();
+    write_payload(data, length);
+    below_image();
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+}
+
+//
+// Writes data as base64 to `out` (through `gfx_write`), padded.
+//
+static
+void
+write_base64(const void* d, size_t size){
+    const char* data = d;
+    // Multiple of 4 so only the last chunk needs padding.
+    char b64buff[4096];
+    while(size){
+        size_t chunk = (sizeof b64buff)/4*3;
+        if(chunk > size) chunk = size;
+        size_t used = base64_encode(b64buff, sizeof b64buff, data, chunk);
+        while(used % 4 != 0) b64buff[used++] = '=';
+        gfx_write(b64buff, used);
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+//
+// Writes an OSC 1337 inline image. w and h are in pixels, 0 for the terminal
+// to use the image's own size.
+//
+// Inside tmux the image is sent in parts (iTerm2 3.5 and WezTerm), as one
+// OSC for all of it wouldn't fit in a passthrough.
+//
+static
+void
+iterm_put(const void* data, size_t size, int w, int h){
+    _Bool parts = mux == MUX_TMUX;
+    gfx_printf("\033]1337;%s=inline=1;size=%zu", parts? "MultipartFile" : "File", size);
+    if(w && h)
+        gfx_printf(";width=%dpx;height=%dpx;preserveAspectRatio=0", w, h);
+    if(!parts){
+        gfx_write(":", 1);
+        write_base64(data, size);
+        gfx_write("\a", 1);
+        gfx_end();
+        return;
+    }
+    gfx_write("\a", 1);
+    gfx_command_done();
+    const char* p = data;
+    while(size){
+        // Same as a kitty chunk once encoded.
+        size_t chunk = size < 3072? size : 3072;
+        gfx_printf("\033]1337;FilePart=");
+        write_base64(p, chunk);
+        gfx_write("\a", 1);
+        gfx_command_done();
+        p += chunk;
+        size -= chunk;
+    }
+    gfx_printf("\033]1337;FileEnd\a");
+    gfx_end();
+}
+
+static
+void
+iterm_emit(const void* data, size_t size, int w, int h){
+    begin_synchronized_update();
+    go_to_topleft();
+    clear_screen();
+    iterm_put(data, size, w, h);
+    below_image();
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+}
+
+//
+// Sends the original bytes of the file and lets the terminal decode (and
+// scale) it.
+//
+static
+int
+iterm_show_file(StringView path, int w, int h){
+    int fd = open(path.text, O_RDONLY);
+    if(fd < 0) return 1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !st.st_size){
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    // If we're shrinking a lot, a png of the resized pixels is smaller than
+    // the original file. Estimate the png at half the raw size.
+    if(w && h && size > (size_t)w*(size_t)h*3/2){
+        close(fd);
+        return 1;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return 1;
+    // Only pass through formats terminals reliably understand.
+    const unsigned char* magic = data;
+    _Bool known = 0;
+    if(size >= 4){
+        known |= !memcmp(magic, "\xff\xd8\xff", 3);
+        known |= !memcmp(magic, "\x89PNG", 4);
+        known |= !memcmp(magic, "GIF8", 4);
+    }
+    if(!known){
+        munmap(data, size);
+        return 1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    iterm_emit(data, size, w, h);
+    munmap(data, size);
+    return 0;
+}
+
+static
+int
+iterm_encode(const uint8_t* pixels, int w, int h, int n, int id){
+    (void)id;
+    int len;
+    unsigned char* png = stbi_write_png_to_mem(pixels, 0, w, h, n, &len);
+    if(!png) return 1;
+    iterm_put(png, (size_t)len, w, h);
+    STBIW_FREE(png);
+    return 0;
+}
+
+// What the text backends last drew, for diffing.
+static TextFrame text_prev, text_cur;
+static _Bool text_prev_valid = 0;
+
+static
+void
+text_invalidate(void){
+    text_prev_valid = 0;
+}
+
+static
+void
+text_fit(TextMode mode, int* w, int* h){
+    TermSize sz = term_size();
+    int cellw = sz.columns? sz.xpix / sz.columns : 0;
+    int cellh = sz.rows? sz.ypix / sz.rows : 0;
+    if(cellw <= 0) cellw = 8;
+    if(cellh <= 0) cellh = 16;
+    int cols = (*w + cellw - 1) / cellw;
+    int rows = (*h + cellh - 1) / cellh;
+    // Leave room for the status lines.
+    int maxcols = sz.columns, maxrows = pane.cols? sz.rows : sz.rows - 3;
+    if(cols > maxcols){
+        rows = (int)((long long)rows * maxcols / cols);
+        cols = maxcols;
+    }
+    if(rows > maxrows){
+        cols = (int)((long long)cols * maxrows / rows);
+        rows = maxrows;
+    }
+    if(cols < 1) cols = 1;
+    if(rows < 1) rows = 1;
+    int px, py;
+    text_cell_pixels(mode, &px, &py);
+    *w = cols * px;
+    *h = rows * py;
+}
+
+static
+void
+text_show_pixels(TextMode mode, const uint8_t* pixels, int w, int h, int n){
+    if(text_frame_build(&text_cur, mode, pixels, w, h, n)) return;
+    begin_synchronized_update();
+    const TextFrame* prev = &text_prev;
+    if(!text_prev_valid || text_prev.cols != text_cur.cols || text_prev.rows != text_cur.rows){
+        go_to_topleft();
+        clear_screen();
+        prev = NULL;
+    }
+    text_frame_emit(out, &text_cur, prev, pane.x, pane.y);
+    if(!pane.cols)
+        fprintf(out, "\033[%d;1H", text_cur.rows+1);
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+    TextFrame tmp = text_prev;
+    text_prev = text_cur;
+    text_cur = tmp;
+    text_prev_valid = 1;
+}
+
+static void blocks_fit(int* w, int* h){ text_fit(TEXT_HALFBLOCK, w, h); }
+static void braille_fit(int* w, int* h){ text_fit(TEXT_BRAILLE, w, h); }
+static void blocks_show_pixels(const uint8_t* pixels, int w, int h, int n){ text_show_pixels(TEXT_HALFBLOCK, pixels, w, h, n); }
+static void braille_show_pixels(const uint8_t* pixels, int w, int h, int n){ text_show_pixels(TEXT_BRAILLE, pixels, w, h, n); }
+
+static const Backend backends[BACKEND_COUNT] = {
+    [BACKEND_KITTY] = {
+        .encode = kitty_encode,
+        .present = kitty_present,
+        .show_file = kitty_show_file,
+        .show_resident = kitty_show_resident,
+    },
+    [BACKEND_SIXEL] = {
+        .encode = sixel_encode_pixels,
+        .present = plain_present,
+    },
+    [BACKEND_BLOCKS] = {
+        .show_pixels = blocks_show_pixels,
+        .fit = blocks_fit,
+        .invalidate = text_invalidate,
+    },
+    [BACKEND_BRAILLE] = {
+        .show_pixels = braille_show_pixels,
+        .fit = braille_fit,
+        .invalidate = text_invalidate,
+    },
+    [BACKEND_ITERM] = {
+        .encode = iterm_encode,
+        .present = plain_present,
+        .show_file = iterm_show_file,
+        .file_scales = 1,
+    },
+};
+
+//
+// Transmits the pixels directly (f=24/32) instead of as a png.
+// Avoids the png encode, but is a lot more bytes over the wire.
+//
+// What's kept (the payload) is the pixels as qoi rather than the escape
+// sequences, which are a third bigger than the pixels and several times
+// bigger than the qoi. `kitty_raw_present` turns it into them on the way out.
+// Only makes sense while capturing.
+//
+static
+int
+kitty_encode_raw(const uint8_t* pixels, int w, int h, int n, int id){
+    (void)id;
+    uint8_t* data;
+    size_t length;
+    if(qoi_encode(pixels, w, h, n, &data, &length)) return 1;
+    gfx_raw((const char*)data, length);
+    free(data);
+    return 0;
+}
+
+//
+// Transmits qoi data as image `id`. The pixels are decoded a chunk at a time
+// and base64 encoded and written while they're still in cache, so neither
+// the whole image nor the whole transmission is ever in memory.
+// Returns non-zero if the data is bad, after ending the transmission.
+//
+static
+int
+kitty_transmit_qoi(const char* data, size_t length, int id){
+    QoiDecoder d;
+    if(qoi_decoder_init(&d, (const uint8_t*)data, length)) return 1;
+    // Kitty takes rgb or rgba, grey is expanded.
+    int channels = d.n == 2 || d.n == 4? 4 : 3;
+    // 3072 bytes of pixels are 4096 of base64, the most kitty takes at once,
+    // and a whole number of pixels either way.
+    uint8_t pixels[3072];
+    char b64buff[4096];
+    size_t per_chunk = sizeof pixels / (size_t)channels;
+    for(_Bool first = 1; d.remaining; first = 0){
+        size_t got = qoi_decode_some(&d, pixels, per_chunk, channels);
+        if(d.bad){
+            // Kitty is waiting on the rest, finish it with nothing.
+            if(!first){
+                gfx_printf("\033_Gm=0,q=2;\033\\");
+                gfx_command_done();
+            }
+            return 1;
+        }
+        size_t used = base64_encode(b64buff, sizeof b64buff, pixels, got*(size_t)channels);
+        while(used % 4 != 0) b64buff[used++] = '=';
+        int m = d.remaining != 0;
+        if(first)
+            gfx_printf("\033_Gf=%d,a=t,i=%d,s=%d,v=%d,q=1,m=%d;", channels*8, id, d.w, d.h, m);
+        else
+            gfx_printf("\033_Gm=%d;", m);
+        gfx_write(b64buff, used);
+        gfx_write("\033\\", 2);
+        gfx_command_done();
+    }
+    return 0;
+}
+
+static
+void
+kitty_raw_present(const char* data, size_t length, int id, int w, int h){
+    begin_synchronized_update();
+    go_to_topleft();
+    clear_screen();
+    frame_kitty_id = id;
+    int err = kitty_transmit_qoi(data, length, id);
+    gfx_end();
+    if(pacing && out == paced_fp){
+        fflush(out);
+        paced_frame_mark(&pacer);
+    }
+    if(!err) kitty_place(id, w, h);
+    show_status();
+    end_synchronized_update();
+    fflush(out);
+}
+
+//
+// Shows the output of `encode`, which for raw kitty transmissions needs
+// transcoding.
+//
+static
+void
+present_payload(const char* data, size_t length, int id, int w, int h){
+    if(backend == BACKEND_KITTY && kitty_raw)
+        kitty_raw_present(data, length, id, w, h);
+    else
+        backends[backend].present(data, length, id, w, h);
+}
+
+//
+// Computes the size to display an image of size x by y at, according to the
+// command line options and terminal size.
+//
+static
+void
+target_size(int x, int y, int* pw, int* ph){
+    int w = width, h = height;
+    if(scale){
+        w = (int)(scale*x);
+        h = (int)(scale*y);
+    }
+    if(auto_scale){
+        // This is wrong, as if the image is bigger than the screen it
+        // picks the wrong one.
+        double xratio = (double)width/(double)x;
+        double yratio = (double)height/(double)y;
+        if(xratio < yratio){
+            w = (int)(xratio * x);
+            h = (int)(xratio * y);
+        }
+        else {
+            w = (int)(yratio * x);
+            h = (int)(yratio * y);
+        }
+    }
+    if(!w && !h){
+        // Backend can't take the file, show it at its native size.
+        w = x;
+        h = y;
+    }
+    if(!w){
+        double s = (double)h/(double)y;
+        w = (int)(s*x);
+    }
+    if(!h){
+        double s = (double)w/(double)x;
+        h = (int)(s*y);
+    }
+    if(pane.cols){
+        // Nothing can go outside a pane, shrink to fit it.
+        TermSize sz = term_size();
+        if(w > sz.xpix){
+            h = (int)((int64_t)h * sz.xpix / w);
+            w = sz.xpix;
+        }
+        if(h > sz.ypix){
+            w = (int)((int64_t)w * sz.ypix / h);
+            h = sz.ypix;
+        }
+        if(w < 1) w = 1;
+        if(h < 1) h = 1;
+    }
+    const Backend* be = &backends[backend];
+    if(be->fit) be->fit(&w, &h);
+    *pw = w;
+    *ph = h;
+}
+
+//
+// Resizes the x by y pixels in *pixels to w by h, replacing them. They're
+// freed either way, on failure *pixels is NULL.
+// Returns non-zero on failure.
+//
+static
+int
+resize_pixels(uint8_t*_Nullable* pixels, int x, int y, int n, int w, int h){
+    uint8_t* src = *pixels;
+    if(w == x && h == y) return 0;
+    *pixels = NULL;
+    uint8_t* dst = malloc((size_t)w*(size_t)h*(size_t)n);
+    int ok = dst && stbir_resize_uint8(src, x, y, 0, dst, w, h, 0, n);
+    free(src);
+    if(!ok){
+        free(dst);
+        return 1;
+    }
+    *pixels = dst;
+    return 0;
+}
+
+//
+// Decodes the file and resizes it to the size to display it at, into
+// *pixels, *w by *h with *n channels. What went wrong goes to errfp.
+// Returns non-zero on failure.
+//
+static
+int
+load_scaled(const char* path, FILE* errfp, uint8_t*_Nullable* pixels, int* w, int* h, int* n){
+    int x, y;
+    *pixels = stbi_load(path, &x, &y, n, 0);
+    if(!*pixels){
+        fprintf(errfp, "Failed to load %s\n", path);
+        return 1;
+    }
+    target_size(x, y, w, h);
+    if(resize_pixels(pixels, x, y, *n, *w, *h)){
+        fprintf(errfp, "Failed to resize %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// What, besides the image and its size, the bytes `encode` produces depend
+// on. Never 0, that's decoded pixels.
+//
+static
+uint32_t
+payload_variant(void){
+    return 1u << 16 | (uint32_t)backend | (uint32_t)mux << 4 | (uint32_t)dither << 8 | (uint32_t)kitty_raw << 9;
+}
+
+//
+// Cached payloads transmit as an id derived from what they show, so the
+// bytes can be replayed as they are, even by a later run. Ids we hand out
+// otherwise are well below this range.
+//
+static PayloadIds payload_ids;
+
+static
+int
+payload_kitty_id(uint64_t hash){
+    _Bool derived;
+    return payload_ids_get(&payload_ids, hash, &derived);
+}
+
+//
+// Whether payloads on disk for the hash were made with the id it has now.
+// If another image took that id first they weren't, and it can't share the
+// files either.
+//
+static
+_Bool
+payload_id_derived(uint64_t hash){
+    _Bool derived;
+    payload_ids_get(&payload_ids, hash, &derived);
+    return derived;
+}
+
+// What a payload is stored on disk under.
+static
+PayloadFileHeader
+payload_file_header(const ImgCacheKey* pkey){
+    return (PayloadFileHeader){
+        .magic = PAYLOAD_MAGIC,
+        .version = PAYLOAD_VERSION,
+        .file_size = pkey->file_size,
+        .mtime_ns = pkey->mtime_ns,
+        .w = pkey->w,
+        .h = pkey->h,
+        .variant = pkey->variant,
+        .path_length = (uint32_t)pkey->path_length,
+    };
+}
+
+//
+// Keeps a finished payload, on disk and in memory. Takes ownership of the
+// buffer's data.
+//
+static
+void
+store_payload(const ImgCacheKey* pkey, PayloadBuffer* buf){
+    if(disk_cache && payload_id_derived(imgcache_hash(pkey))){
+        PayloadFileHeader hdr = payload_file_header(pkey);
+        payload_store(imgcache_hash(pkey), &hdr, pkey->path, buf->data, buf->length);
+        // Checking means statting every file, don't do it every time.
+        static int stores;
+        if(stores++ % 32 == 0)
+            payload_prune(DISK_CACHE_MAX);
+    }
+    imgcache_put(&payload_cache, pkey, (uint8_t*)buf->data, buf->length, 0);
+    *buf = (PayloadBuffer){0};
+}
+
+//
+// Encodes and shows pixels, caching the output if there's a key for it.
+// Returns non-zero on failure.
+//
+static
+int
+show_decoded(const uint8_t* pixels, int w, int h, int n, const ImgCacheKey*_Nullable pkey){
+    const Backend* be = &backends[backend];
+    if(!be->encode){
+        be->show_pixels(pixels, w, h, n);
+        return 0;
+    }
+    int (*encode)(const uint8_t*, int, int, int, int) = be->encode;
+    if(backend == BACKEND_KITTY && kitty_raw)
+        encode = kitty_encode_raw;
+    uint64_t hash = pkey? imgcache_hash(pkey) : 0;
+    int id = pkey? payload_kitty_id(hash) : ++kitty_id;
+    PayloadBuffer buf = {0};
+    gfx_begin_capture(&buf);
+    int err = encode(pixels, w, h, n, id);
+    if(gfx_end_capture()) err = 1;
+    if(err){
+        free(buf.data);
+        fprintf(out, "Failed to encode %s\n", image_path(current).text);
+        return 1;
+    }
+    present_payload(buf.data, buf.length, id, w, h);
+    if(!pkey){
+        free(buf.data);
+        return 0;
+    }
+    store_payload(pkey, &buf);
+    return 0;
+}
+
+//
+// Shows the finished output for the image at this size if we have it, in
+// memory or on disk, which is just writing it out.
+// Returns non-zero on a miss.
+//
+static
+int
+show_cached_payload(const ImgCacheKey* pkey){
+    uint64_t hash = imgcache_hash(pkey);
+    int id = payload_kitty_id(hash);
+    const ImgCacheEntry* e = imgcache_get(&payload_cache, pkey);
+    if(e){
+        present_payload((const char*)e->pixels, e->size, id, pkey->w, pkey->h);
+        return 0;
+    }
+    if(!disk_cache || !payload_id_derived(hash)) return 1;
+    PayloadFileHeader want = payload_file_header(pkey);
+    PayloadMapping m;
+    if(payload_map(&m, hash, &want, pkey->path)) return 1;
+    present_payload(m.data, m.length, id, pkey->w, pkey->h);
+    // Likely to be wanted again soon.
+    uint8_t* copy = malloc(m.length?m.length:1);
+    if(copy){
+        memcpy(copy, m.data, m.length);
+        imgcache_put(&payload_cache, pkey, copy, m.length, 0);
+    }
+    payload_unmap(&m);
+    return 0;
+}
+
+//
+// Decoded pixels are kept on disk too, as qoi, under their decode key
+// (variant 0). They're for a later run, or the same image with other
+// options, that would otherwise decode the file again.
+//
+static
+PayloadFileHeader
+pixels_file_header(const ImgCacheKey* key){
+    return (PayloadFileHeader){
+        .magic = PAYLOAD_MAGIC,
+        .version = PAYLOAD_VERSION,
+        .file_size = key->file_size,
+        .mtime_ns = key->mtime_ns,
+        .w = key->w,
+        .h = key->h,
+        .variant = 0,
+        .path_length = (uint32_t)key->path_length,
+    };
+}
+
+// Failure is ignored, it's only a cache.
+static
+void
+store_cached_pixels(const ImgCacheKey* key, const uint8_t* qoi, size_t length){
+    PayloadFileHeader hdr = pixels_file_header(key);
+    payload_store(imgcache_hash(key), &hdr, key->path, (const char*)qoi, length);
+}
+
+//
+// Reads the pixels for the key from disk, still as qoi, into a malloced
+// buffer.
+// Returns non-zero on a miss.
+//
+static
+int
+read_cached_pixels(const ImgCacheKey* key, uint8_t*_Nullable* qoi, size_t* length, int* n){
+    PayloadFileHeader want = pixels_file_header(key);
+    PayloadMapping m;
+    if(payload_map(&m, imgcache_hash(key), &want, key->path)) return 1;
+    int result = 1;
+    int w, h;
+    if(qoi_info((const uint8_t*)m.data, m.length, &w, &h, n) || w != key->w || h != key->h)
+        goto cleanup;
+    *qoi = malloc(m.length);
+    if(!*qoi) goto cleanup;
+    memcpy(*qoi, m.data, m.length);
+    *length = m.length;
+    result = 0;
+    cleanup:
+    payload_unmap(&m);
+    return result;
+}
+
+// The files' headers are read on the main thread, in batches.
+static FileBatch main_files;
+static _Bool have_main_files = 0;
+
+static
+FileBatch*
+main_file_batch(void){
+    if(!have_main_files){
+        file_batch_init(&main_files);
+        have_main_files = 1;
+    }
+    return &main_files;
+}
+
+//
+// For reading the start of image `index`'s file. The stat from resolving
+// the path is used if there was one.
+//
+static
+FileBatchItem
+image_head_item(int index){
+    FileBatchItem it = {.path = image_path(index).text, .max_bytes = FILE_BATCH_HEAD_MAX};
+    if(!resolving) return it;
+    const ResolvedPath* r = resolve_get(&resolver, index);
+    if(r->error || !r->regular) return it;
+    it.stat_known = 1;
+    it.file_size = (size_t)r->file_size;
+    it.mtime_ns = r->mtime_ns;
+    return it;
+}
+
+//
+// Works out the cache keys for showing the image at `index` from the start
+// of its file, read into `it` by file_batch_read. The payload key's path is
+// the decode key's.
+// Returns non-zero if the file can't be read.
+//
+static
+int
+image_keys_from(int index, const FileBatchItem* it, ImgCacheKey* key, ImgCacheKey* pkey, int* px, int* py){
+    StringView path = image_path(index);
+    if(it->error.errored) return 1;
+    int x, y, n;
+    if(!stbi_info_from_memory(it->data.buff, (int)it->data.n_bytes, &x, &y, &n)){
+        // Some headers come after more than was read, like a jpeg's behind
+        // a big exif block.
+        if(it->data.n_bytes == it->file_size || !stbi_info(path.text, &x, &y, &n))
+            return 1;
+    }
+    int w, h;
+    target_size(x, y, &w, &h);
+    *key = (ImgCacheKey){
+        .path = path.text,
+        .path_length = path.length,
+        .file_size = it->file_size,
+        .mtime_ns = it->mtime_ns,
+        .w = w,
+        .h = h,
+    };
+    *pkey = *key;
+    pkey->variant = payload_variant();
+    *px = x;
+    *py = y;
+    return 0;
+}
+
+//
+// Works out the cache keys for showing the image at `index`, reading only
+// the file's header.
+// Returns non-zero if the file can't be read.
+//
+static
+int
+image_keys(int index, ImgCacheKey* key, ImgCacheKey* pkey, int* px, int* py){
+    FileBatchItem it = image_head_item(index);
+    file_batch_read(main_file_batch(), &it, 1, MALLOCATOR);
+    int err = image_keys_from(index, &it, key, pkey, px, py);
+    free(it.data.buff);
+    return err;
+}
+
+//
+// Rendering
+// ---------
+// Turning a file into what gets written to the terminal runs on the
+// scheduler's workers as a job made of stages:
+//
+//     decode -> resize -> encode
+//
+// Each stage needs what an earlier one made. A job starts from whatever is
+// already cached and stops once it has what the backend presents: pixels
+// for the text backends, a payload for the rest.
+//
+// Prefetches that decode the file also keep the pixels on disk, as that's
+// work done in the background anyway. What the user waits for is stored
+// if it gets compressed on leaving the decode cache.
+//
+// Jobs are tracked by what they make, so asking for an image a prefetch is
+// already working on adopts that job (boosting it) instead of starting
+// over. Only the main thread looks at the table, and it moves the results of
+// finished jobs into the caches.
+//
+enum {RENDER_DECODED = 1, RENDER_PIXELS = 2, RENDER_PAYLOAD = 4, RENDER_COMPRESSED = 8, RENDER_STORED = 16};
+
+typedef struct RenderJob RenderJob;
+struct RenderJob {
+    SchedJob job;
+    // key.path is owned, pkey shares it.
+    ImgCacheKey key, pkey;
+    // The image's size according to its header.
+    int x, y;
+    // What the job has and what it's after.
+    unsigned have, want;
+    int (*_Nullable encode)(const uint8_t*, int, int, int, int);
+    int kitty_id;
+    uint8_t*_Nullable decoded;
+    int n;
+    uint8_t*_Nullable compressed;
+    size_t compressed_size;
+    uint8_t*_Nullable pixels;
+    PayloadBuffer payload;
+    _Bool failed;
+    // Queued ahead of being asked for, and not asked for since.
+    _Bool prefetch;
+    // Started from the file rather than something cached.
+    _Bool from_scratch;
+    // The file was read ahead, and how long reading it took.
+    _Bool warmed;
+    double read_time;
+    // Seconds spent in stages.
+    double cost;
+};
+
+typedef struct RenderStage RenderStage;
+struct RenderStage {
+    // Runs once the job has all of `needs` and none of `makes` or `skip`.
+    unsigned needs, makes, skip;
+    // Returns non-zero on failure.
+    int (*run)(RenderJob*);
+};
+
+// Each worker reads files with its own batch.
+static _Thread_local FileBatch render_files;
+static _Thread_local _Bool have_render_files = 0;
+
+static
+int
+render_decode(RenderJob* r){
+    if(!have_render_files){
+        file_batch_init(&render_files);
+        have_render_files = 1;
+    }
+    // All of it in one go, stdio would read it a page at a time.
+    FileBatchItem it = {.path = r->key.path};
+    double t0 = paced_now();
+    file_batch_read(&render_files, &it, 1, MALLOCATOR);
+    if(it.error.errored) return 1;
+    r->read_time = paced_now() - t0;
+    int x, y;
+    if(it.data.n_bytes <= INT_MAX)
+        r->decoded = stbi_load_from_memory(it.data.buff, (int)it.data.n_bytes, &x, &y, &r->n, 0);
+    free(it.data.buff);
+    if(!r->decoded) return 1;
+    // The size was picked from the header, if the data disagrees let the
+    // main thread sort it out.
+    return x != r->x || y != r->y;
+}
+
+static
+int
+render_resize(RenderJob* r){
+    r->pixels = r->decoded;
+    r->decoded = NULL;
+    return resize_pixels(&r->pixels, r->x, r->y, r->n, r->key.w, r->key.h);
+}
+
+static
+int
+render_decompress(RenderJob* r){
+    int w, h, n;
+    if(qoi_info(r->compressed, r->compressed_size, &w, &h, &n)) return 1;
+    if(w != r->key.w || h != r->key.h || n != r->n) return 1;
+    r->pixels = malloc((size_t)w*(size_t)h*(size_t)n);
+    if(!r->pixels) return 1;
+    int err = qoi_decode_into(r->compressed, r->compressed_size, r->pixels);
+    free(r->compressed);
+    r->compressed = NULL;
+    return err;
+}
+
+static
+int
+render_encode(RenderJob* r){
+    gfx_begin_capture(&r->payload);
+    int err = r->encode(r->pixels, r->key.w, r->key.h, r->n, r->kitty_id);
+    if(gfx_end_capture()) err = 1;
+    return err;
+}
+
+static
+int
+render_store(RenderJob* r){
+    size_t size = (size_t)r->key.w*(size_t)r->key.h*(size_t)r->n;
+    uint8_t* data;
+    size_t length;
+    if(qoi_encode(r->pixels, r->key.w, r->key.h, r->n, &data, &length)) return 0;
+    // Not worth the disk if it doesn't compress, as for the compressed cache.
+    if(length <= size / 4 * 3)
+        store_cached_pixels(&r->key, data, length);
+    free(data);
+    return 0;
+}
+
+// The pixels come from the compressed copy if there is one, otherwise the
+// file.
+static const RenderStage render_stages[] = {
+    {RENDER_COMPRESSED, RENDER_PIXELS,  0,                                render_decompress},
+    {0,                 RENDER_DECODED, RENDER_PIXELS|RENDER_COMPRESSED,  render_decode},
+    {RENDER_DECODED,    RENDER_PIXELS,  0,                                render_resize},
+    {RENDER_PIXELS,     RENDER_PAYLOAD, 0,                                render_encode},
+    {RENDER_PIXELS,     RENDER_STORED,  0,                                render_store},
+};
+
+static
+SchedStep
+render_step(SchedJob* job){
+    RenderJob* r = (RenderJob*)job;
+    // Started from something cached that's already enough.
+    if((r->have & r->want) == r->want) return SCHED_STEP_DONE;
+    for(size_t i = 0; i < arrlen(render_stages); i++){
+        const RenderStage* stage = &render_stages[i];
+        if((r->have & stage->needs) != stage->needs || (r->have & (stage->makes|stage->skip)))
+            continue;
+        // Nothing else needs these, only make them if they're wanted.
+        if((stage->makes & (RENDER_PAYLOAD|RENDER_STORED)) && !(stage->makes & r->want))
+            continue;
+        double t0 = paced_now();
+        int err = stage->run(r);
+        r->cost += paced_now() - t0;
+        if(err){
+            r->failed = 1;
+            return SCHED_STEP_DONE;
+        }
+        r->have |= stage->makes;
+        return (r->have & r->want) == r->want? SCHED_STEP_DONE : SCHED_STEP_MORE;
+    }
+    return SCHED_STEP_DONE;
+}
+
+//
+// A job cancelled with the file decoded still resizes it, which is cheap
+// next to the decode, so the pixels can go in the decode cache.
+//
+static
+void
+render_salvage(SchedJob* job){
+    RenderJob* r = (RenderJob*)job;
+    if(r->failed || !(r->have & RENDER_DECODED) || (r->have & RENDER_PIXELS)) return;
+    if(render_resize(r)) r->failed = 1;
+    else r->have |= RENDER_PIXELS;
+}
+
+static
+void
+render_destroy(SchedJob* job){
+    RenderJob* r = (RenderJob*)job;
+    free((char*)r->key.path);
+    free(r->decoded);
+    free(r->compressed);
+    free(r->pixels);
+    free(r->payload.data);
+    free(r);
+}
+
+static Scheduler scheduler;
+static _Bool have_scheduler = 0;
+static PrefetchPolicy prefetch;
+
+enum {RENDER_MAX_JOBS = 16};
+static RenderJob*_Nullable render_jobs[RENDER_MAX_JOBS];
+
+// In the pager the current image's render is an ordinary job, and the main
+// loop goes on while it runs. Once it's collected it waits in `shown_ready`
+// for the loop to present it, see render_present_shown.
+static RenderJob*_Nullable shown_job;
+static RenderJob*_Nullable shown_ready;
+// The image it's for.
+static int shown_index = -1;
+// It's already the second go, after the first was cut short.
+static _Bool shown_retried;
+
+//
+// Pixels evicted from the decode cache are compressed, and stored on disk,
+// by a job at the lowest priority rather than holding up whatever evicted
+// them. The main thread puts the result in the compressed cache once it's
+// done. The job holds the pixels until then, so only so many at a time.
+//
+enum {COMPRESS_MAX_JOBS = 4};
+typedef struct CompressJob CompressJob;
+struct CompressJob {
+    SchedJob job;
+    // key.path is owned.
+    ImgCacheKey key;
+    int n;
+    uint8_t*_Nullable pixels;
+    size_t size;
+    // NULL if it didn't compress.
+    uint8_t*_Nullable qoi;
+    size_t length;
+};
+static CompressJob*_Nullable compress_jobs[COMPRESS_MAX_JOBS];
+
+static
+SchedStep
+compress_step(SchedJob* job){
+    CompressJob* c = (CompressJob*)job;
+    if(c->pixels){
+        uint8_t* data;
+        size_t length;
+        int err = qoi_encode(c->pixels, c->key.w, c->key.h, c->n, &data, &length);
+        imgcache_release(c->pixels, c->size);
+        c->pixels = NULL;
+        if(err) return SCHED_STEP_DONE;
+        // Noise doesn't compress, it isn't worth the decompressing.
+        if(length > c->size / 4 * 3){
+            free(data);
+            return SCHED_STEP_DONE;
+        }
+        c->qoi = data;
+        c->length = length;
+        return disk_cache? SCHED_STEP_MORE : SCHED_STEP_DONE;
+    }
+    store_cached_pixels(&c->key, c->qoi, c->length);
+    return SCHED_STEP_DONE;
+}
+
+static
+void
+compress_destroy(SchedJob* job){
+    CompressJob* c = (CompressJob*)job;
+    free((char*)c->key.path);
+    imgcache_release(c->pixels, c->size);
+    free(c->qoi);
+    free(c);
+}
+
+// The workers hand finished render and compress jobs (with a reference) to
+// the main thread through render_finished, and wake it with render_notify.
+// If it overflows, the main thread looks through all the jobs instead.
+static MpmcQueue render_finished;
+static QueueNotify render_notify;
+static _Bool have_render_notify = 0;
+static atomic_bool render_overflowed;
+
+static
+void
+render_job_finished(SchedJob* job, void*_Nullable ctx){
+    (void)ctx;
+    if(job->destroy != render_destroy && job->destroy != compress_destroy) return;
+    sched_job_retain(job);
+    if(mpmc_push(&render_finished, job)){
+        sched_job_release(job);
+        atomic_store(&render_overflowed, 1);
+    }
+    queue_notify_signal(&render_notify);
+}
+
+//
+// Keeps a compressed copy of pixels evicted from the decode cache, taking
+// them for a job to compress. Without workers it's done here.
+//
+static
+void
+compress_evicted(void*_Nullable ctx, ImgCacheEntry* e){
+    (void)ctx;
+    ImgCacheKey key = {
+        .path = e->path,
+        .path_length = e->path_length,
+        .file_size = e->file_size,
+        .mtime_ns = e->mtime_ns,
+        .w = e->w,
+        .h = e->h,
+    };
+    if(!compressed_cache.budget || imgcache_contains(&compressed_cache, &key)) return;
+    int slot = -1;
+    for(int i = 0; i < COMPRESS_MAX_JOBS; i++){
+        CompressJob* c = compress_jobs[i];
+        if(!c){
+            if(slot < 0) slot = i;
+            continue;
+        }
+        if(c->key.path_length == key.path_length && !memcmp(c->key.path, key.path, key.path_length)
+        && c->key.w == key.w && c->key.h == key.h
+        && c->key.file_size == key.file_size && c->key.mtime_ns == key.mtime_ns)
+            return;
+    }
+    if(!have_scheduler){
+        uint8_t* data;
+        size_t length;
+        if(qoi_encode(e->pixels, e->w, e->h, e->n, &data, &length)) return;
+        if(length > e->size / 4 * 3){
+            free(data);
+            return;
+        }
+        if(disk_cache)
+            store_cached_pixels(&key, data, length);
+        imgcache_put(&compressed_cache, &key, data, length, e->n);
+        return;
+    }
+    // Evicting this much at once means memory is short, holding on to it
+    // for longer won't help.
+    if(slot < 0) return;
+    CompressJob* c = calloc(1, sizeof *c);
+    char* path = malloc(key.path_length+1);
+    if(!c || !path){
+        free(c);
+        free(path);
+        return;
+    }
+    memcpy(path, key.path, key.path_length+1);
+    c->key = key;
+    c->key.path = path;
+    c->n = e->n;
+    c->pixels = e->pixels;
+    c->size = e->size;
+    e->pixels = NULL;
+    sched_job_init(&c->job, compress_step, compress_destroy, SCHED_THUMBNAIL);
+    if(sched_submit(&scheduler, &c->job)){
+        sched_job_release(&c->job);
+        return;
+    }
+    compress_jobs[slot] = c;
+}
+
+//
+// Puts what the finished compress job in slot `i` made in the compressed
+// cache and forgets it.
+//
+static
+void
+compress_collect(int i){
+    CompressJob* c = compress_jobs[i];
+    compress_jobs[i] = NULL;
+    if(c->qoi && compressed_cache.budget){
+        imgcache_put(&compressed_cache, &c->key, c->qoi, c->length, c->n);
+        c->qoi = NULL;
+    }
+    sched_job_release(&c->job);
+}
+
+//
+// Resizes the caches for the memory that's to spare, shrinking them right
+// away if they're over. Checks at most once a second unless forced.
+// `stalled` is for when the pressure trigger fired.
+//
+static
+void
+adjust_cache_budgets(_Bool force, _Bool stalled){
+    static double last;
+    double now = paced_now();
+    if(!force && now - last < 1.0) return;
+    last = now;
+    MemSample ms;
+    mem_sample(&ms);
+    ms.triggered = stalled;
+    size_t held = decode_cache.bytes + compressed_cache.bytes + payload_cache.bytes;
+    size_t total = mem_cache_budget(&ms, held, cache_max);
+    // Below this it isn't much of a cache.
+    size_t floor = (size_t)16 << 20;
+    if(total < floor) total = cache_max < floor? cache_max : floor;
+    // Split as the defaults are, 2:2:1.
+    decode_cache.budget = total / 5 * 2;
+    compressed_cache.budget = total / 5 * 2;
+    payload_cache.budget = total / 5;
+    imgcache_shrink(&compressed_cache, compressed_cache.budget);
+    imgcache_shrink(&decode_cache, decode_cache.budget);
+    imgcache_shrink(&payload_cache, payload_cache.budget);
+    prefetch.budget = decode_cache.budget/2;
+}
+
+static
+void
+sixel_on_workers(void (*fn)(void*, int), void* ctx, int count){
+    sched_for(&scheduler, count, fn, ctx);
+}
+
+// Stops the workers on the way out.
+static
+void
+render_shutdown(void){
+    sched_shutdown(&scheduler);
+}
+
+static
+void
+render_init(void){
+    have_scheduler = sched_init(&scheduler, 0) == 0;
+    if(have_scheduler){
+        atexit(render_shutdown);
+        sixel_parallel = sixel_on_workers;
+    }
+    if(have_scheduler && mpmc_init(&render_finished, 4*RENDER_MAX_JOBS) == 0){
+        if(queue_notify_init(&render_notify) == 0){
+            have_render_notify = 1;
+            scheduler.finished = render_job_finished;
+        }
+        else
+            mpmc_destroy(&render_finished);
+    }
+    decode_cache.evicted = compress_evicted;
+    // Prefetched results end up in the decode cache, leave room for the
+    // images the user goes back to.
+    prefetch_init(&prefetch, decode_cache.budget/2, scheduler.nworkers);
+}
+
+static
+_Bool
+render_job_is(const RenderJob* r, const ImgCacheKey* key, const ImgCacheKey* pkey){
+    return imgcache_hash(&r->pkey) == imgcache_hash(pkey)
+        && r->key.w == key->w && r->key.h == key->h
+        && r->key.file_size == key->file_size && r->key.mtime_ns == key->mtime_ns
+        && r->pkey.variant == pkey->variant
+        && r->key.path_length == key->path_length
+        && !memcmp(r->key.path, key->path, key->path_length);
+}
+
+//
+// Moves what the finished job made into the caches and lets go of it.
+//
+static
+void
+render_keep(RenderJob* r){
+    _Bool complete = !r->failed && (r->have & r->want) == r->want;
+    if(complete && r->from_scratch)
+        prefetch_record_render(&prefetch, r->cost, (size_t)r->key.w*(size_t)r->key.h*(size_t)r->n + r->payload.length);
+    if(r->read_time > 0 && !r->warmed)
+        prefetch_record_read(&prefetch, r->read_time);
+    if(r->prefetch){
+        if(complete)
+            prefetch_mark_ready(&prefetch, imgcache_hash(&r->pkey));
+        else
+            prefetch.wasted++;
+    }
+    if(!r->failed){
+        if(r->have & RENDER_PAYLOAD){
+            store_payload(&r->pkey, &r->payload);
+            preupload_wanted = 1;
+        }
+        if(r->have & RENDER_PIXELS){
+            imgcache_put(&decode_cache, &r->key, r->pixels, (size_t)r->key.w*(size_t)r->key.h*(size_t)r->n, r->n);
+            r->pixels = NULL;
+        }
+    }
+    sched_job_release(&r->job);
+}
+
+//
+// Moves what the finished job in slot `i` made into the caches and forgets
+// it. The current image's is presented first.
+//
+static
+void
+render_collect(int i){
+    RenderJob* r = render_jobs[i];
+    render_jobs[i] = NULL;
+    if(r == shown_job){
+        shown_job = NULL;
+        shown_ready = r;
+        return;
+    }
+    render_keep(r);
+}
+
+//
+// Moves what finished jobs made into the caches and forgets them.
+//
+static
+void
+render_harvest(void){
+    if(have_render_notify){
+        queue_notify_clear(&render_notify);
+        _Bool overflowed = atomic_exchange(&render_overflowed, 0);
+        SchedJob* job;
+        while((job = mpmc_pop(&render_finished))){
+            for(int i = 0; i < RENDER_MAX_JOBS; i++)
+                if(render_jobs[i] == (RenderJob*)job) render_collect(i);
+            for(int i = 0; i < COMPRESS_MAX_JOBS; i++)
+                if(compress_jobs[i] == (CompressJob*)job) compress_collect(i);
+            sched_job_release(job);
+        }
+        if(!overflowed) return;
+    }
+    for(int i = 0; i < RENDER_MAX_JOBS; i++){
+        RenderJob* r = render_jobs[i];
+        if(r && sched_job_done(&r->job)) render_collect(i);
+    }
+    for(int i = 0; i < COMPRESS_MAX_JOBS; i++){
+        CompressJob* c = compress_jobs[i];
+        if(c && sched_job_done(&c->job)) compress_collect(i);
+    }
+}
+
+//
+// Files past the prefetch window are read ahead by a job at the lowest
+// priority, a file a stage, so a slow open on a network filesystem doesn't
+// keep a worker from anything more urgent.
+//
+enum {WARM_MAX_FILES = 16};
+typedef struct WarmJob WarmJob;
+struct WarmJob {
+    SchedJob job;
+    int count, next;
+    // Owned.
+    char* paths[WARM_MAX_FILES];
+};
+
+static
+SchedStep
+warm_step(SchedJob* job){
+    WarmJob* w = (WarmJob*)job;
+    if(w->next < w->count)
+        file_will_need(w->paths[w->next++]);
+    return w->next < w->count? SCHED_STEP_MORE : SCHED_STEP_DONE;
+}
+
+static
+void
+warm_destroy(SchedJob* job){
+    WarmJob* w = (WarmJob*)job;
+    for(int i = 0; i < w->count; i++)
+        free(w->paths[i]);
+    free(w);
+}
+
+// Hashes of the files most recently read ahead, from realpaths, 0 for
+// none. Hashes rather than the paths, which can be gone by the time it
+// wraps around. A collision only costs a hint.
+static uint64_t warmed_hashes[WARM_MAX_FILES*2];
+static int warmed_next = 0;
+
+static
+uint64_t
+warm_hash(const char* path){
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(; *path; path++){
+        h ^= (unsigned char)*path;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static
+_Bool
+was_warmed(const char* path){
+    uint64_t h = warm_hash(path);
+    for(size_t i = 0; i < arrlen(warmed_hashes); i++)
+        if(warmed_hashes[i] == h) return 1;
+    return 0;
+}
+
+//
+// Reads ahead the files for these images that haven't been already.
+//
+static
+void
+render_warm_indices(const int* indices, int count){
+    if(!have_scheduler || !count) return;
+    WarmJob* w = calloc(1, sizeof *w);
+    if(!w) return;
+    for(int i = 0; i < count && w->count < WARM_MAX_FILES; i++){
+        int index = indices[i];
+        if(index < 0 || index >= npaths) continue;
+        const char* path = image_path(index).text;
+        if(was_warmed(path)) continue;
+        char* copy = strdup(path);
+        if(!copy) break;
+        w->paths[w->count++] = copy;
+        warmed_hashes[warmed_next] = warm_hash(path);
+        warmed_next = (warmed_next + 1) % (int)arrlen(warmed_hashes);
+    }
+    if(!w->count){
+        free(w);
+        return;
+    }
+    prefetch.warmed += (size_t)w->count;
+    // Nothing waits on it or cancels it, the hints are cheap.
+    sched_job_init(&w->job, warm_step, warm_destroy, SCHED_THUMBNAIL);
+    sched_submit(&scheduler, &w->job);
+    sched_job_release(&w->job);
+}
+
+// The image the goto or search prompt would go to if entered now, -1 if
+// none.
+static int prompt_guess = -1;
+
+//
+// Reads ahead the files past the window.
+//
+static
+void
+render_warm(const PrefetchWindow* win){
+    int indices[PREFETCH_MAX_WARM];
+    int count = 0;
+    for(int i = 1; i <= win->warm && i <= PREFETCH_MAX_WARM; i++)
+        indices[count++] = current + win->direction*(win->ahead + i);
+    render_warm_indices(indices, count);
+}
+
+//
+// Finds the job making this, or starts one from whatever is cached.
+// Returns NULL if there's no scheduler or no room for another job.
+//
+static
+RenderJob*_Nullable
+render_request(const ImgCacheKey* key, const ImgCacheKey* pkey, int x, int y, SchedPriority priority){
+    if(!have_scheduler) return NULL;
+    int free_slot = -1;
+    for(int i = 0; i < RENDER_MAX_JOBS; i++){
+        RenderJob* r = render_jobs[i];
+        if(!r){
+            if(free_slot < 0) free_slot = i;
+            continue;
+        }
+        if(!render_job_is(r, key, pkey)) continue;
+        atomic_store(&r->job.cancelled, 0);
+        if(priority == SCHED_VISIBLE && r->prefetch){
+            r->prefetch = 0;
+            if(sched_job_done(&r->job)) prefetch.hits++;
+            else prefetch.late++;
+        }
+        sched_boost(&scheduler, &r->job, priority);
+        return r;
+    }
+    if(free_slot < 0) return NULL;
+    const Backend* be = &backends[backend];
+    RenderJob* r = calloc(1, sizeof *r);
+    if(!r) return NULL;
+    char* path = malloc(key->path_length+1);
+    if(!path){
+        free(r);
+        return NULL;
+    }
+    memcpy(path, key->path, key->path_length+1);
+    r->key = *key;
+    r->key.path = path;
+    r->pkey = *pkey;
+    r->pkey.path = path;
+    r->x = x;
+    r->y = y;
+    r->want = RENDER_PIXELS;
+    if(be->encode){
+        r->want |= RENDER_PAYLOAD;
+        r->encode = backend == BACKEND_KITTY && kitty_raw? kitty_encode_raw : be->encode;
+        r->kitty_id = payload_kitty_id(imgcache_hash(pkey));
+    }
+    const ImgCacheEntry* e = imgcache_get(&decode_cache, key);
+    if(e && (r->pixels = malloc(e->size))){
+        memcpy(r->pixels, e->pixels, e->size);
+        r->n = e->n;
+        r->have = RENDER_DECODED | RENDER_PIXELS;
+    }
+    else if((e = imgcache_get(&compressed_cache, key)) && (r->compressed = malloc(e->size))){
+        memcpy(r->compressed, e->pixels, e->size);
+        r->compressed_size = e->size;
+        r->n = e->n;
+        r->have = RENDER_COMPRESSED;
+    }
+    else if(disk_cache && read_cached_pixels(key, &r->compressed, &r->compressed_size, &r->n) == 0)
+        r->have = RENDER_COMPRESSED;
+    r->from_scratch = !r->have;
+    r->warmed = was_warmed(key->path);
+    r->prefetch = priority != SCHED_VISIBLE;
+    // A raw kitty payload is the same qoi, it's stored anyway.
+    if(r->from_scratch && r->prefetch && disk_cache && r->encode != kitty_encode_raw)
+        r->want |= RENDER_STORED;
+    if(r->prefetch) prefetch.issued++;
+    sched_job_init(&r->job, render_step, render_destroy, priority);
+    r->job.salvage = render_salvage;
+    if(sched_submit(&scheduler, &r->job)){
+        sched_job_release(&r->job);
+        return NULL;
+    }
+    render_jobs[free_slot] = r;
+    return r;
+}
+
+//
+// Renders the image on the workers, adopting a prefetch of it if there is
+// one, and shows it. `counted` is whether it already went in the prefetch
+// statistics.
+//
+// In the pager this only starts the job, the main loop presents it when
+// the workers say it's done. The daemon, and anything that can't be told
+// when, waits for it.
+// Returns non-zero if it wasn't shown and isn't going to be.
+//
+static
+int
+render_show(const ImgCacheKey* key, const ImgCacheKey* pkey, int x, int y, _Bool counted){
+    const Backend* be = &backends[backend];
+    size_t adopted = prefetch.hits + prefetch.late;
+    // A job that was cancelled partway cached what it got, so the second
+    // one picks up from there.
+    for(int tries = 0; tries < 2; tries++){
+        RenderJob* r = render_request(key, pkey, x, y, SCHED_VISIBLE);
+        if(!r) return 1;
+        if(!tries && !counted && adopted == prefetch.hits + prefetch.late)
+            prefetch.misses++;
+        if(!serving && have_render_notify){
+            shown_job = r;
+            shown_index = current;
+            shown_retried = 0;
+            return 0;
+        }
+        sched_wait(&scheduler, &r->job);
+        if(r->failed) break;
+        if((r->have & r->want) == r->want){
+            if(r->want & RENDER_PAYLOAD)
+                present_payload(r->payload.data, r->payload.length, r->kitty_id, key->w, key->h);
+            else
+                be->show_pixels(r->pixels, key->w, key->h, r->n);
+            render_harvest();
+            return 0;
+        }
+        render_harvest();
+    }
+    render_harvest();
+    return 1;
+}
+
+typedef struct PrefetchTarget PrefetchTarget;
+struct PrefetchTarget {
+    int index;
+    SchedPriority priority;
+    int x, y;
+    ImgCacheKey key, pkey;
+};
+
+//
+// Starts rendering the images the prefetch policy expects to be wanted next,
+// cancelling prefetches that are no longer wanted.
+//
+static
+void
+render_prefetch(void){
+    if(!have_scheduler || serving) return;
+    render_harvest();
+    const Backend* be = &backends[backend];
+    // These are shown from the file by the terminal, there's nothing to do.
+    if(be->show_file && (be->file_scales || !(width || height || scale || auto_scale)))
+        return;
+    PrefetchWindow win = prefetch_window(&prefetch);
+    enum {MAX_WANTED = PREFETCH_MAX_AHEAD + 3};
+    PrefetchTarget wanted[MAX_WANTED];
+    int nwanted = 0;
+    // Where the goto prompt would go is likely to be next.
+    if(prompt_guess >= 0)
+        wanted[nwanted++] = (PrefetchTarget){.index = prompt_guess, .priority = SCHED_NEXT};
+    for(int i = 1; i <= win.ahead; i++)
+        wanted[nwanted++] = (PrefetchTarget){.index = current + win.direction*i, .priority = i == 1? SCHED_NEXT : SCHED_THUMBNAIL};
+    if(win.behind)
+        wanted[nwanted++] = (PrefetchTarget){.index = current - win.direction, .priority = SCHED_PREV};
+    if(win.partner && win.partner != win.direction && win.partner != -win.direction)
+        wanted[nwanted++] = (PrefetchTarget){.index = current + win.partner, .priority = SCHED_NEXT};
+    int nvalid = 0;
+    for(int i = 0; i < nwanted; i++){
+        int index = wanted[i].index;
+        if(index < 0 || index >= npaths || index == current) continue;
+        if(be->show_resident){
+            KittyResident* kr = backend == BACKEND_KITTY? kitty_find_resident(index) : NULL;
+            if(kr && kr->generation == geometry_generation) continue;
+        }
+        wanted[nvalid++] = wanted[i];
+    }
+    // Read all their headers at once.
+    FileBatchItem heads[MAX_WANTED];
+    for(int i = 0; i < nvalid; i++)
+        heads[i] = image_head_item(wanted[i].index);
+    file_batch_read(main_file_batch(), heads, (size_t)nvalid, MALLOCATOR);
+    int nkeyed = 0;
+    for(int i = 0; i < nvalid; i++){
+        int err = image_keys_from(wanted[i].index, &heads[i], &wanted[i].key, &wanted[i].pkey, &wanted[i].x, &wanted[i].y);
+        free(heads[i].data.buff);
+        if(!err) wanted[nkeyed++] = wanted[i];
+    }
+    nvalid = nkeyed;
+    // Let go of jobs for images that aren't wanted any more.
+    for(int j = 0; j < RENDER_MAX_JOBS; j++){
+        RenderJob* r = render_jobs[j];
+        if(!r) continue;
+        _Bool keep = 0;
+        for(int i = 0; i < nvalid; i++)
+            if(render_job_is(r, &wanted[i].key, &wanted[i].pkey)) keep = 1;
+        if(!keep && r != shown_job) sched_cancel(&r->job);
+    }
+    for(int i = 0; i < nvalid; i++){
+        if(be->encode){
+            if(imgcache_contains(&payload_cache, &wanted[i].pkey)) continue;
+            uint64_t hash = imgcache_hash(&wanted[i].pkey);
+            if(disk_cache && payload_id_derived(hash) && payload_exists(hash)) continue;
+        }
+        else if(imgcache_contains(&decode_cache, &wanted[i].key))
+            continue;
+        render_request(&wanted[i].key, &wanted[i].pkey, wanted[i].x, wanted[i].y, wanted[i].priority);
+    }
+    render_warm(&win);
+}
+
+//
+// The window or its cells changed size.
+//
+static
+void
+window_resized(_Bool writing){
+    need_rescale = 1;
+    preupload_wanted = 1;
+    // Start on images at the new size, unless that would get in the way of
+    // the frame going out.
+    if(!writing){
+        rescale();
+        render_prefetch();
+    }
+}
+
+static _Bool print_stats = 0;
+
+// Called at exit, after leaving the alternate screen.
+// How long searches took, see `search_update`.
+static size_t searches;
+static double search_ms_total, search_ms_max;
+
+static
+void
+show_stats(void){
+    fprintf(stderr, "decode cache: %zu hits, %zu misses, %zuMB held\n",
+        decode_cache.hits, decode_cache.misses, decode_cache.bytes >> 20);
+    fprintf(stderr, "compressed cache: %zu hits, %zu misses, %zuMB held\n",
+        compressed_cache.hits, compressed_cache.misses, compressed_cache.bytes >> 20);
+    fprintf(stderr, "payload cache: %zu hits, %zu misses, %zuMB held\n",
+        payload_cache.hits, payload_cache.misses, payload_cache.bytes >> 20);
+    if(kitty_acks)
+        kitty_ack_print_stats(&acks, stderr);
+    if(preuploads)
+        fprintf(stderr, "uploaded ahead: %zu images, %zu shown\n", preuploads, preuploads_used);
+    if(searches)
+        fprintf(stderr, "search: %zu searches, %.3fms mean, %.3fms max\n",
+            searches, search_ms_total / (double)searches, search_ms_max);
+    if(!have_scheduler) return;
+    fprintf(stderr, "scheduler: %d workers, %d steals, %d yields\n",
+        scheduler.nworkers, atomic_load(&scheduler.steals), atomic_load(&scheduler.yields));
+    prefetch_print_stats(&prefetch, stderr);
+}
+
+//
+// Shows the current image by decoding it on this thread, when the workers
+// couldn't. `key` and `pkey` are from image_keys, if they could be worked
+// out.
+// Returns non-zero if it couldn't be shown.
+//
+static
+int
+show_image_here(StringView path, const ImgCacheKey*_Nullable key, const ImgCacheKey*_Nullable pkey){
+    if(key && pkey){
+        // What a render got before failing is cached.
+        const ImgCacheEntry* e = imgcache_get(&decode_cache, key);
+        if(e)
+            return show_decoded(e->pixels, e->w, e->h, e->n, pkey);
+    }
+    int w, h, n;
+    #if DO_TIMING
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+    #endif
+    uint8_t* data;
+    if(load_scaled(path.text, out, &data, &w, &h, &n))
+        return 1;
+    // The header could in theory disagree with what got decoded.
+    if(key && (key->w != w || key->h != h)) key = pkey = NULL;
+    int result = show_decoded(data, w, h, n, pkey);
+    #if DO_TIMING
+        clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+        fprintf(out, "%.3fs\n", (double)t1.tv_sec+(double)t1.tv_nsec/1e9-(double)t0.tv_sec-(double)t0.tv_nsec/1e9);
+    #endif
+    if(key)
+        imgcache_put(&decode_cache, key, data, (size_t)w*(size_t)h*(size_t)n, n);
+    else
+        free(data);
+    return result;
+}
+
+//
+// Shows the current image, or starts rendering it for the main loop to
+// show, see render_show.
+// Returns non-zero if it couldn't be shown.
+//
+static
+int
+show_image(void){
+    StringView path = image_path(current);
+    int path_err = image_path_error(current);
+    if(path_err){
+        fprintf(out, "%s: %s\n", path.text, strerror(path_err));
+        return 1;
+    }
+    const Backend* be = &backends[backend];
+    // Whatever was being rendered for the last one carries on as a
+    // prefetch, or is cancelled as one.
+    shown_job = NULL;
+    if(shown_ready){
+        render_keep(shown_ready);
+        shown_ready = NULL;
+    }
+    if(need_rescale) rescale();
+    if(be->show_resident && be->show_resident(current) == 0)
+        return 0;
+    // At its native size it could be bigger than a pane.
+    if(!(width || height || scale || auto_scale || pane.cols) && be->show_file){
+        if(be->show_file(path, 0, 0) == 0)
+            return 0;
+    }
+    int x, y;
+    // If we know what size it will end up, it might already be cached.
+    ImgCacheKey key = {0}, pkey = {0};
+    if(image_keys(current, &key, &pkey, &x, &y) != 0)
+        return show_image_here(path, NULL, NULL);
+    if(be->file_scales && be->show_file(path, key.w, key.h) == 0)
+        return 0;
+    _Bool was_ready = prefetch_take_ready(&prefetch, imgcache_hash(&pkey));
+    if(was_ready) prefetch.hits++;
+    if(be->encode && show_cached_payload(&pkey) == 0)
+        return 0;
+    if(render_show(&key, &pkey, x, y, was_ready) == 0)
+        return 0;
+    return show_image_here(path, &key, &pkey);
+}
+
+//
+// Shows what the render of the current image made, once the main loop has
+// collected it. A render that was cut short is tried again, and one that
+// failed is done here instead.
+//
+static
+void
+render_present_shown(void){
+    RenderJob* r = shown_ready;
+    shown_ready = NULL;
+    if(shown_index != current){
+        render_keep(r);
+        return;
+    }
+    if(!r->failed && (r->have & r->want) == r->want){
+        if(r->want & RENDER_PAYLOAD)
+            present_payload(r->payload.data, r->payload.length, r->kitty_id, r->pkey.w, r->pkey.h);
+        else
+            backends[backend].show_pixels(r->pixels, r->key.w, r->key.h, r->n);
+        render_keep(r);
+        return;
+    }
+    // The key's path is the job's, it has to stay until done with.
+    sched_job_retain(&r->job);
+    // What it got is cached, so the second go picks up from there.
+    render_keep(r);
+    RenderJob* again = NULL;
+    if(!r->failed && !shown_retried)
+        again = render_request(&r->key, &r->pkey, r->x, r->y, SCHED_VISIBLE);
+    if(again){
+        shown_job = again;
+        shown_retried = 1;
+    }
+    else
+        show_image_here(image_path(current), &r->key, &r->pkey);
+    sched_job_release(&r->job);
+}
+
+//
+// Goto prompt
+// -----------
+// Typing a number and then Enter goes to that image. The prompt is handled
+// by the main loop like any other key rather than by reading a line, so
+// frames, resizes and workers carry on while it's open.
+//
+// Once typing pauses for GOTO_IDLE_MS, the image for the number so far is
+// rendered ahead, and the files for the numbers one more digit would make
+// are read ahead. After typing 12, image 12 is rendered and 120 to 129 are
+// read, so whichever is entered shows straight away.
+//
+enum {GOTO_IDLE_MS = 150, GOTO_MAX_DIGITS = 9};
+typedef struct GotoPrompt GotoPrompt;
+struct GotoPrompt {
+    _Bool active;
+    // What's typed has been rendered ahead.
+    _Bool speculated;
+    int length;
+    char digits[GOTO_MAX_DIGITS];
+    double typed_at;
+};
+static GotoPrompt goto_prompt;
+
+static
+void
+goto_draw(void){
+    fprintf(out, "\r\033[2K%.*s", goto_prompt.length, goto_prompt.digits);
+    fflush(out);
+}
+
+static
+void
+goto_typed(void){
+    goto_prompt.typed_at = paced_now();
+    goto_prompt.speculated = 0;
+    goto_draw();
+}
+
+static
+void
+goto_open(char digit){
+    goto_prompt = (GotoPrompt){.active = 1, .length = 1, .digits = {digit}};
+    goto_typed();
+}
+
+static
+void
+goto_close(void){
+    goto_prompt.active = 0;
+    prompt_guess = -1;
+    fputs("\r\033[2K", out);
+    fflush(out);
+}
+
+//
+// Returns the image the number typed so far is, -1 if nothing's typed.
+//
+static
+int
+goto_target(void){
+    if(!goto_prompt.length) return -1;
+    IntResult ir = parse_int(goto_prompt.digits, (size_t)goto_prompt.length);
+    if(ir.errored) return -1;
+    int index = ir.result - 1;
+    if(index < 0) index = 0;
+    if(index >= npaths) index = npaths - 1;
+    return index;
+}
+
+//
+// Returns milliseconds until what's typed should be rendered ahead, -1 if
+// it doesn't need to be.
+//
+static
+int
+goto_timeout_ms(double now){
+    if(!goto_prompt.active || goto_prompt.speculated) return -1;
+    double left = goto_prompt.typed_at + GOTO_IDLE_MS/1000. - now;
+    return left > 0? (int)(left * 1000) + 1 : 0;
+}
+
+//
+// Renders ahead the image for what's typed and reads ahead the files for
+// the numbers it could become.
+//
+static
+void
+goto_speculate(void){
+    goto_prompt.speculated = 1;
+    prompt_guess = goto_target();
+    if(prompt_guess < 0) return;
+    render_prefetch();
+    IntResult ir = parse_int(goto_prompt.digits, (size_t)goto_prompt.length);
+    if(ir.errored || ir.result > INT_MAX / 10) return;
+    int probes[10];
+    for(int i = 0; i < 10; i++)
+        probes[i] = (int)ir.result*10 + i - 1;
+    render_warm_indices(probes, 10);
+}
+
+//
+// Takes a key typed at the goto prompt.
+// Returns the image to go to once the number is entered, -1 otherwise.
+//
+static
+int
+goto_key(int key){
+    switch(key){
+        case '0' ... '9':
+            if(goto_prompt.length < GOTO_MAX_DIGITS){
+                goto_prompt.digits[goto_prompt.length++] = (char)key;
+                goto_typed();
+            }
+            return -1;
+        case 127: case 8: // Backspace
+            if(--goto_prompt.length > 0)
+                goto_typed();
+            else
+                goto_close();
+            return -1;
+        case '\r': case '\n':{
+            int index = goto_target();
+            goto_close();
+            return index;
+        }
+        case '\033': case 3: case 7: case 21: // Escape, CTRL-C, CTRL-G, CTRL-U
+            goto_close();
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+//
+// Search
+// ------
+// `/` opens a prompt for finding images by name. The paths are indexed in
+// the background as they're loaded (see trigram.h) and searched again on
+// every key, the best SEARCH_MAX_SHOWN shown above the prompt. Up and Down
+// (or Tab, CTRL-N and CTRL-P) pick one and Enter goes to it.
+//
+// Like the goto prompt it's handled by the main loop a key at a time. The
+// line and where the cursor is in it are kept in a GetInputCtx. Once
+// typing pauses for SEARCH_IDLE_MS the picked image is rendered ahead, so
+// it's usually ready by the time it's entered.
+//
+enum {SEARCH_IDLE_MS = 150, SEARCH_MAX_SHOWN = 8};
+typedef struct SearchPrompt SearchPrompt;
+struct SearchPrompt {
+    _Bool active;
+    // The picked result has been rendered ahead.
+    _Bool speculated;
+    GetInputCtx line;
+    TrigramMatch results[SEARCH_MAX_SHOWN];
+    int nresults, total, selected;
+    // How long finding them took.
+    double ms;
+    // How many rows at the bottom are drawn on, the prompt's included.
+    int rows;
+    double typed_at;
+};
+static SearchPrompt search;
+static TrigramIndex path_index;
+
+static
+void
+search_draw(void){
+    TermSize sz = term_size();
+    int shown = search.nresults < sz.rows - 1? search.nresults : sz.rows - 1;
+    if(shown < 0) shown = 0;
+    // Rows drawn on before that aren't now.
+    for(int row = sz.rows - search.rows + 1; row < sz.rows - shown; row++)
+        fprintf(out, "\033[%d;1H\033[2K", row);
+    for(int i = 0; i < shown; i++){
+        const TrigramMatch* m = &search.results[i];
+        _Bool picked = i == search.selected;
+        char number[16];
+        int nlen = snprintf(number, sizeof number, "%d ", m->index + 1);
+        // Long paths lose their start, the name is what was searched for.
+        StringView path = imgpaths[m->index];
+        int room = sz.columns - 2 - nlen;
+        if(room < 0) room = 0;
+        if(path.length > (size_t)room){
+            path.text += path.length - (size_t)room;
+            path.length = (size_t)room;
+        }
+        fprintf(out, "\033[%d;1H\033[2K%s%s%.*s%s", sz.rows - shown + i,
+            picked? "\033[7m> " : "  ", number, (int)path.length, path.text,
+            picked? "\033[27m" : "");
+    }
+    fprintf(out, "\033[%d;1H\033[2K%.*s%.*s", sz.rows,
+        (int)search.line.prompt.length, search.line.prompt.text,
+        (int)search.line.buff_count, search.line.buff);
+    if(search.line.buff_count)
+        fprintf(out, "  \033[2m%d found in %.2fms\033[22m", search.total, search.ms);
+    fprintf(out, "\033[%d;%zuH", sz.rows, search.line.prompt.length + search.line.buff_cursor + 1);
+    fflush(out);
+    search.rows = shown + 1;
+}
+
+//
+// Searches again for what's typed.
+//
+static
+void
+search_update(void){
+    double start = paced_now();
+    search.total = trigram_search(&path_index, search.line.buff, search.line.buff_count,
+        search.results, SEARCH_MAX_SHOWN, &search.nresults);
+    search.ms = (paced_now() - start) * 1000;
+    if(search.line.buff_count){
+        searches++;
+        search_ms_total += search.ms;
+        if(search.ms > search_ms_max) search_ms_max = search.ms;
+    }
+    search.selected = 0;
+    search.typed_at = paced_now();
+    search.speculated = 0;
+    search_draw();
+}
+
+static
+void
+search_open(void){
+    search.active = 1;
+    search.line.prompt = SV("/");
+    search.line.buff_count = 0;
+    search.line.buff_cursor = 0;
+    search.rows = 0;
+    // Back to wherever frames leave it when done.
+    fputs("\0337", out);
+    search_update();
+}
+
+static
+void
+search_close(void){
+    search.active = 0;
+    prompt_guess = -1;
+    TermSize sz = term_size();
+    for(int row = sz.rows - search.rows + 1; row <= sz.rows; row++)
+        fprintf(out, "\033[%d;1H\033[2K", row);
+    fputs("\0338", out);
+    fflush(out);
+}
+
+//
+// Returns milliseconds until the picked result should be rendered ahead,
+// -1 if it doesn't need to be.
+//
+static
+int
+search_timeout_ms(double now){
+    if(!search.active || search.speculated) return -1;
+    double left = search.typed_at + SEARCH_IDLE_MS/1000. - now;
+    return left > 0? (int)(left * 1000) + 1 : 0;
+}
+
+static
+void
+search_speculate(void){
+    search.speculated = 1;
+    prompt_guess = search.nresults? search.results[search.selected].index : -1;
+    if(prompt_guess >= 0)
+        render_prefetch();
+}
+
+//
+// Picks the result `by` away from the picked one, wrapping around.
+//
+static
+void
+search_pick(int by){
+    if(!search.nresults) return;
+    search.selected = (search.selected + by + search.nresults) % search.nresults;
+    search.typed_at = paced_now();
+    search.speculated = 0;
+    search_draw();
+}
+
+//
+// Puts a character in the line at the cursor, as utf-8.
+//
+static
+void
+search_insert(int key){
+    char utf8[4];
+    size_t n;
+    if(key < 0x80){
+        utf8[0] = (char)key;
+        n = 1;
+    }
+    else if(key < 0x800){
+        utf8[0] = (char)(0xc0 | key >> 6);
+        utf8[1] = (char)(0x80 | (key & 0x3f));
+        n = 2;
+    }
+    else if(key < 0x10000){
+        utf8[0] = (char)(0xe0 | key >> 12);
+        utf8[1] = (char)(0x80 | (key >> 6 & 0x3f));
+        utf8[2] = (char)(0x80 | (key & 0x3f));
+        n = 3;
+    }
+    else {
+        utf8[0] = (char)(0xf0 | key >> 18);
+        utf8[1] = (char)(0x80 | (key >> 12 & 0x3f));
+        utf8[2] = (char)(0x80 | (key >> 6 & 0x3f));
+        utf8[3] = (char)(0x80 | (key & 0x3f));
+        n = 4;
+    }
+    GetInputCtx* line = &search.line;
+    if(line->buff_count + n >= sizeof line->buff) return;
+    memmove(line->buff + line->buff_cursor + n, line->buff + line->buff_cursor, line->buff_count - line->buff_cursor);
+    memcpy(line->buff + line->buff_cursor, utf8, n);
+    line->buff_count += n;
+    line->buff_cursor += n;
+    search_update();
+}
+
+//
+// Takes out the `n` bytes of the line from `at`.
+//
+static
+void
+search_delete(size_t at, size_t n){
+    GetInputCtx* line = &search.line;
+    memmove(line->buff + at, line->buff + at + n, line->buff_count - at - n);
+    line->buff_count -= n;
+    line->buff_cursor = at;
+    search_update();
+}
+
+//
+// Takes a key typed at the search prompt.
+// Returns the image to go to once one is picked, -1 otherwise.
+//
+static
+int
+search_key(const GiEvent* ev){
+    GetInputCtx* line = &search.line;
+    if(ev->mods & (GI_MOD_ALT|GI_MOD_SUPER)) return -1;
+    switch(ev->key){
+        case GI_KEY_UP: case 16: // CTRL-P
+            search_pick(-1);
+            return -1;
+        case GI_KEY_DOWN: case '\t': case 14: // CTRL-N
+            search_pick(+1);
+            return -1;
+        case GI_KEY_LEFT: case 2: // CTRL-B
+            // Back over a whole utf-8 sequence.
+            while(line->buff_cursor && (line->buff[--line->buff_cursor] & 0xc0) == 0x80)
+                ;
+            search_draw();
+            return -1;
+        case GI_KEY_RIGHT: case 6: // CTRL-F
+            while(line->buff_cursor < line->buff_count && (line->buff[++line->buff_cursor] & 0xc0) == 0x80)
+                ;
+            if(line->buff_cursor > line->buff_count) line->buff_cursor = line->buff_count;
+            search_draw();
+            return -1;
+        case GI_KEY_HOME: case 1: // CTRL-A
+            line->buff_cursor = 0;
+            search_draw();
+            return -1;
+        case GI_KEY_END: case 5: // CTRL-E
+            line->buff_cursor = line->buff_count;
+            search_draw();
+            return -1;
+        case 127: case 8:{ // Backspace
+            if(!line->buff_count){
+                search_close();
+                return -1;
+            }
+            size_t end = line->buff_cursor;
+            if(!end) return -1;
+            size_t at = end - 1;
+            while(at && (line->buff[at] & 0xc0) == 0x80) at--;
+            search_delete(at, end - at);
+            return -1;
+        }
+        case GI_KEY_DELETE:{
+            size_t at = line->buff_cursor;
+            if(at == line->buff_count) return -1;
+            size_t end = at + 1;
+            while(end < line->buff_count && (line->buff[end] & 0xc0) == 0x80) end++;
+            search_delete(at, end - at);
+            return -1;
+        }
+        case 21: // CTRL-U
+            search_delete(0, line->buff_cursor);
+            return -1;
+        case '\r': case '\n':{
+            int index = search.nresults? search.results[search.selected].index : -1;
+            search_close();
+            return index;
+        }
+        case '\033': case 3: case 7: // Escape, CTRL-C, CTRL-G
+            search_close();
+            return -1;
+        default:
+            if(ev->key >= ' ' && ev->key < GI_KEY_UP && ev->key != 127)
+                search_insert(ev->key);
+            return -1;
+    }
+}
+
+//
+// Uploading ahead
+// ---------------
+// Once the current image is out and nothing else is going on, the image
+// the user is likely to go to next is transmitted (a=t, without placing
+// it) if its payload has been made. Going to it is then just a placement,
+// which over ssh is a round trip instead of megabytes.
+//
+// The upload is a frame of its own. A key that goes anywhere else cuts it
+// short like any other frame. One that goes to it lets it finish, and the
+// placement is queued after it.
+//
+
+// The image being uploaded by the current frame, -1 if none.
+static int preupload_index = -1;
+// What `image_keys` said last time, it reads the file.
+static int preupload_keyed = -1, preupload_keyed_generation;
+static ImgCacheKey preupload_pkey;
 
+//
+// Starts uploading the next image, if there's one to upload.
+// Returns non-zero while the upload is being written.
+//
 static
-int npaths = 0;
+int
+preupload_next(void){
+    preupload_wanted = 0;
+    if(backend != BACKEND_KITTY || !pacing) return 0;
+    PrefetchWindow win = prefetch_window(&prefetch);
+    int index = current + (win.direction? win.direction : 1);
+    if(index < 0 || index >= npaths || image_path_error(index)) return 0;
+    KittyResident* r = kitty_find_resident(index);
+    if(r && r->generation == geometry_generation) return 0;
+    if(preupload_keyed != index || preupload_keyed_generation != geometry_generation){
+        ImgCacheKey key;
+        int x, y;
+        preupload_keyed = -1;
+        if(image_keys(index, &key, &preupload_pkey, &x, &y)) return 0;
+        preupload_keyed = index;
+        preupload_keyed_generation = geometry_generation;
+    }
+    const ImgCacheKey* pkey = &preupload_pkey;
+    uint64_t hash = imgcache_hash(pkey);
+    const char* data;
+    size_t length;
+    PayloadMapping m;
+    _Bool mapped = 0;
+    if(imgcache_contains(&payload_cache, pkey)){
+        const ImgCacheEntry* e = imgcache_get(&payload_cache, pkey);
+        data = (const char*)e->pixels;
+        length = e->size;
+    }
+    else {
+        PayloadFileHeader want = payload_file_header(pkey);
+        if(!disk_cache || !payload_id_derived(hash) || payload_map(&m, hash, &want, pkey->path)) return 0;
+        mapped = 1;
+        data = m.data;
+        length = m.length;
+    }
+    int id = payload_kitty_id(hash);
+    frame_begin();
+    frame_kitty_id = id;
+    r = kitty_claim_resident(index, id);
+    r->unplaced = 1;
+    r->w = pkey->w;
+    r->h = pkey->h;
+    int err = 0;
+    if(kitty_raw){
+        err = kitty_transmit_qoi(data, length, id);
+        gfx_end();
+        fflush(out);
+        paced_frame_mark(&pacer);
+    }
+    else
+        write_payload(data, length);
+    if(mapped) payload_unmap(&m);
+    if(err){
+        frame_abort();
+        kitty_forget_id(id);
+        return 0;
+    }
+    preupload_index = index;
+    preuploads++;
+    return frame_pump();
+}
+
+//
+// Batch mode
+// ----------
+// Renders every image to a file in a directory instead of the terminal:
+// either the escape sequences a backend would have written (so showing it
+// later is just a `cat`) or a png of the resized pixels.
+//
+// One worker per core, each taking the next image. Before decoding, a
+// worker reserves the memory the image will need from a shared budget and
+// waits if it's exhausted, so a handful of huge images can't all be in
+// memory at once.
+//
+typedef struct BatchCtx BatchCtx;
+struct BatchCtx {
+    const char* outdir;
+    _Bool png;
+    atomic_int next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t in_flight, budget;
+    // Totals, under the lock.
+    size_t bytes_in, bytes_out;
+    int done, failed;
+};
 
 static
-int current = 0;
-static int width = 0, height = 0;
+void
+batch_put_base64(FILE* fp, const void* d, size_t size){
+    const char* data = d;
+    char b64buff[4096];
+    while(size){
+        size_t chunk = (sizeof b64buff)/4*3;
+        if(chunk > size) chunk = size;
+        size_t used = base64_encode(b64buff, sizeof b64buff, data, chunk);
+        while(used % 4 != 0) b64buff[used++] = '=';
+        fwrite(b64buff, used, 1, fp);
+        data += chunk;
+        size -= chunk;
+    }
+}
 
-static double scale=0;
-static _Bool auto_height = 0, auto_width = 0, auto_scale = 0;
-static _Bool need_rescale = 1;
+//
+// Writes what the backend would have sent to show these pixels at the
+// cursor.
+// Returns non-zero on failure.
+//
+static
+int
+batch_write_escapes(FILE* fp, const uint8_t* pixels, int w, int h, int n){
+    switch(backend){
+        case BACKEND_KITTY:
+        case BACKEND_ITERM:{
+            int len;
+            unsigned char* png = stbi_write_png_to_mem(pixels, 0, w, h, n, &len);
+            if(!png) return 1;
+            if(backend == BACKEND_ITERM){
+                fprintf(fp, "\033]1337;File=inline=1;size=%d;width=%dpx;height=%dpx:", len, w, h);
+                batch_put_base64(fp, png, (size_t)len);
+                fputs("\a\n", fp);
+            }
+            else {
+                // Chunks of 3072 bytes are 4096 of base64, the most kitty
+                // takes at once.
+                for(int off = 0; off < len; off += 3072){
+                    int chunk = len - off < 3072? len - off : 3072;
+                    int more = off + chunk < len;
+                    if(!off)
+                        fprintf(fp, "\033_Ga=T,f=100,q=2,m=%d;", more);
+                    else
+                        fprintf(fp, "\033_Gm=%d;", more);
+                    batch_put_base64(fp, png+off, (size_t)chunk);
+                    fputs("\033\\", fp);
+                }
+                fputs("\n", fp);
+            }
+            STBIW_FREE(png);
+            return 0;
+        }
+        case BACKEND_SIXEL:{
+            // Already one worker per core.
+            SixelOptions opts = {.dither = dither, .nthreads = 1};
+            SixelBuffer buf = {0};
+            int err = sixel_encode(pixels, w, h, n, &opts, &buf);
+            if(!err){
+                fwrite(buf.data, buf.length, 1, fp);
+                fputs("\n", fp);
+            }
+            free(buf.data);
+            return err;
+        }
+        case BACKEND_BLOCKS:
+        case BACKEND_BRAILLE:{
+            TextFrame frame = {0};
+            if(text_frame_build(&frame, backend == BACKEND_BRAILLE? TEXT_BRAILLE : TEXT_HALFBLOCK, pixels, w, h, n))
+                return 1;
+            text_frame_emit(fp, &frame, NULL, 0, 0);
+            fprintf(fp, "\033[%d;1H", frame.rows+1);
+            text_frame_destroy(&frame);
+            return 0;
+        }
+        case BACKEND_COUNT:
+            break;
+    }
+    return 1;
+}
 
+static
+void
+batch_reserve(BatchCtx* ctx, size_t bytes){
+    pthread_mutex_lock(&ctx->lock);
+    // Something has to be allowed through, however big.
+    while(ctx->in_flight && ctx->in_flight + bytes > ctx->budget)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    ctx->in_flight += bytes;
+    pthread_mutex_unlock(&ctx->lock);
+}
 
 static
 void
-sighandler(int sig){
-    if(sig == SIGWINCH)
-        return need_rescale = 1, (void)0;
+batch_release(BatchCtx* ctx, size_t bytes){
+    pthread_mutex_lock(&ctx->lock);
+    ctx->in_flight -= bytes;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
 }
 
+//
+// Decodes, resizes and writes out one image.
+// Returns non-zero on failure.
+//
 static
-void rescale(void){
-    TermSize sz = get_terminal_size();
-    if(auto_width || auto_scale) width = sz.xpix;
-    if(auto_height || auto_scale) height = sz.ypix*(sz.rows-2)/sz.rows;
-    need_rescale = 0;
+int
+batch_one(BatchCtx* ctx, int i, size_t* bytes_in, size_t* bytes_out){
+    const char* path = imgpaths[i].text;
+    int x, y, n, w, h;
+    struct stat st;
+    if(stat(path, &st) != 0 || !stbi_info(path, &x, &y, &n)){
+        fprintf(stderr, "Failed to load %s\n", path);
+        return 1;
+    }
+    target_size(x, y, &w, &h);
+    // Decoded plus resized plus about as much again for the encoder.
+    size_t reserve = (size_t)x*(size_t)y*4 + (size_t)w*(size_t)h*4*2;
+    batch_reserve(ctx, reserve);
+    int result = 1;
+    uint8_t* pixels = NULL;
+    FILE* fp = NULL;
+    if(load_scaled(path, stderr, &pixels, &w, &h, &n))
+        goto finally;
+    const char* base = strrchr(path, '/');
+    base = base? base+1 : path;
+    char outpath[4096];
+    int len = snprintf(outpath, sizeof outpath, "%s/%04d-%s.%s", ctx->outdir, i+1, base, ctx->png? "png" : backend_names[backend].text);
+    if(len < 0 || (size_t)len >= sizeof outpath){
+        fprintf(stderr, "Output path for %s is too long\n", path);
+        goto finally;
+    }
+    if(ctx->png){
+        if(!stbi_write_png(outpath, w, h, n, pixels, 0)){
+            fprintf(stderr, "Failed to write %s\n", outpath);
+            goto finally;
+        }
+    }
+    else {
+        fp = fopen(outpath, "wb");
+        if(!fp){
+            fprintf(stderr, "Failed to open %s: %s\n", outpath, strerror(errno));
+            goto finally;
+        }
+        if(batch_write_escapes(fp, pixels, w, h, n)){
+            fprintf(stderr, "Failed to encode %s\n", path);
+            goto finally;
+        }
+        if(fclose(fp) != 0){
+            fp = NULL;
+            fprintf(stderr, "Failed to write %s\n", outpath);
+            goto finally;
+        }
+        fp = NULL;
+    }
+    struct stat ost;
+    if(stat(outpath, &ost) == 0) *bytes_out += (size_t)ost.st_size;
+    *bytes_in += (size_t)st.st_size;
+    result = 0;
+    finally:
+    if(fp) fclose(fp);
+    free(pixels);
+    batch_release(ctx, reserve);
+    return result;
+}
+
+static
+void*_Nullable
+batch_worker(void* p){
+    BatchCtx* ctx = p;
+    size_t bytes_in = 0, bytes_out = 0;
+    int done = 0, failed = 0;
+    for(;;){
+        int i = atomic_fetch_add(&ctx->next, 1);
+        if(i >= npaths) break;
+        if(batch_one(ctx, i, &bytes_in, &bytes_out))
+            failed++;
+        else
+            done++;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    ctx->bytes_in += bytes_in;
+    ctx->bytes_out += bytes_out;
+    ctx->done += done;
+    ctx->failed += failed;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static
+int
+run_batch(const char* outdir, _Bool png){
+    if(mkdir(outdir, 0755) != 0 && errno != EEXIST){
+        fprintf(stderr, "Unable to create %s: %s\n", outdir, strerror(errno));
+        return 1;
+    }
+    BatchCtx ctx = {
+        .outdir = outdir,
+        .png = png,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .budget = decode_cache.budget + compressed_cache.budget,
+    };
+    atomic_init(&ctx.next, 0);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0? (int)ncpu : 1;
+    if(nthreads > npaths) nthreads = npaths;
+    enum {MAX_BATCH_THREADS = 64};
+    if(nthreads > MAX_BATCH_THREADS) nthreads = MAX_BATCH_THREADS;
+    pthread_t threads[MAX_BATCH_THREADS];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    // This thread is worker 0.
+    int started = 1;
+    for(; started < nthreads; started++)
+        if(pthread_create(&threads[started], NULL, batch_worker, &ctx) != 0)
+            break;
+    batch_worker(&ctx);
+    for(int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec)/1e9;
+    if(elapsed <= 0) elapsed = 1e-9;
+    fprintf(stderr, "Wrote %d of %d images in %.3fs with %d threads: %.1f images/s, %.1f MB/s read, %.1f MB/s written\n",
+        ctx.done, npaths, elapsed, started,
+        ctx.done/elapsed, ctx.bytes_in/elapsed/1e6, ctx.bytes_out/elapsed/1e6);
+    return ctx.failed != 0;
+}
+
+//
+// Times the qoi codec the caches use against png, which is what stb would
+// otherwise be used for, and the raw kitty transcode, on each image.
+// Throughput is in megabytes of pixels a second, best of a few runs.
+//
+static
+int
+run_codec_bench(void){
+    enum {RUNS = 5};
+    for(int i = 0; i < npaths; i++){
+        const char* path = imgpaths[i].text;
+        int w, h, n;
+        uint8_t* pixels = stbi_load(path, &w, &h, &n, 0);
+        if(!pixels){
+            fprintf(stderr, "Failed to load %s\n", path);
+            continue;
+        }
+        size_t size = (size_t)w*(size_t)h*(size_t)n;
+        uint8_t* roundtrip = malloc(size);
+        uint8_t* qoi = NULL;
+        size_t qoi_len = 0;
+        unsigned char* png = NULL;
+        int png_len = 0;
+        PayloadBuffer wire = {0};
+        double best[5] = {1e9, 1e9, 1e9, 1e9, 1e9};
+        _Bool ok = roundtrip != NULL;
+        for(int run = 0; run < RUNS && ok; run++){
+            double t[6];
+            t[0] = paced_now();
+            free(qoi);
+            qoi = NULL;
+            ok = qoi_encode(pixels, w, h, n, &qoi, &qoi_len) == 0;
+            t[1] = paced_now();
+            ok = ok && qoi_decode_into(qoi, qoi_len, roundtrip) == 0 && memcmp(roundtrip, pixels, size) == 0;
+            t[2] = paced_now();
+            if(png) STBIW_FREE(png);
+            png = stbi_write_png_to_mem(pixels, 0, w, h, n, &png_len);
+            t[3] = paced_now();
+            int x, y, c;
+            uint8_t* back = png? stbi_load_from_memory(png, png_len, &x, &y, &c, 0) : NULL;
+            ok = ok && back;
+            stbi_image_free(back);
+            t[4] = paced_now();
+            wire.length = 0;
+            gfx_begin_capture(&wire);
+            if(ok && kitty_transmit_qoi((const char*)qoi, qoi_len, 1)) ok = 0;
+            if(gfx_end_capture()) ok = 0;
+            t[5] = paced_now();
+            for(int k = 0; k < 5; k++)
+                if(t[k+1] - t[k] < best[k]) best[k] = t[k+1] - t[k];
+        }
+        if(ok){
+            double mb = (double)size / 1e6;
+            printf("%s: %dx%d, %d channels, %.1fMB\n", path, w, h, n, mb);
+            printf("  qoi: ratio %5.2f, encode %7.1f MB/s, decode %7.1f MB/s\n",
+                (double)size/(double)qoi_len, mb/best[0], mb/best[1]);
+            printf("  png: ratio %5.2f, encode %7.1f MB/s, decode %7.1f MB/s\n",
+                (double)size/(double)png_len, mb/best[2], mb/best[3]);
+            printf("  qoi to kitty raw: %7.1f MB/s\n", mb/best[4]);
+        }
+        else
+            fprintf(stderr, "Failed to benchmark %s\n", path);
+        free(wire.data);
+        if(png) STBIW_FREE(png);
+        free(qoi);
+        free(roundtrip);
+        stbi_image_free(pixels);
+    }
+    return 0;
 }
 
-static void begin_synchronized_update(void){ printf("\033[?2026h"); }
-static void end_synchronized_update(void){ printf("\033[?2026l"); }
-static void go_to_topleft(void){ printf("\033[H"); }
-static void clear_screen(void){ printf("\033[2J"); }
+//
+// Times handing pointers from one thread to another: the lock-free queues
+// against a queue behind a mutex and condition variables, the way the
+// scheduler's are. Then how long a thread asleep on each takes to wake up
+// for an item, polling a QueueNotify or waiting on the condition variable.
+//
+enum {QBENCH_ITEMS = 1 << 20, QBENCH_WAKEUPS = 2000, QBENCH_LOCKED = 1024};
+
+typedef enum QueueBenchKind {
+    QBENCH_SPSC,
+    QBENCH_MPMC,
+    QBENCH_MUTEX,
+} QueueBenchKind;
+
+typedef struct QueueBench QueueBench;
+struct QueueBench {
+    QueueBenchKind kind;
+    SpscRing spsc;
+    MpmcQueue mpmc;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    void* locked[QBENCH_LOCKED];
+    size_t head, count;
+    QueueNotify notify;
+    // Items each producer pushes, and for the wakeups, when each was.
+    size_t items;
+    double pushed[QBENCH_WAKEUPS];
+    _Bool wakeups;
+};
 
 static
 void
-restore_buff(void){
-    end_synchronized_update();
-    printf("\033[?1049l");
-    fflush(stdout);
+qbench_push(QueueBench* b, void* item){
+    switch(b->kind){
+        case QBENCH_SPSC:
+            while(spsc_push(&b->spsc, item)) sched_yield();
+            break;
+        case QBENCH_MPMC:
+            while(mpmc_push(&b->mpmc, item)) sched_yield();
+            break;
+        case QBENCH_MUTEX:
+            pthread_mutex_lock(&b->lock);
+            while(b->count == QBENCH_LOCKED)
+                pthread_cond_wait(&b->not_full, &b->lock);
+            b->locked[(b->head + b->count++) % QBENCH_LOCKED] = item;
+            pthread_cond_signal(&b->not_empty);
+            pthread_mutex_unlock(&b->lock);
+            break;
+    }
 }
-FILE* flog = NULL;
-#define LOG(mess, ...) do { \
-    if(!flog) \
-        flog = fopen("debug.txt", "w"); \
-    fprintf(flog, "%d: " mess "\n", __LINE__,##__VA_ARGS__); \
-}while(0);
 
-static void
-write_func(void* ctx, void* d, int size){
-    char* data = d;
-    char b64buff[4096];
-    _Bool first = 1;
-    int m = 1;
-    static int id = 13337;
-    while(size > 0){
-        int chunk = (sizeof b64buff)/4*3;
-        if(chunk > size) {
-            chunk = size;
-            m = 0;
+// Waits for an item, by polling the notify fd for the lock-free ones.
+static
+void*
+qbench_pop(QueueBench* b){
+    for(;;){
+        void* item = NULL;
+        switch(b->kind){
+            case QBENCH_SPSC:  item = spsc_pop(&b->spsc); break;
+            case QBENCH_MPMC:  item = mpmc_pop(&b->mpmc); break;
+            case QBENCH_MUTEX:
+                pthread_mutex_lock(&b->lock);
+                while(!b->count)
+                    pthread_cond_wait(&b->not_empty, &b->lock);
+                item = b->locked[b->head];
+                b->head = (b->head + 1) % QBENCH_LOCKED;
+                b->count--;
+                pthread_cond_signal(&b->not_full);
+                pthread_mutex_unlock(&b->lock);
+                return item;
         }
-        int b64_size = base64_encode_size(chunk);
-        int ch = base64_encode(b64buff, sizeof b64buff, data, chunk);
-        if(m == 0 && b64_size < sizeof b64buff){
-            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
-            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
-            if((b64_size % 4) != 0) b64buff[b64_size++] = '=';
+        if(item) return item;
+        if(!b->wakeups){
+            sched_yield();
+            continue;
         }
-        if(first){
-            begin_synchronized_update();
-            go_to_topleft();
-            clear_screen();
-            printf("\033_Gf=100,a=t,i=%d,m=%d,q=1;",++id, m);
-            first = 0;
+        struct pollfd pfd = {.fd = b->notify.fd, .events = POLLIN};
+        poll(&pfd, 1, -1);
+        queue_notify_clear(&b->notify);
+    }
+}
+
+static
+void*_Nullable
+qbench_producer(void* p){
+    QueueBench* b = p;
+    for(size_t i = 0; i < b->items; i++){
+        if(b->wakeups){
+            // Long enough for the consumer to go back to sleep.
+            usleep(200);
+            b->pushed[i] = paced_now();
         }
-        else {
-            printf("\033_Gm=%d;", m);
+        qbench_push(b, (void*)(uintptr_t)(i+1));
+        if(b->wakeups && b->kind != QBENCH_MUTEX)
+            queue_notify_signal(&b->notify);
+    }
+    return NULL;
+}
+
+static
+int
+qbench_cmp_double(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+//
+// Runs `producers` threads pushing into the queue and pops everything on
+// this thread. Returns the seconds it took, or puts the wakeup latencies
+// in `latency`.
+//
+static
+double
+qbench_run(QueueBench* b, int producers, double*_Nullable latency){
+    pthread_t threads[4];
+    double t0 = paced_now();
+    int started = 0;
+    for(; started < producers; started++)
+        if(pthread_create(&threads[started], NULL, qbench_producer, b) != 0)
+            break;
+    for(size_t i = 0; i < b->items*(size_t)started; i++){
+        uintptr_t item = (uintptr_t)qbench_pop(b);
+        if(latency) latency[item-1] = paced_now() - b->pushed[item-1];
+    }
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return paced_now() - t0;
+}
+
+static
+int
+run_queue_bench(void){
+    static QueueBench b;
+    static const char* const names[] = {"spsc ring", "mpmc queue", "mutex+condvar"};
+    b.lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    b.not_empty = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    b.not_full = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    if(spsc_init(&b.spsc, QBENCH_LOCKED) || mpmc_init(&b.mpmc, QBENCH_LOCKED) || queue_notify_init(&b.notify)){
+        fprintf(stderr, "Unable to set up the queues\n");
+        return 1;
+    }
+    printf("handoff, %d items:\n", QBENCH_ITEMS);
+    for(int kind = QBENCH_SPSC; kind <= QBENCH_MUTEX; kind++){
+        b.kind = kind;
+        b.wakeups = 0;
+        // The ring only takes one producer.
+        int producers = kind == QBENCH_SPSC? 1 : 2;
+        b.items = QBENCH_ITEMS / (size_t)producers;
+        double t = qbench_run(&b, producers, NULL);
+        printf("  %-14s %d producer%s: %6.1f ns an item\n", names[kind], producers, producers == 1? " " : "s", t*1e9/QBENCH_ITEMS);
+    }
+    printf("wakeup, %d items:\n", QBENCH_WAKEUPS);
+    static double latency[QBENCH_WAKEUPS];
+    for(int kind = QBENCH_SPSC; kind <= QBENCH_MUTEX; kind += QBENCH_MUTEX - QBENCH_SPSC){
+        b.kind = kind;
+        b.wakeups = 1;
+        b.items = QBENCH_WAKEUPS;
+        qbench_run(&b, 1, latency);
+        qsort(latency, QBENCH_WAKEUPS, sizeof *latency, qbench_cmp_double);
+        printf("  %-14s median %6.1f us, p99 %6.1f us, max %7.1f us\n",
+            kind == QBENCH_MUTEX? "condvar" : "notify fd",
+            latency[QBENCH_WAKEUPS/2]*1e6, latency[QBENCH_WAKEUPS*99/100]*1e6, latency[QBENCH_WAKEUPS-1]*1e6);
+    }
+    spsc_destroy(&b.spsc);
+    mpmc_destroy(&b.mpmc);
+    queue_notify_destroy(&b.notify);
+    return 0;
+}
+
+//
+// Works out which backend to use and how big a cell is, asking the terminal
+// if we have to.
+//
+static
+void
+detect_terminal(_Bool reprobe){
+    mux = detect_multiplexer();
+    if(mux == MUX_TMUX) use_placeholders = 1;
+    // Only talk to the terminal if we need to know something.
+    _Bool need_geometry = !termcaps_have_pixel_size();
+    if(backend == BACKEND_AUTO || need_geometry){
+        TermCaps caps = {0};
+        _Bool known = !reprobe && termcaps_load_cached(&caps) == 0;
+        // Only the protocols are cached. The terminal always answers DA1,
+        // so the timeout only matters if something is badly wrong.
+        if(!known || need_geometry){
+            TermCaps probed;
+            if(termcaps_probe(&probed, 1000, !known, mux == MUX_TMUX) == 0){
+                if(!known){
+                    caps = probed;
+                    termcaps_store_cached(&caps);
+                    known = 1;
+                }
+                caps.cell_width = probed.cell_width;
+                caps.cell_height = probed.cell_height;
+            }
         }
-        printf("%.*s\033\\", b64_size, b64buff);
-        data += chunk;
-        size -= chunk;
+        if(caps.cell_width > 0 && caps.cell_height > 0){
+            cell_width = caps.cell_width;
+            cell_height = caps.cell_height;
+        }
+        if(mux == MUX_TMUX && termcaps_env_kitty())
+            caps.kitty = 1;
+        // Screen can't pass graphics through to the terminal.
+        if(mux == MUX_SCREEN)
+            caps.kitty = caps.sixel = caps.iterm = 0;
+        // With nothing to ask (output going to a file, say), stay with the
+        // default rather than falling all the way back to blocks.
+        if(backend == BACKEND_AUTO && known)
+            backend = choose_backend(&caps);
     }
-    printf("\033_Ga=p,i=%d,q=1\033\\",id);
-    printf("\033_Ga=d,d=i,i=%d,q=1\033\\",id-1);
-    printf("\n\r");
-    printf("\033\\\033[2K%d/%d\n", current+1, npaths);
-    end_synchronized_update();
-    fflush(stdout);
+    if(backend == BACKEND_AUTO) backend = BACKEND_KITTY;
+}
+
+//
+// Shows one image for a client, drawing into its terminal.
+// Takes ownership of path.
+// Returns non-zero if it wasn't shown.
+//
+static
+int
+serve_request(const DaemonRequest* req, char* path, int tty){
+    _Bool bad_pane = req->pane_x < 0 || req->pane_y < 0 || req->pane_cols < 0 || req->pane_rows < 0
+        || req->pane_x > 10000 || req->pane_y > 10000 || req->pane_cols > 10000 || req->pane_rows > 10000
+        || (req->pane_cols && !req->pane_rows);
+    if(req->backend < 0 || req->backend >= BACKEND_COUNT || req->mux > MUX_SCREEN || bad_pane){
+        free(path);
+        return 1;
+    }
+    // Whatever we left in another terminal is no use here.
+    static char term_key[sizeof req->term_key];
+    if(strcmp(term_key, req->term_key) != 0){
+        kitty_drop_resident();
+        memcpy(term_key, req->term_key, sizeof term_key);
+    }
+    _Bool same_geometry = backend == (BackendKind)req->backend
+        && cell_width == req->cell_width && cell_height == req->cell_height
+        && scale == req->scale
+        && auto_width == req->auto_width && auto_height == req->auto_height && auto_scale == req->auto_scale
+        && (req->auto_width || req->auto_scale || width == req->width)
+        && (req->auto_height || req->auto_scale || height == req->height);
+    if(!same_geometry) geometry_generation++;
+    backend = (BackendKind)req->backend;
+    cell_width = req->cell_width;
+    cell_height = req->cell_height;
+    // Auto sizes get worked out by rescale(), keep the old ones to compare.
+    if(!(req->auto_width || req->auto_scale)) width = req->width;
+    if(!(req->auto_height || req->auto_scale)) height = req->height;
+    scale = req->scale;
+    auto_width = req->auto_width;
+    auto_height = req->auto_height;
+    auto_scale = req->auto_scale;
+    use_placeholders = req->placeholders;
+    mux = (Multiplexer)req->mux;
+    Pane asked = {req->pane_x, req->pane_y, req->pane_cols, req->pane_rows};
+    if(memcmp(&asked, &pane, sizeof pane) != 0) geometry_generation++;
+    pane = asked;
+    // Remember every file we've been asked for, that's what the kitty
+    // residency is keyed by.
+    int index = -1;
+    for(int i = 0; i < npaths; i++){
+        if(!strcmp(realpaths[i].text, path)){
+            index = i;
+            break;
+        }
+    }
+    if(index < 0){
+        if(npaths == maxpaths){
+            kitty_drop_resident();
+            for(int i = 0; i < npaths; i++)
+                free((char*)realpaths[i].text);
+            npaths = 0;
+        }
+        index = npaths++;
+        realpaths[index] = imgpaths[index] = (StringView){req->path_length, path};
+    }
+    else
+        free(path);
+    current = index;
+    fflush(out);
+    int saved = dup(STDOUT_FILENO);
+    if(saved < 0) return 1;
+    dup2(tty, STDOUT_FILENO);
+    // The screen has been drawn over since we were last here.
+    if(backends[backend].invalidate) backends[backend].invalidate();
+    need_rescale = 1;
+    adjust_cache_budgets(0, 0);
+    int err = show_image();
+    gfx_end();
+    fflush(out);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return err;
+}
+
+// Requests are drawn one at a time: they share the terminal state above,
+// and `out`.
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Reads a request from a client and shows it. Runs on a thread of its own,
+// so a client that's slow to send its request or read the reply doesn't
+// hold up the others.
+//
+static
+void*_Nullable
+serve_connection(void* p){
+    int conn = (int)(intptr_t)p;
+    // A client that stops talking gives up its place after a while.
+    struct timeval timeout = {.tv_sec = 5};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    DaemonRequest req;
+    char* path;
+    int tty;
+    if(daemon_check_peer(conn) == 0 && daemon_recv_request(conn, &req, &path, &tty) == 0){
+        pthread_mutex_lock(&serve_lock);
+        uint8_t status = (uint8_t)!!serve_request(&req, path, tty);
+        pthread_mutex_unlock(&serve_lock);
+        close(tty);
+        daemon_write_all(conn, &status, 1);
+    }
+    close(conn);
+    return NULL;
+}
+
+static
+int
+run_daemon(const char* socket_path){
+    signal(SIGPIPE, SIG_IGN);
+    int lfd = daemon_listen(socket_path);
+    if(lfd < 0){
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    serving = 1;
+    render_init();
+    for(;;){
+        int conn = accept(lfd, NULL, NULL);
+        if(conn < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            close(lfd);
+            return 1;
+        }
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, serve_connection, (void*)(intptr_t)conn) == 0)
+            pthread_detach(thread);
+        else
+            serve_connection((void*)(intptr_t)conn);
+    }
+}
+
+//
+// Asks the daemon to show the first image, or shows it ourselves if there
+// is no daemon.
+//
+static
+int
+run_client(const char* socket_path){
+    char* path = realpath(imgpaths[0].text, NULL);
+    if(!path){
+        fprintf(stderr, "%s: %s\n", imgpaths[0].text, strerror(errno));
+        return 1;
+    }
+    int sock = *socket_path? daemon_connect(socket_path) : -1;
+    // Whoever is listening gets our terminal, it had better be us.
+    if(sock >= 0 && daemon_check_peer(sock) != 0){
+        fprintf(stderr, "%s isn't ours, not using it.\n", socket_path);
+        close(sock);
+        sock = -1;
+    }
+    if(sock < 0){
+        serving = 1;
+        npaths = 1;
+        current = 0;
+        realpaths[0] = (StringView){strlen(path), path};
+        int err = show_image();
+        gfx_end();
+        fflush(out);
+        return err;
+    }
+    DaemonRequest req = {
+        .magic = DAEMON_MAGIC,
+        .struct_size = sizeof req,
+        .backend = (int32_t)backend,
+        .cell_width = cell_width,
+        .cell_height = cell_height,
+        .width = width,
+        .height = height,
+        .scale = scale,
+        .auto_width = auto_width,
+        .auto_height = auto_height,
+        .auto_scale = auto_scale,
+        .placeholders = use_placeholders,
+        .mux = (uint8_t)mux,
+        .pane_x = pane.x,
+        .pane_y = pane.y,
+        .pane_cols = pane.cols,
+        .pane_rows = pane.rows,
+        .path_length = (uint32_t)strlen(path),
+    };
+    const char* tty = ttyname(STDOUT_FILENO);
+    const char* term = getenv("TERM");
+    snprintf(req.term_key, sizeof req.term_key, "%s\t%s", tty?tty:"", term?term:"");
+    uint8_t status = 1;
+    if(daemon_send_request(sock, &req, path, STDOUT_FILENO) == 0)
+        daemon_read_all(sock, &status, 1);
+    close(sock);
+    free(path);
+    return status;
 }
 
 int main(int argc, const char** argv){
+    out = stdout;
+    maxpaths = argc > DAEMON_MAX_PATHS? argc : DAEMON_MAX_PATHS;
+    imgpaths = calloc((size_t)maxpaths, sizeof *imgpaths);
+    realpaths = calloc((size_t)maxpaths, sizeof *realpaths);
+    resolved = calloc((size_t)maxpaths, sizeof *resolved);
+    if(!imgpaths || !realpaths || !resolved){
+        fprintf(stderr, "Out of memory for %d paths.\n", maxpaths);
+        return 1;
+    }
     _Bool is_remote = !!getenv("SSH_CLIENT");
+    _Bool reprobe = 0;
+    _Bool run_as_daemon = 0, as_client = 0;
+    StringView socket_path = {0};
+    StringView batch_dir = {0};
+    _Bool batch_png = 0;
+    int cache_mb = -1;
+    _Bool no_disk_cache = 0;
+    _Bool bench_codec = 0;
+    _Bool bench_queue = 0;
     signal(SIGWINCH, sighandler);
+    ArgParseEnumType backend_enum = {
+        .enum_size = sizeof backend,
+        .enum_count = BACKEND_COUNT+1,
+        .enum_names = backend_names,
+    };
     ArgToParse pos_args[] = {
         [0] = {
             .name = SV("imgs"),
             .help = "imgs to show",
             .dest = ARGDEST(imgpaths),
-            .min_num = 1,
-            .max_num = arrlen(imgpaths),
+            // At least one, unless it's --daemon or --bench-queue. Checked
+            // after parsing.
+            .min_num = 0,
+            .max_num = maxpaths,
         },
     };
     ArgToParse kw_args[] = {
@@ -167,6 +4085,109 @@ int main(int argc, const char** argv){
             .dest = ARGDEST(&is_remote),
             .help = "Act as if running on a different system (like under ssh)",
         },
+        {
+            .name = SV("--backend"),
+            .dest = ArgEnumDest(&backend, &backend_enum),
+            .help = "Which terminal graphics protocol to use.",
+            .show_default = 1,
+        },
+        {
+            .name = SV("--reprobe"),
+            .dest = ARGDEST(&reprobe),
+            .help = "Ignore the cached terminal capabilities and query the terminal again.",
+        },
+        {
+            .name = SV("--placeholders"),
+            .dest = ARGDEST(&use_placeholders),
+            .help = "Place kitty images with unicode placeholders and keep recently shown ones in the terminal, so going back to them is instant. Always on inside tmux.",
+        },
+        {
+            .name = SV("--cache-size"),
+            .dest = ARGDEST(&cache_mb),
+            .help = "Megabytes of decoded images to keep in memory at most (default 256). Less is kept when memory is short.",
+        },
+        {
+            .name = SV("--no-disk-cache"),
+            .dest = ARGDEST(&no_disk_cache),
+            .help = "Don't keep what was sent to the terminal for each image in ~/.cache/imgpgr/payloads.",
+        },
+        {
+            .name = SV("--daemon"),
+            .dest = ARGDEST(&run_as_daemon),
+            .help = "Listen on a unix socket and show images for `--client`s, keeping decoded images and what the terminal has between them.",
+        },
+        {
+            .name = SV("--client"),
+            .dest = ARGDEST(&as_client),
+            .help = "Have the daemon show the (first) image on this terminal and exit. For previews in file managers. Shows it directly if no daemon is running.",
+        },
+        {
+            .name = SV("--pane-x"),
+            .dest = ARGDEST(&pane.x),
+            .help = "With --client, the column (from 0) of the pane to draw in, for file manager previews. Nothing outside the pane is touched.",
+        },
+        {
+            .name = SV("--pane-y"),
+            .dest = ARGDEST(&pane.y),
+            .help = "With --client, the row (from 0) of the pane to draw in.",
+        },
+        {
+            .name = SV("--pane-width"),
+            .dest = ARGDEST(&pane.cols),
+            .help = "With --client, the width of the pane to draw in, in cells. The whole screen if not given.",
+        },
+        {
+            .name = SV("--pane-height"),
+            .dest = ARGDEST(&pane.rows),
+            .help = "With --client, the height of the pane to draw in, in cells.",
+        },
+        {
+            .name = SV("--socket"),
+            .dest = ARGDEST(&socket_path),
+            .help = "Socket for --daemon and --client. Defaults to $XDG_RUNTIME_DIR/imgpgr.sock, or /tmp/imgpgr-$UID/sock.",
+        },
+        {
+            .name = SV("--batch"),
+            .dest = ARGDEST(&batch_dir),
+            .help = "Don't show anything, write what would be sent to the terminal for each image into this directory, to be `cat`ed later. Uses all cores. --backend auto means kitty.",
+        },
+        {
+            .name = SV("--batch-png"),
+            .dest = ARGDEST(&batch_png),
+            .help = "With --batch, write the resized images as pngs instead.",
+        },
+        {
+            .name = SV("--dither"),
+            .dest = ARGDEST(&dither),
+            .help = "Use ordered dithering when reducing colors (sixel).",
+        },
+        {
+            .name = SV("--stats"),
+            .dest = ARGDEST(&print_stats),
+            .help = "Print cache and prefetch statistics on exit.",
+        },
+        {
+            .name = SV("--kitty-raw"),
+            .dest = ARGDEST(&kitty_raw),
+            .help = "With kitty, send pixels instead of pngs. Much more to write, but nothing to encode, which is faster on a local terminal.",
+        },
+        {
+            .name = SV("--kitty-acks"),
+            .dest = ARGDEST(&kitty_acks),
+            .help = "With kitty, have the terminal say when each image is on screen, and don't send the next before it has. Prints how long that took after the key with --stats.",
+        },
+        {
+            .name = SV("--bench-codec"),
+            .dest = ARGDEST(&bench_codec),
+            .help = "Time the image cache codec against png on the images and exit.",
+            .hidden = 1,
+        },
+        {
+            .name = SV("--bench-queue"),
+            .dest = ARGDEST(&bench_queue),
+            .help = "Time the lock-free queues against a mutex and condition variable and exit.",
+            .hidden = 1,
+        },
     };
     enum {HELP, HIDDEN_HELP, FISH};
     ArgToParse early_args[] = {
@@ -197,7 +4218,7 @@ int main(int argc, const char** argv){
         .early_out.args = early_args,
         .early_out.count = arrlen(early_args),
     };
-    TermSize sz = get_terminal_size();
+    TermSize sz = term_size();
     switch(check_for_early_out_args(&parser, &args)){
         case HELP:{
             int columns = sz.columns;
@@ -219,231 +4240,285 @@ int main(int argc, const char** argv){
             break;
     }
     enum ArgParseError parse_err = parse_args(&parser, &args, ARGPARSE_FLAGS_NONE);
+    // The daemon and the queue benchmark don't take any images.
+    if(!parse_err && !pos_args[0].num_parsed && !run_as_daemon && !bench_queue){
+        parser.failed.arg_to_parse = &pos_args[0];
+        parse_err = ARGPARSE_INSUFFICIENT_ARGS;
+    }
     if(parse_err){
         print_argparse_error(&parser, parse_err);
         return 1;
     }
+    if(cache_mb >= 0)
+        cache_max = ((size_t)cache_mb << 20) / 4 * 5;
+    adjust_cache_budgets(1, 0);
+    disk_cache = !no_disk_cache;
+    char default_socket[sizeof ((struct sockaddr_un*)0)->sun_path];
+    if(!socket_path.length){
+        if(daemon_socket_path(default_socket, sizeof default_socket, run_as_daemon)){
+            if(run_as_daemon){
+                fprintf(stderr, "Nowhere safe for the socket (%s), use --socket.\n", strerror(errno));
+                return 1;
+            }
+            // There can't be a daemon, the client shows it itself.
+            default_socket[0] = 0;
+        }
+        socket_path = (StringView){strlen(default_socket), default_socket};
+    }
+    if(pane.x < 0 || pane.y < 0 || pane.cols < 0 || pane.rows < 0 || (pane.cols && !pane.rows) || (pane.rows && !pane.cols)){
+        fprintf(stderr, "--pane-width and --pane-height go together and can't be negative.\n");
+        return 1;
+    }
+    if(bench_queue)
+        return run_queue_bench();
+    if(bench_codec){
+        npaths = pos_args[0].num_parsed;
+        return run_codec_bench();
+    }
+    if(run_as_daemon)
+        return run_daemon(socket_path.text);
+    if(batch_dir.length){
+        // There might not be a terminal to ask.
+        if(backend == BACKEND_AUTO) backend = BACKEND_KITTY;
+        npaths = pos_args[0].num_parsed;
+        rescale();
+        return run_batch(batch_dir.text, batch_png);
+    }
+    detect_terminal(reprobe);
     if(is_remote && !scale && !auto_scale && !width && !height && !auto_width && !auto_height)
         scale = 1;
     npaths = pos_args[0].num_parsed;
     if(!npaths) return 0;
-    for(int i = 0; i < npaths; i++){
-        const StringView* p = &imgpaths[i];
-        StringView* rp = &realpaths[i];
-        rp->text = realpath(p->text, NULL);
-        rp->length = strlen(rp->text);
-    }
+    if(as_client)
+        return run_client(socket_path.text);
+    // Before any threads start, see eventloop.h.
+    EventLoop loop;
+    loop_init(&loop, STDIN_FILENO);
+    for(int i = 0; i < npaths; i++)
+        resolved[i].given = imgpaths[i].text;
+    resolve_start(&resolver, resolved, npaths);
+    resolving = 1;
+    trigram_start(&path_index, imgpaths, npaths);
 
-    GetInputCtx input = {
-        .prompt = SV(""),
-    };
-    char b64buff[4092];
+    enable_pacing();
+    if(print_stats)
+        atexit(show_stats);
     if(1){
         atexit(restore_buff);
-        printf("\033[?1049h");
-        fflush(stdout);
+        // Registered after, so these run before leaving the alternate screen.
+        if(backend == BACKEND_KITTY)
+            atexit(kitty_forget_resident);
+        atexit(frame_abort);
+        fprintf(out, "\033[?1049h");
+        fflush(out);
     }
     for(int i = 0; i < sz.rows; i++)
-        puts("");
+        fputc('\n', out);
     rescale();
-
-    goto show;
+    render_init();
+    if(have_render_notify) loop.worker_fd = render_notify.fd;
+    if(pacing) loop.output_fd = pacer.fd;
+    loop.pressure_fd = mem_pressure_trigger();
+    acks.enabled = kitty_acks && backend == BACKEND_KITTY;
+    last_key_time = paced_now();
+    keys_begin();
+    int last_shown = -1;
+    // The current image needs showing.
+    _Bool dirty = 1;
+    // A frame is still going out.
+    _Bool writing = 0;
+    // The line under the last frame has been cleared.
+    _Bool settled = 0;
     for(;;){
-        {
-            fputs("\033[2K", stdout);
-            fflush(stdout);
-            int c;
-            switch((c = gi_get_one_char())){
-                case -1:
-                    return 0;
-                case '>':
-                case '.':
-                case '+':
-                case 'n':
-                case '\r':
-                case ' ':
-                    if(current < 0) current = 0;
-                    if(current >= npaths) current = npaths-1;
-                    current++;
-                    goto show;
-                case 'l':
-                    printf("%.*s\n", (int)realpaths[current].length, realpaths[current].text);
-                    continue;
-                case '-':
-                case '<':
-                case ',':
-                case 'p':
-                    current--;
-                    if(current < 0) current = 0;
-                    if(current >= npaths) current = npaths-1;
-                    goto show;
-                case 'q':
-                case 'x':
-                case 4: // CTRL-D
-                    return 0;
-                case '0' ... '9':
-                    input.buff[0] = (char)c;
-                    break;
-                default:
-                    continue;
-            }
-            ssize_t len = gi_get_input2(&input, 1);
-            fputs("\r\033[2K", stdout);
-            fflush(stdout);
-            if(len < 0) break;
-            if(!len) continue;
-            IntResult ir = parse_int(input.buff, len);
-            if(ir.errored) continue;
-            int pg = ir.result-1;
-            if(pg < 0) pg = 0;
-            if(pg >= npaths) pg = npaths-1;
-            current = pg;
-            goto show;
-        }
-        show:;
-        if(current < 0) current = 0;
-        if(current >= npaths) current = npaths-1;
-        StringView path = realpaths[current];
-        if(width || height || scale || auto_scale){
-            if(need_rescale) rescale();
-            int w = width, h = height;
-            int x, y, n;
-            uint8_t * data = NULL;
-            uint8_t * data2 = NULL;
-            uint8_t * data3 = NULL;
-            data = stbi_load(path.text, &x, &y, &n, 0);
-            if(!data) {
-                printf("Failed to load %s\n", path.text);
-                goto cleanup;
-            }
-            if(scale){
-                w = (int)(scale*x);
-                h = (int)(scale*y);
-            }
-            if(auto_scale){
-                // This is wrong, as if the image is bigger than the screen it
-                // picks the wrong one.
-                double xratio = (double)width/(double)x;
-                double yratio = (double)height/(double)y;
-                if(xratio < yratio){
-                    w = (int)(xratio * x);
-                    h = (int)(xratio * y);
-                }
-                else {
-                    w = (int)(yratio * x);
-                    h = (int)(yratio * y);
+        // Keys typed together move together, only where they end up is
+        // shown. The last frame has to have been shown first.
+        if(dirty && !keys.event_count && !kitty_ack_blocking(&acks, paced_now())){
+            dirty = 0;
+            settled = 0;
+            if(current < 0) current = 0;
+            if(current >= npaths) current = npaths-1;
+            if(last_shown != -1)
+                prefetch_record_move(&prefetch, current - last_shown, paced_now());
+            last_shown = current;
+            adjust_cache_budgets(0, 0);
+            // An upload of this image can finish, see preupload_next.
+            if(preupload_index != -1 && preupload_index != current)
+                frame_abort();
+            preupload_index = -1;
+            preupload_wanted = 1;
+            frame_begin();
+            show_image();
+            render_prefetch();
+            writing = frame_pump();
+            // A resize redrew the image over it.
+            if(search.active) search_draw();
+        }
+        // The current image's render is done, it goes out like any frame.
+        if(shown_ready && !writing && !dirty && !keys.event_count && !kitty_ack_blocking(&acks, paced_now())){
+            settled = 0;
+            frame_begin();
+            render_present_shown();
+            writing = frame_pump();
+            if(search.active) search_draw();
+        }
+        // Not under a prompt, which clears its line when it's done, or
+        // before the image is out.
+        if(!writing && !settled && !shown_job && !shown_ready && !goto_prompt.active && !search.active){
+            fputs("\033[2K", out);
+            fflush(out);
+            settled = 1;
+        }
+        if(preupload_wanted && !writing && !dirty && !shown_job && !shown_ready && !goto_prompt.active && !search.active && !keys.event_count && !kitty_ack_blocking(&acks, paced_now()))
+            writing = preupload_next();
+        GiEvent ev;
+        if(gi_input_next(&keys, &ev) != 0){
+            if(keys.eof) return 0;
+            int timeout = gi_input_timeout(&keys);
+            if(dirty || shown_ready)
+                timeout = loop_sooner(timeout, kitty_ack_timeout_ms(&acks, paced_now()));
+            timeout = loop_sooner(timeout, goto_timeout_ms(paced_now()));
+            timeout = loop_sooner(timeout, search_timeout_ms(paced_now()));
+            unsigned happened = loop_wait(&loop, writing, timeout);
+            if(happened & LOOP_WRITABLE)
+                writing = frame_pump();
+            if(happened & LOOP_WORKER)
+                render_harvest();
+            if(happened & LOOP_PRESSURE)
+                adjust_cache_budgets(1, 1);
+            if(happened & LOOP_RESIZE){
+                window_resized(writing);
+                // The font might have changed too.
+                if(!termcaps_have_pixel_size()){
+                    resize_caps = (TermCaps){0};
+                    termcaps_request_cell_size(out);
+                    fflush(out);
                 }
             }
-            if(!w){
-                double s = (double)h/(double)y;
-                w = (int)(s*x);
-            }
-            if(!h){
-                double s = (double)w/(double)x;
-                h = (int)(s*y);
-            }
-            size_t data2_length = (size_t)w*(size_t)h*(size_t)n;
-            data2 = malloc(data2_length);
-            if(!data2) goto cleanup;
-            int ok = stbir_resize_uint8(data, x, y, 0, data2, w, h, 0, n);
-            if(!ok) {
-                printf("Failed to resize %s\n", path.text);
-                goto cleanup;
-            }
-            if(1){
-                #if DO_TIMING
-                    struct timespec t0, t1;
-                    clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
-                #endif
-                stbi_write_png_to_func(write_func, NULL, w, h, n, data2, 0);
-                printf("%.*s\n", (int)imgpaths[current].length, imgpaths[current].text);
-                #if DO_TIMING
-                    clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
-                    printf("%.3fs\n", (double)t1.tv_sec+(double)t1.tv_nsec/1e9-(double)t0.tv_sec-(double)t0.tv_nsec/1e9);
-                #endif
-                goto cleanup;
-            }
-
-            #if DO_TIMING
-                struct timespec t0, t1;
-                clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
-            #endif
-            size_t b64_len = base64_encode_size(data2_length);
-            data3 = malloc(b64_len);
-            if(!data3) goto cleanup;
-            size_t used = base64_encode((char*)data3, b64_len, data2, data2_length);
-            if(!used) goto cleanup;
-            uint8_t* to_write = data3;
-            begin_synchronized_update();
-            go_to_topleft();
-            clear_screen();
-            printf("\033_Ga=d\033\\");
-            printf("\033_Gf=%d,a=T,s=%d,v=%d,", n*8, w, h);
-            enum {chunk_size=4096};
-            // write first chunk differently
-            {
-                printf(used > chunk_size?"m=1;":"m=0;");
-                size_t w_size = used >= chunk_size?chunk_size: used;
-                size_t writ =  fwrite(to_write, w_size, 1, stdout);
-                if(writ != 1){
-                    // idk
-                }
-                printf("\033\\");
-                to_write += w_size;
-                used -= w_size;
+            if(happened & LOOP_INPUT)
+                gi_input_read(&keys);
+            else if(gi_input_timeout(&keys) == 0)
+                gi_input_expire(&keys);
+            if(goto_timeout_ms(paced_now()) == 0)
+                goto_speculate();
+            if(search_timeout_ms(paced_now()) == 0)
+                search_speculate();
+            continue;
+        }
+        if(ev.type == GI_EVENT_REPLY){
+            kitty_ack_receive(&acks, ev.reply, ev.reply_length, paced_now());
+            if(cell_size_reply(ev.reply, ev.reply_length))
+                window_resized(writing);
+            continue;
+        }
+        if(goto_prompt.active){
+            if(ev.type != GI_EVENT_KEY || ev.release) continue;
+            last_key_time = paced_now();
+            int index = goto_key(ev.key);
+            if(index >= 0){
+                if(preupload_index == -1)
+                    frame_abort();
+                writing = pacing && out == paced_fp;
+                current = index;
+                dirty = 1;
             }
-            while(used > chunk_size){
-                printf("\033_Gm=1;");
-                size_t writ =  fwrite(to_write, chunk_size, 1, stdout);
-                if(writ != 1){
-                    // idk
-                }
-                printf("\033\\");
-                to_write += chunk_size;
-                used -= chunk_size;
+            continue;
+        }
+        if(search.active){
+            if(ev.type != GI_EVENT_KEY || ev.release) continue;
+            last_key_time = paced_now();
+            int index = search_key(&ev);
+            if(search.active) continue;
+            // The results were drawn over the image.
+            if(backends[backend].invalidate) backends[backend].invalidate();
+            if(index >= 0){
+                if(preupload_index == -1)
+                    frame_abort();
+                writing = pacing && out == paced_fp;
+                current = index;
             }
-            // last chunk
-            if(used){
-                printf("\033_Gm=0;");
-                size_t writ =  fwrite(to_write, used, 1, stdout);
-                if(writ != 1){
-                    // idk
+            dirty = 1;
+            continue;
+        }
+        int c = key_from_event(&ev);
+        if(c == KEY_NONE) continue;
+        last_key_time = paced_now();
+        switch(c){
+            // Moving on, what's still being written can go.
+            case '>': case '.': case '+': case 'n': case '\r': case ' ':
+            case '-': case '<': case ',': case 'p':
+            case 'q': case 'x': case 4:
+            case KEY_FIRST: case KEY_LAST:
+                // Unless it's an upload of where this ends up.
+                if(preupload_index == -1)
+                    frame_abort();
+                break;
+            // The prompt goes out after the frame, the frame can finish.
+            case '0' ... '9':
+                break;
+            default:
+                if(preupload_index != -1){
+                    frame_abort();
+                    preupload_index = -1;
                 }
-                printf("\033\\");
-                to_write += used;
-                used -= used;
-            }
-            printf("\n\r");
-            printf("\033\\\033[2K%d/%d\n", current+1, npaths);
-            printf("%.*s\n", (int)imgpaths[current].length, imgpaths[current].text);
-            end_synchronized_update();
-            fflush(stdout);
-            #if DO_TIMING
-                clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
-                printf("%.3fs\n", (double)t1.tv_sec+(double)t1.tv_nsec/1e9-(double)t0.tv_sec-(double)t0.tv_nsec/1e9);
-            #endif
-            {
-                cleanup:
-                free(data);
-                free(data2);
-                free(data3);
-            }
+                else
+                    frame_finish();
+                break;
         }
-        else {
-            size_t used = base64_encode(b64buff, sizeof b64buff, path.text, path.length);
-            if(used %4 != 0) b64buff[used++] = '=';
-            if(used %4 != 0) b64buff[used++] = '=';
-            if(used %4 != 0) b64buff[used++] = '=';
-            begin_synchronized_update();
-            go_to_topleft();
-            clear_screen();
-            printf("\033_Ga=d\033\\");
-            printf("\033_Ga=T,f=100,t=f,d=a,C=0;%.*s\033\\\n\r", (int)used, b64buff);
-            printf("\033[2K%d/%d\n", current+1, npaths);
-            printf("%.*s\n", (int)imgpaths[current].length, imgpaths[current].text);
-            // printf("%.*s\n", (int)path.length, path.text);
-            end_synchronized_update();
-            fflush(stdout);
+        writing = pacing && out == paced_fp;
+        switch(c){
+            case '>':
+            case '.':
+            case '+':
+            case 'n':
+            case '\r':
+            case ' ':
+                if(current < 0) current = 0;
+                if(current >= npaths) current = npaths-1;
+                current++;
+                dirty = 1;
+                continue;
+            case 'l':{
+                if(backends[backend].invalidate) backends[backend].invalidate();
+                StringView path = image_path(current);
+                fprintf(out, "%.*s\n", (int)path.length, path.text);
+                settled = 0;
+                continue;
+            }
+            case '-':
+            case '<':
+            case ',':
+            case 'p':
+                current--;
+                dirty = 1;
+                continue;
+            case KEY_FIRST:
+                current = 0;
+                dirty = 1;
+                continue;
+            case KEY_LAST:
+                current = npaths-1;
+                dirty = 1;
+                continue;
+            case KEY_SUSPEND:
+                // The terminal goes back how it was while stopped.
+                keys_end();
+                raise(SIGTSTP);
+                keys_begin();
+                if(backends[backend].invalidate) backends[backend].invalidate();
+                dirty = 1;
+                continue;
+            case 'q':
+            case 'x':
+            case 4: // CTRL-D
+                return 0;
+            case '0' ... '9':
+                goto_open((char)c);
+                continue;
+            case '/':
+                search_open();
+                continue;
+            default:
+                continue;
         }
     }
 }
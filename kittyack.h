@@ -0,0 +1,186 @@
+#ifndef KITTYACK_H
+#define KITTYACK_H
+// kittyack.h
+// ----------
+// Acknowledgements from kitty for the images it's shown.
+//
+// Images normally go out quietly (q=1 or q=2), so there's no knowing when
+// the terminal has got through a transmission of several megabytes. With
+// acks on, the placement at the end of a frame asks for a reply instead.
+// Kitty handles commands in order, so an OK for the placement means the
+// transmission before it has been decoded and the image is on screen. (The
+// transmissions themselves stay quiet: they're cached and replayed as they
+// are, while the placement is written fresh each time.)
+//
+// One frame is waited for at a time. The next isn't started until the last
+// has been acknowledged, so a slow terminal doesn't end up with frames
+// queued that will only be replaced. How long it was from the key that
+// asked for a frame to the frame being acknowledged is recorded.
+//
+// A terminal that never replies, or a multiplexer that doesn't pass the
+// replies back, is given up on at the first timeout.
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {KITTY_ACK_SAMPLES = 64};
+// Seconds to wait for an ack before giving up on it.
+#define KITTY_ACK_TIMEOUT 2.0
+
+typedef struct KittyAcks KittyAcks;
+struct KittyAcks {
+    _Bool enabled;
+    // The image whose placement is awaited, 0 if none.
+    int awaited;
+    // When that was asked for, and when the key leading to it was pressed.
+    double sent, key_time;
+    size_t acked, errors, timeouts;
+    double total, max;
+    // The most recent latencies.
+    double samples[KITTY_ACK_SAMPLES];
+    size_t nsamples;
+    char last_error[64];
+};
+
+//
+// Parses a graphics protocol reply, ESC _ G keys ; message ESC \.
+// Returns non-zero if it isn't one or doesn't say which image.
+//
+static inline
+int
+kitty_ack_parse(const char* reply, size_t length, int* id, const char*_Nullable* message, size_t* message_length){
+    if(length < 5 || memcmp(reply, "\033_G", 3) != 0) return 1;
+    const char* end = reply + length;
+    // Ended by ST, or cut short.
+    if(end[-1] == '\\' && end[-2] == '\033') end -= 2;
+    const char* semi = memchr(reply + 3, ';', (size_t)(end - reply - 3));
+    if(!semi) return 1;
+    *id = 0;
+    for(const char* p = reply + 3; p < semi; ){
+        const char* comma = memchr(p, ',', (size_t)(semi - p));
+        if(!comma) comma = semi;
+        if(comma - p > 2 && p[0] == 'i' && p[1] == '=')
+            *id = (int)strtol(p + 2, NULL, 10);
+        p = comma + 1;
+    }
+    if(!*id) return 1;
+    *message = semi + 1;
+    *message_length = (size_t)(end - semi - 1);
+    return 0;
+}
+
+//
+// Waits for the placement of image `id`, asked for at `now` because of a
+// key pressed at `key_time`.
+//
+static inline
+void
+kitty_ack_expect(KittyAcks* a, int id, double key_time, double now){
+    a->awaited = id;
+    a->sent = now;
+    a->key_time = key_time;
+}
+
+//
+// The frame was cut short before its placement went out.
+//
+static inline
+void
+kitty_ack_cancel(KittyAcks* a, int id){
+    if(a->awaited == id) a->awaited = 0;
+}
+
+//
+// Takes a reply from the terminal.
+// Returns non-zero if it wasn't a graphics reply.
+//
+static inline
+int
+kitty_ack_receive(KittyAcks* a, const char* reply, size_t length, double now){
+    int id;
+    const char* message;
+    size_t message_length;
+    if(kitty_ack_parse(reply, length, &id, &message, &message_length)) return 1;
+    _Bool ok = message_length == 2 && memcmp(message, "OK", 2) == 0;
+    if(!ok){
+        // Errors come back even for quiet commands.
+        a->errors++;
+        size_t n = message_length < sizeof a->last_error - 1? message_length : sizeof a->last_error - 1;
+        memcpy(a->last_error, message, n);
+        a->last_error[n] = 0;
+    }
+    if(id != a->awaited) return 0;
+    a->awaited = 0;
+    if(!ok) return 0;
+    double latency = now - a->key_time;
+    a->acked++;
+    a->total += latency;
+    if(latency > a->max) a->max = latency;
+    a->samples[a->nsamples++ % KITTY_ACK_SAMPLES] = latency;
+    return 0;
+}
+
+//
+// Returns non-zero while a frame is waiting to be acknowledged and the next
+// should wait for it.
+//
+static inline
+int
+kitty_ack_blocking(KittyAcks* a, double now){
+    if(!a->awaited) return 0;
+    if(now - a->sent < KITTY_ACK_TIMEOUT) return 1;
+    a->awaited = 0;
+    a->timeouts++;
+    // Never heard from it, it isn't going to answer.
+    if(!a->acked && !a->errors) a->enabled = 0;
+    return 0;
+}
+
+//
+// Returns milliseconds until the awaited ack times out, -1 if none is.
+//
+static inline
+int
+kitty_ack_timeout_ms(const KittyAcks* a, double now){
+    if(!a->awaited) return -1;
+    double left = a->sent + KITTY_ACK_TIMEOUT - now;
+    return left > 0? (int)(left * 1000) + 1 : 0;
+}
+
+static inline
+int
+kitty_ack_cmp(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static inline
+void
+kitty_ack_print_stats(const KittyAcks* a, FILE* fp){
+    fprintf(fp, "acks: %zu acknowledged, %zu errors, %zu timed out", a->acked, a->errors, a->timeouts);
+    if(a->errors)
+        fprintf(fp, " (last: %s)", a->last_error);
+    fputc('\n', fp);
+    if(!a->acked) return;
+    size_t n = a->nsamples < KITTY_ACK_SAMPLES? a->nsamples : KITTY_ACK_SAMPLES;
+    double sorted[KITTY_ACK_SAMPLES];
+    memcpy(sorted, a->samples, n * sizeof *sorted);
+    qsort(sorted, n, sizeof *sorted, kitty_ack_cmp);
+    fprintf(fp, "key to display: %.1fms mean, %.1fms median, %.1fms max\n",
+        a->total / (double)a->acked * 1000, sorted[n/2] * 1000, a->max * 1000);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef MEMPRESSURE_H
+#define MEMPRESSURE_H
+// mempressure.h
+// -------------
+// How much memory there is to spare, for sizing caches.
+//
+// Looks at the memory cgroup we're in (v2 memory.max and memory.current, or
+// v1 memory.limit_in_bytes and memory.usage_in_bytes), less the inactive
+// page cache the kernel can drop, and at MemAvailable for the whole machine.
+// Pressure stall information (the cgroup's memory.pressure, or
+// /proc/pressure/memory) says whether tasks are already waiting on memory,
+// which happens well before the OOM killer shows up.
+//
+// Rather than wait for the next look, a PSI trigger (`mem_pressure_trigger`)
+// gives an fd to poll that wakes as soon as tasks stall for long enough.
+//
+// Inside a container the cgroup paths in /proc/self/cgroup are usually
+// relative to a namespace whose root is mounted at /sys/fs/cgroup, so the
+// root is tried too.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+typedef struct MemSample MemSample;
+struct MemSample {
+    _Bool have_limit;
+    // Of the cgroup, in bytes. usage leaves out reclaimable page cache.
+    uint64_t limit, usage;
+    _Bool have_available;
+    // MemAvailable.
+    uint64_t available;
+    _Bool have_psi;
+    // Percent of the last 10 seconds some (or all) tasks were stalled on
+    // memory.
+    double some10, full10;
+    // Set by the caller when a trigger fired: tasks are stalling now,
+    // before the averages show it.
+    _Bool triggered;
+};
+
+//
+// Reads a small file into buff, nul-terminated.
+// Returns non-zero if it can't be read.
+//
+static inline
+int
+mem_read_file(const char* path, char* buff, size_t len){
+    FILE* fp = fopen(path, "r");
+    if(!fp) return 1;
+    size_t n = fread(buff, 1, len-1, fp);
+    fclose(fp);
+    buff[n] = 0;
+    return n == 0;
+}
+
+// Returns non-zero if it isn't a number ("max" isn't).
+static inline
+int
+mem_read_u64(const char* path, uint64_t* out){
+    char buff[64];
+    if(mem_read_file(path, buff, sizeof buff)) return 1;
+    char* end;
+    unsigned long long v = strtoull(buff, &end, 10);
+    if(end == buff) return 1;
+    *out = v;
+    return 0;
+}
+
+// Finds `key` at the start of a line followed by a number.
+static inline
+int
+mem_find_field(const char* text, const char* key, uint64_t* out){
+    size_t klen = strlen(key);
+    for(const char* p = text; p && *p; p = strchr(p, '\n'), p = p? p+1 : NULL){
+        if(strncmp(p, key, klen) != 0) continue;
+        const char* q = p + klen;
+        while(*q == ' ' || *q == ':' || *q == '\t') q++;
+        char* end;
+        unsigned long long v = strtoull(q, &end, 10);
+        if(end == q) return 1;
+        *out = v;
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Finds our memory cgroup's directory. Tries the path from
+// /proc/self/cgroup, then the root in case it's namespaced.
+// Returns non-zero if there isn't one, *v2 says which hierarchy it is.
+//
+static inline
+int
+mem_cgroup_dir(char* buff, size_t len, _Bool* v2){
+    char cg[4096];
+    if(mem_read_file("/proc/self/cgroup", cg, sizeof cg)) return 1;
+    for(char* line = cg; line && *line;){
+        char* next = strchr(line, '\n');
+        if(next) *next++ = 0;
+        // hierarchy-id:controllers:path
+        char* c1 = strchr(line, ':');
+        char* c2 = c1? strchr(c1+1, ':') : NULL;
+        if(c2){
+            *c1 = *c2 = 0;
+            const char* controllers = c1+1;
+            const char* path = c2+1;
+            _Bool is_v2 = !strcmp(line, "0") && !*controllers;
+            _Bool is_v1 = !is_v2 && strstr(controllers, "memory") != NULL;
+            if(is_v2 || is_v1){
+                const char* base = is_v2? "/sys/fs/cgroup" : "/sys/fs/cgroup/memory";
+                const char* probe = is_v2? "memory.max" : "memory.limit_in_bytes";
+                const char* dirs[2] = {path, ""};
+                for(int i = 0; i < 2; i++){
+                    char file[4096+64];
+                    snprintf(buff, len, "%s%s", base, strcmp(dirs[i], "/")? dirs[i] : "");
+                    snprintf(file, sizeof file, "%s/%s", buff, probe);
+                    FILE* fp = fopen(file, "r");
+                    if(!fp) continue;
+                    fclose(fp);
+                    *v2 = is_v2;
+                    return 0;
+                }
+            }
+        }
+        line = next;
+    }
+    return 1;
+}
+
+// Parses the avg10 of the "some" and "full" lines.
+static inline
+int
+mem_parse_psi(const char* text, double* some10, double* full10){
+    const char* some = strstr(text, "some avg10=");
+    if(!some) return 1;
+    *some10 = strtod(some + sizeof "some avg10=" - 1, NULL);
+    const char* full = strstr(text, "full avg10=");
+    *full10 = full? strtod(full + sizeof "full avg10=" - 1, NULL) : 0;
+    return 0;
+}
+
+static inline
+void
+mem_sample(MemSample* s){
+    *s = (MemSample){0};
+    char text[8192];
+    char dir[4096], path[4096+64];
+    _Bool v2 = 0;
+    _Bool have_cgroup = mem_cgroup_dir(dir, sizeof dir, &v2) == 0;
+    if(have_cgroup){
+        uint64_t limit, usage;
+        snprintf(path, sizeof path, "%s/%s", dir, v2? "memory.max" : "memory.limit_in_bytes");
+        int err = mem_read_u64(path, &limit);
+        snprintf(path, sizeof path, "%s/%s", dir, v2? "memory.current" : "memory.usage_in_bytes");
+        if(!err) err = mem_read_u64(path, &usage);
+        // v1 says "no limit" with a huge number.
+        if(!err && limit < ((uint64_t)1 << 60)){
+            snprintf(path, sizeof path, "%s/memory.stat", dir);
+            uint64_t inactive;
+            if(mem_read_file(path, text, sizeof text) == 0
+            && mem_find_field(text, v2? "inactive_file" : "total_inactive_file", &inactive) == 0)
+                usage = inactive < usage? usage - inactive : 0;
+            s->have_limit = 1;
+            s->limit = limit;
+            s->usage = usage;
+        }
+        if(v2){
+            snprintf(path, sizeof path, "%s/memory.pressure", dir);
+            if(mem_read_file(path, text, sizeof text) == 0)
+                s->have_psi = mem_parse_psi(text, &s->some10, &s->full10) == 0;
+        }
+    }
+    if(!s->have_psi && mem_read_file("/proc/pressure/memory", text, sizeof text) == 0)
+        s->have_psi = mem_parse_psi(text, &s->some10, &s->full10) == 0;
+    uint64_t kb;
+    if(mem_read_file("/proc/meminfo", text, sizeof text) == 0
+    && mem_find_field(text, "MemAvailable", &kb) == 0){
+        s->have_available = 1;
+        s->available = kb * 1024;
+    }
+}
+
+//
+// How many bytes caches currently holding `held` bytes should be allowed,
+// at most `max`: half of what's free (counting what they hold), less under
+// pressure.
+//
+static inline
+size_t
+mem_cache_budget(const MemSample* s, size_t held, size_t max){
+    uint64_t spare = UINT64_MAX;
+    if(s->have_limit)
+        spare = s->limit > s->usage? s->limit - s->usage : 0;
+    if(s->have_available && s->available < spare)
+        spare = s->available;
+    size_t budget = max;
+    if(spare != UINT64_MAX){
+        uint64_t b = (spare + held) / 2;
+        if(b < budget) budget = (size_t)b;
+    }
+    if(s->triggered && budget > held/2) budget = held/2;
+    if(s->have_psi){
+        // Everything stalling, give back most of it.
+        if(s->full10 > 1.0 && budget > held/4) budget = held/4;
+        else if(s->some10 > 10.0 && budget > held/2) budget = held/2;
+    }
+    return budget;
+}
+
+// A trigger fires when some task has been stalled on memory this long in
+// the window. Triggers from unprivileged users need a window that's a
+// multiple of 2 seconds.
+enum {MEM_TRIGGER_STALL_US = 150000, MEM_TRIGGER_WINDOW_US = 2000000};
+
+//
+// Opens a PSI trigger on our cgroup's memory.pressure, or failing that on
+// /proc/pressure/memory. The fd polls POLLPRI when it fires, and POLLERR
+// once it never will again (the cgroup went away).
+// Returns -1 if there's no PSI or it won't take a trigger.
+//
+static inline
+int
+mem_pressure_trigger(void){
+    char dir[4096], path[4096+64];
+    _Bool v2 = 0;
+    const char* paths[2] = {NULL, "/proc/pressure/memory"};
+    if(mem_cgroup_dir(dir, sizeof dir, &v2) == 0 && v2){
+        snprintf(path, sizeof path, "%s/memory.pressure", dir);
+        paths[0] = path;
+    }
+    char trigger[64];
+    int len = snprintf(trigger, sizeof trigger, "some %d %d", MEM_TRIGGER_STALL_US, MEM_TRIGGER_WINDOW_US);
+    for(int i = 0; i < 2; i++){
+        if(!paths[i]) continue;
+        int fd = open(paths[i], O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if(fd < 0) continue;
+        // The nul goes too, it's how the kernel knows where it ends.
+        if(write(fd, trigger, (size_t)len + 1) == len + 1) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef PACEDWRITE_H
+#define PACEDWRITE_H
+// pacedwrite.h
+// ------------
+// Output to the terminal that never blocks the program.
+//
+// Everything written goes into a queue, which `paced_pump` writes out to a
+// non-blocking fd a chunk at a time, sized from the measured drain rate so a
+// chunk takes about PACED_CHUNK_MS to go through. In between chunks the
+// caller can look at input.
+//
+// Output is grouped into frames (`paced_frame_begin`). A frame that hasn't
+// finished going out can be abandoned with `paced_abort`. It cuts the queue
+// at the first point where that's harmless: between escape sequences, or
+// inside a DCS/APC/OSC that can just be terminated. Inside a tmux
+// passthrough the doubled escapes make that impossible, so the cut waits for
+// the passthrough to close.
+//
+// `paced_stream` gives a FILE* that writes into the queue, so stdout can be
+// pointed at it and everything printed stays in order.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {PACED_CHUNK_MS = 8};
+enum {PACED_MIN_CHUNK = 4096, PACED_MAX_CHUNK = 1 << 20};
+
+// Where we are in the escape sequences that have been written.
+typedef enum PacedParse {
+    PACED_TOP,
+    PACED_TOP_ESC,
+    // In a DCS, APC or OSC.
+    PACED_STR,
+    PACED_STR_ESC,
+} PacedParse;
+
+typedef struct PacedWriter PacedWriter;
+struct PacedWriter {
+    int fd;
+    char* data;
+    size_t length, capacity;
+    // data[0] is this many bytes into the output.
+    uint64_t base;
+    // How much of data has been written.
+    size_t head;
+    // Of the written bytes.
+    PacedParse parse;
+    // The current string is a tmux passthrough. prefix counts how much of
+    // "tmux;" has matched, -1 if it didn't.
+    _Bool tmux;
+    int prefix;
+    // Absolute offsets of the current frame and its mark, UINT64_MAX if
+    // there is none.
+    uint64_t frame_start, frame_mark;
+    // Bytes per second the terminal takes output at, 0 until measured.
+    double rate;
+    // When the queue last went from empty to not.
+    struct timespec busy_since;
+    uint64_t busy_bytes;
+    _Bool failed;
+};
+
+static inline
+double
+paced_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+static inline
+void
+paced_init(PacedWriter* pw, int fd){
+    *pw = (PacedWriter){
+        .fd = fd,
+        .frame_start = UINT64_MAX,
+        .frame_mark = UINT64_MAX,
+    };
+    int flags = fcntl(fd, F_GETFL);
+    if(flags != -1) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static inline
+size_t
+paced_pending(const PacedWriter* pw){
+    return pw->length - pw->head;
+}
+
+static inline
+uint64_t
+paced_written(const PacedWriter* pw){
+    return pw->base + pw->head;
+}
+
+static inline
+uint64_t
+paced_queued(const PacedWriter* pw){
+    return pw->base + pw->length;
+}
+
+static inline
+int
+paced_queue(PacedWriter* pw, const void* data, size_t len){
+    if(!len) return 0;
+    if(!paced_pending(pw)){
+        clock_gettime(CLOCK_MONOTONIC, &pw->busy_since);
+        pw->busy_bytes = 0;
+        // Everything's out, start over at the front.
+        pw->base += pw->length;
+        pw->length = pw->head = 0;
+    }
+    if(pw->capacity - pw->length < len && pw->head >= pw->capacity/2){
+        memmove(pw->data, pw->data+pw->head, pw->length - pw->head);
+        pw->base += pw->head;
+        pw->length -= pw->head;
+        pw->head = 0;
+    }
+    if(pw->capacity - pw->length < len){
+        size_t cap = pw->capacity? pw->capacity*2 : 65536;
+        while(cap - pw->length < len) cap *= 2;
+        char* p = realloc(pw->data, cap);
+        if(!p){
+            pw->failed = 1;
+            return 1;
+        }
+        pw->data = p;
+        pw->capacity = cap;
+    }
+    memcpy(pw->data+pw->length, data, len);
+    pw->length += len;
+    return 0;
+}
+
+// Advances the parse state over one byte.
+static inline
+void
+paced_parse_byte(PacedParse* state, _Bool* tmux, int* prefix, unsigned char c){
+    switch(*state){
+        case PACED_TOP:
+            if(c == 0x1b) *state = PACED_TOP_ESC;
+            return;
+        case PACED_TOP_ESC:
+            if(c == 'P' || c == '_' || c == ']'){
+                *state = PACED_STR;
+                *tmux = 0;
+                *prefix = c == 'P'? 0 : -1;
+            }
+            else if(c != 0x1b)
+                *state = PACED_TOP;
+            return;
+        case PACED_STR:
+            if(*prefix >= 0){
+                if(c == (unsigned char)"tmux;"[*prefix]){
+                    if(++*prefix == 5){
+                        *tmux = 1;
+                        *prefix = -1;
+                    }
+                }
+                else
+                    *prefix = -1;
+            }
+            if(c == 0x1b)
+                *state = PACED_STR_ESC;
+            // BEL ends an OSC.
+            else if(c == 0x07 && !*tmux)
+                *state = PACED_TOP;
+            return;
+        case PACED_STR_ESC:
+            // In a passthrough, a doubled escape is a literal one.
+            *state = c == '\\'? PACED_TOP : PACED_STR;
+            return;
+    }
+}
+
+// Whether output can stop here (with the returned terminator added).
+static inline
+_Bool
+paced_safe_point(PacedParse state, _Bool tmux, const char*_Nullable* closer){
+    switch(state){
+        case PACED_TOP:
+        case PACED_TOP_ESC:
+            *closer = "";
+            return 1;
+        case PACED_STR:
+            *closer = "\033\\";
+            return !tmux;
+        case PACED_STR_ESC:
+            *closer = "\\";
+            return !tmux;
+    }
+    return 0;
+}
+
+//
+// Writes as much as one chunk without blocking.
+// Returns non-zero if there is still output pending.
+//
+static inline
+int
+paced_pump(PacedWriter* pw){
+    size_t pending = paced_pending(pw);
+    if(!pending) return 0;
+    size_t chunk = pw->rate > 0? (size_t)(pw->rate * PACED_CHUNK_MS / 1000) : PACED_MIN_CHUNK;
+    if(chunk < PACED_MIN_CHUNK) chunk = PACED_MIN_CHUNK;
+    if(chunk > PACED_MAX_CHUNK) chunk = PACED_MAX_CHUNK;
+    if(chunk > pending) chunk = pending;
+    ssize_t n = write(pw->fd, pw->data+pw->head, chunk);
+    if(n < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 1;
+        // Nowhere for it to go, drop it.
+        pw->failed = 1;
+        n = (ssize_t)pending;
+    }
+    for(ssize_t i = 0; i < n; i++)
+        paced_parse_byte(&pw->parse, &pw->tmux, &pw->prefix, (unsigned char)pw->data[pw->head+(size_t)i]);
+    pw->head += (size_t)n;
+    pw->busy_bytes += (uint64_t)n;
+    if(paced_pending(pw)) return 1;
+    // Only measure bursts big enough to have had to wait on the terminal.
+    if(pw->busy_bytes >= 65536){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (double)(now.tv_sec - pw->busy_since.tv_sec) + (double)(now.tv_nsec - pw->busy_since.tv_nsec)/1e9;
+        if(elapsed > 0){
+            double rate = (double)pw->busy_bytes / elapsed;
+            pw->rate = pw->rate > 0? pw->rate*0.75 + rate*0.25 : rate;
+        }
+    }
+    return 0;
+}
+
+//
+// Waits until everything has been written.
+//
+static inline
+void
+paced_drain(PacedWriter* pw){
+    while(paced_pump(pw)){
+        struct pollfd pfd = {.fd = pw->fd, .events = POLLOUT};
+        poll(&pfd, 1, -1);
+    }
+}
+
+static inline
+void
+paced_frame_begin(PacedWriter* pw){
+    pw->frame_start = paced_queued(pw);
+    pw->frame_mark = UINT64_MAX;
+}
+
+// Marks the end of the part of the frame the caller needs to know was cut
+// short (like the image data), see `paced_abort`.
+static inline
+void
+paced_frame_mark(PacedWriter* pw){
+    pw->frame_mark = paced_queued(pw);
+}
+
+typedef enum PacedAbort {
+    // The frame had already gone out.
+    PACED_ABORT_NONE,
+    // Cut before the mark.
+    PACED_ABORT_BEFORE_MARK,
+    // Cut after the mark.
+    PACED_ABORT_AFTER_MARK,
+} PacedAbort;
+
+//
+// Drops the rest of the current frame (and anything queued after it) from
+// the first point it can be cut.
+//
+static inline
+PacedAbort
+paced_abort(PacedWriter* pw){
+    uint64_t start = pw->frame_start;
+    pw->frame_start = UINT64_MAX;
+    if(start == UINT64_MAX || !paced_pending(pw)) return PACED_ABORT_NONE;
+    PacedParse state = pw->parse;
+    _Bool tmux = pw->tmux;
+    int prefix = pw->prefix;
+    size_t cut = pw->head;
+    const char* closer = "";
+    // Never cut before the frame started.
+    while(cut < pw->length && (pw->base + cut < start || !paced_safe_point(state, tmux, &closer))){
+        paced_parse_byte(&state, &tmux, &prefix, (unsigned char)pw->data[cut]);
+        cut++;
+    }
+    if(cut == pw->length) return PACED_ABORT_NONE;
+    PacedAbort result = pw->base + cut < pw->frame_mark? PACED_ABORT_BEFORE_MARK : PACED_ABORT_AFTER_MARK;
+    pw->length = cut;
+    paced_queue(pw, closer, strlen(closer));
+    return result;
+}
+
+#if defined(__GLIBC__) || defined(__linux__)
+static inline
+ssize_t
+paced_cookie_write(void* cookie, const char* buf, size_t size){
+    if(paced_queue(cookie, buf, size)) return -1;
+    return (ssize_t)size;
+}
+#else
+static inline
+int
+paced_cookie_write(void* cookie, const char* buf, int size){
+    if(paced_queue(cookie, buf, (size_t)size)) return -1;
+    return size;
+}
+#endif
+
+//
+// A stream that writes into the queue. Flushing it only queues the output,
+// `paced_pump` or `paced_drain` still has to be called.
+// Returns NULL on failure.
+//
+static inline
+FILE*_Nullable
+paced_stream(PacedWriter* pw){
+    FILE* fp;
+    #if defined(__GLIBC__) || defined(__linux__)
+        fp = fopencookie(pw, "w", (cookie_io_functions_t){.write = paced_cookie_write});
+    #else
+        fp = funopen(pw, NULL, paced_cookie_write, NULL, NULL);
+    #endif
+    if(fp) setvbuf(fp, NULL, _IOFBF, 65536);
+    return fp;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef PAYLOADCACHE_H
+#define PAYLOADCACHE_H
+// payloadcache.h
+// --------------
+// Stores the finished escape sequences for an image (at some size, for some
+// backend) on disk, so showing it again, even in a later run, is a write of
+// the file's bytes rather than a decode, resize and encode.
+//
+// Files live in $XDG_CACHE_HOME/imgpgr/payloads (or ~/.cache/...), named by
+// the hash of what they're for. The header repeats the full key so a hash
+// collision or a changed source file is just a miss.
+//
+// The same files can hold other things keyed like a payload, told apart by
+// the variant, like decoded pixels.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+typedef struct PayloadBuffer PayloadBuffer;
+struct PayloadBuffer {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+static inline
+int
+payload_append(PayloadBuffer* b, const void* data, size_t len){
+    if(b->capacity - b->length < len){
+        size_t cap = b->capacity? b->capacity*2 : 4096;
+        while(cap - b->length < len) cap *= 2;
+        char* p = realloc(b->data, cap);
+        if(!p) return 1;
+        b->data = p;
+        b->capacity = cap;
+    }
+    memcpy(b->data+b->length, data, len);
+    b->length += len;
+    return 0;
+}
+
+enum {PAYLOAD_MAGIC = 0x69706770}; // "ipgp"
+enum {PAYLOAD_VERSION = 2};
+
+typedef struct PayloadFileHeader PayloadFileHeader;
+struct PayloadFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t file_size, mtime_ns;
+    int32_t w, h;
+    // What else went into the bytes: backend, multiplexer, options.
+    uint32_t variant;
+    uint32_t path_length;
+    uint64_t payload_length;
+    // Followed by the path, then the payload.
+};
+
+//
+// Writes the path of the file for `hash` into buff, optionally creating the
+// directories.
+// Returns non-zero if there's no cache directory or it doesn't fit.
+//
+static inline
+int
+payload_cache_path(char* buff, size_t bufflen, uint64_t hash, _Bool create_dir){
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int n;
+    if(xdg && *xdg)
+        n = snprintf(buff, bufflen, "%s/imgpgr/payloads", xdg);
+    else if(home && *home)
+        n = snprintf(buff, bufflen, "%s/.cache/imgpgr/payloads", home);
+    else
+        return 1;
+    if(n < 0 || (size_t)n >= bufflen) return 1;
+    if(create_dir){
+        // Make each level, the parents might not exist either.
+        for(char* p = buff+1; *p; p++){
+            if(*p != '/') continue;
+            *p = 0;
+            mkdir(buff, 0755);
+            *p = '/';
+        }
+        mkdir(buff, 0755);
+    }
+    int n2 = snprintf(buff+n, bufflen-(size_t)n, "/%016llx", (unsigned long long)hash);
+    if(n2 < 0 || (size_t)(n+n2) >= bufflen) return 1;
+    return 0;
+}
+
+typedef struct PayloadMapping PayloadMapping;
+struct PayloadMapping {
+    void* base;
+    size_t size;
+    // Points into the mapping.
+    const char* data;
+    size_t length;
+};
+
+//
+// Maps the cached payload for the key if there is one.
+// Release it with `payload_unmap`.
+// Returns non-zero on a miss.
+//
+static inline
+int
+payload_map(PayloadMapping* m, uint64_t hash, const PayloadFileHeader* want, const char* path){
+    char fpath[1024];
+    if(payload_cache_path(fpath, sizeof fpath, hash, 0)) return 1;
+    int fd = open(fpath, O_RDONLY);
+    if(fd < 0) return 1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *want){
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(base == MAP_FAILED){
+        close(fd);
+        return 1;
+    }
+    PayloadFileHeader hdr;
+    memcpy(&hdr, base, sizeof hdr);
+    const char* cpath = (const char*)base + sizeof hdr;
+    if(hdr.magic != want->magic || hdr.version != want->version
+    || hdr.file_size != want->file_size || hdr.mtime_ns != want->mtime_ns
+    || hdr.w != want->w || hdr.h != want->h || hdr.variant != want->variant
+    || hdr.path_length != want->path_length
+    || size - sizeof hdr < hdr.path_length
+    || size - sizeof hdr - hdr.path_length != hdr.payload_length
+    || memcmp(cpath, path, hdr.path_length) != 0){
+        munmap(base, size);
+        close(fd);
+        return 1;
+    }
+    // A hit makes it the newest, so `payload_prune` goes by last use.
+    futimens(fd, NULL);
+    close(fd);
+    madvise(base, size, MADV_SEQUENTIAL);
+    *m = (PayloadMapping){
+        .base = base,
+        .size = size,
+        .data = cpath + hdr.path_length,
+        .length = (size_t)hdr.payload_length,
+    };
+    return 0;
+}
+
+static inline
+void
+payload_unmap(PayloadMapping* m){
+    munmap(m->base, m->size);
+    *m = (PayloadMapping){0};
+}
+
+// Whether there's a file for the hash, which might still not match.
+static inline
+_Bool
+payload_exists(uint64_t hash){
+    char fpath[1024];
+    if(payload_cache_path(fpath, sizeof fpath, hash, 0)) return 0;
+    return access(fpath, R_OK) == 0;
+}
+
+//
+// Stores a payload, atomically replacing any previous file for the hash.
+// Failure is ignored, it's only a cache.
+//
+static inline
+void
+payload_store(uint64_t hash, const PayloadFileHeader* hdr, const char* path, const char* data, size_t length){
+    char fpath[1024];
+    if(payload_cache_path(fpath, sizeof fpath, hash, 1)) return;
+    // Unique within the process too, workers store at the same time.
+    static _Atomic unsigned seq;
+    char tmppath[1060];
+    snprintf(tmppath, sizeof tmppath, "%s.%d.%u", fpath, (int)getpid(), atomic_fetch_add(&seq, 1));
+    int fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0) return;
+    PayloadFileHeader h = *hdr;
+    h.payload_length = length;
+    _Bool ok = 1;
+    const void* parts[3] = {&h, path, data};
+    size_t lens[3] = {sizeof h, hdr->path_length, length};
+    for(int i = 0; i < 3 && ok; i++){
+        const char* p = parts[i];
+        size_t len = lens[i];
+        while(len){
+            ssize_t n = write(fd, p, len);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0){
+                ok = 0;
+                break;
+            }
+            p += n;
+            len -= (size_t)n;
+        }
+    }
+    if(close(fd) != 0) ok = 0;
+    if(ok && rename(tmppath, fpath) == 0) return;
+    unlink(tmppath);
+}
+
+//
+// Kitty image ids for payloads, derived from the hash so a later run can
+// replay the bytes as they are. There are only 23 bits of them, so two
+// images can want the same one. Whichever asks first gets it and the other
+// moves on to the next free id, which isn't the one its stored bytes
+// (from this run or an earlier one) were made with.
+//
+// Only the main thread uses this.
+//
+enum {PAYLOAD_ID_BASE = 0x800000, PAYLOAD_ID_MASK = 0x7fffff};
+
+typedef struct PayloadIds PayloadIds;
+struct PayloadIds {
+    // Open addressing on the id, 0 is empty.
+    uint32_t*_Nullable ids;
+    uint64_t*_Nullable hashes;
+    size_t count, capacity;
+};
+
+static inline
+size_t
+payload_ids_slot(const PayloadIds* t, uint32_t id){
+    size_t mask = t->capacity - 1;
+    size_t i = (id * 2654435761u) & mask;
+    while(t->ids[i] && t->ids[i] != id) i = (i + 1) & mask;
+    return i;
+}
+
+//
+// Returns non-zero if there's no memory for it.
+//
+static inline
+int
+payload_ids_grow(PayloadIds* t){
+    size_t capacity = t->capacity? t->capacity * 2 : 1024;
+    uint32_t* ids = calloc(capacity, sizeof *ids);
+    uint64_t* hashes = malloc(capacity * sizeof *hashes);
+    if(!ids || !hashes){
+        free(ids);
+        free(hashes);
+        return 1;
+    }
+    PayloadIds old = *t;
+    t->ids = ids;
+    t->hashes = hashes;
+    t->capacity = capacity;
+    for(size_t i = 0; i < old.capacity; i++){
+        if(!old.ids[i]) continue;
+        size_t j = payload_ids_slot(t, old.ids[i]);
+        ids[j] = old.ids[i];
+        hashes[j] = old.hashes[i];
+    }
+    free(old.ids);
+    free(old.hashes);
+    return 0;
+}
+
+//
+// The id to transmit the payload for `hash` as, setting *derived to whether
+// it's the one derived from the hash. If it isn't, stored bytes for the hash
+// can't be used.
+//
+static inline
+int
+payload_ids_get(PayloadIds* t, uint64_t hash, _Bool* derived){
+    uint32_t want = PAYLOAD_ID_BASE | (uint32_t)(hash >> 40 & PAYLOAD_ID_MASK);
+    *derived = 1;
+    if(t->count > PAYLOAD_ID_MASK) return (int)want;
+    if(t->count * 2 >= t->capacity && payload_ids_grow(t))
+        // Can't keep track, but most of the time that's fine.
+        return (int)want;
+    uint32_t id = want;
+    for(;;){
+        size_t i = payload_ids_slot(t, id);
+        if(!t->ids[i]){
+            t->ids[i] = id;
+            t->hashes[i] = hash;
+            t->count++;
+            break;
+        }
+        if(t->hashes[i] == hash) break;
+        id = PAYLOAD_ID_BASE | ((id + 1) & PAYLOAD_ID_MASK);
+    }
+    *derived = id == want;
+    return (int)id;
+}
+
+typedef struct PayloadFileInfo PayloadFileInfo;
+struct PayloadFileInfo {
+    char name[32];
+    time_t mtime;
+    size_t size;
+};
+
+static inline
+int
+payload_file_info_cmp(const void* a, const void* b){
+    const PayloadFileInfo* l = a;
+    const PayloadFileInfo* r = b;
+    return (l->mtime > r->mtime) - (l->mtime < r->mtime);
+}
+
+//
+// Deletes the least recently used payloads until the directory holds at
+// most max_bytes. Files are touched when stored and when mapped, so that's
+// the oldest by mtime.
+//
+static inline
+void
+payload_prune(size_t max_bytes){
+    char dir[1024];
+    if(payload_cache_path(dir, sizeof dir, 0, 0)) return;
+    *strrchr(dir, '/') = 0;
+    DIR* d = opendir(dir);
+    if(!d) return;
+    PayloadFileInfo* files = NULL;
+    size_t count = 0, capacity = 0, total = 0;
+    char path[1100];
+    for(struct dirent* ent; (ent = readdir(d));){
+        if(ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof files->name) continue;
+        snprintf(path, sizeof path, "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if(count == capacity){
+            capacity = capacity? capacity*2 : 64;
+            PayloadFileInfo* p = realloc(files, capacity * sizeof *p);
+            if(!p) break;
+            files = p;
+        }
+        PayloadFileInfo* f = &files[count++];
+        strcpy(f->name, ent->d_name);
+        f->mtime = st.st_mtime;
+        f->size = (size_t)st.st_size;
+        total += f->size;
+    }
+    closedir(d);
+    if(total > max_bytes && count){
+        qsort(files, count, sizeof *files, payload_file_info_cmp);
+        for(size_t i = 0; i < count && total > max_bytes; i++){
+            snprintf(path, sizeof path, "%s/%s", dir, files[i].name);
+            if(unlink(path) == 0) total -= files[i].size;
+        }
+    }
+    free(files);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+// prefetch.h
+// ----------
+// Decides which images to render before they're asked for.
+//
+// The policy watches how the user moves through the images:
+//
+//   - Paging one way: look further ahead the longer the streak, up to
+//     PREFETCH_MAX_AHEAD, and keep one behind. But no further than the
+//     user gets in PREFETCH_HORIZON seconds at the pace they're paging,
+//     someone pausing on each image only needs the next one.
+//   - Flipping back and forth between two images: the other one is kept,
+//     plus both neighbours of this one.
+//   - Jumping by number: one either side, nothing is known yet.
+//
+// The window is then cut down so that what it holds fits the memory
+// budget, and so that it isn't more work than the workers get through in
+// PREFETCH_HORIZON seconds (further out the user may never get to), both
+// from the measured average per image.
+//
+// Past the window, files are only read ahead: the kernel is told they'll be
+// wanted so they're in the page cache by the time they're rendered. That
+// only pays when reading a file is slow (spinning disks, network
+// filesystems), and then it goes as far as the user gets in the time a read
+// takes. Reads of files that were read ahead don't count towards how long a
+// read takes, or it would look like there's no need.
+//
+// It also keeps count of how prefetching is doing: shown images that were
+// ready (hits), still being rendered (late) or not prefetched (misses), and
+// prefetched images that were never shown (wasted).
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {PREFETCH_HISTORY = 8};
+enum {PREFETCH_MAX_AHEAD = 4};
+enum {PREFETCH_READY = 32};
+enum {PREFETCH_MAX_WARM = 8};
+#define PREFETCH_HORIZON 2.0
+// Seconds, reads quicker than this are from the page cache or near enough.
+#define PREFETCH_SLOW_READ 0.002
+
+typedef struct PrefetchPolicy PrefetchPolicy;
+struct PrefetchPolicy {
+    // Index deltas of the most recent moves, oldest first.
+    int moves[PREFETCH_HISTORY];
+    int nmoves;
+    // Averages: seconds between moves, seconds of work to render an image
+    // and the bytes it holds once rendered. 0 until measured.
+    double last_move, interval;
+    double cost, bytes;
+    // Seconds to read a file that wasn't read ahead.
+    double read;
+    size_t budget;
+    int workers;
+    // Hashes of prefetched results that haven't been shown yet.
+    uint64_t ready[PREFETCH_READY];
+    int nready;
+    size_t hits, late, misses, wasted, issued;
+    // Files read ahead.
+    size_t warmed;
+};
+
+typedef struct PrefetchWindow PrefetchWindow;
+struct PrefetchWindow {
+    // +1 or -1, which way is "ahead".
+    int direction;
+    int ahead, behind;
+    // Another index to keep ready, 0 if none. Relative to the current one.
+    int partner;
+    // How many files past `ahead` to read ahead.
+    int warm;
+};
+
+static inline
+void
+prefetch_init(PrefetchPolicy* p, size_t budget, int workers){
+    *p = (PrefetchPolicy){
+        .budget = budget,
+        .workers = workers > 0? workers : 1,
+    };
+}
+
+static inline
+double
+prefetch_ewma(double avg, double sample){
+    return avg > 0? avg*0.75 + sample*0.25 : sample;
+}
+
+static inline
+void
+prefetch_record_move(PrefetchPolicy* p, int delta, double now){
+    if(!delta) return;
+    if(p->nmoves == PREFETCH_HISTORY){
+        for(int i = 1; i < PREFETCH_HISTORY; i++)
+            p->moves[i-1] = p->moves[i];
+        p->nmoves--;
+    }
+    p->moves[p->nmoves++] = delta;
+    // Ignore long pauses, they're not how fast the user pages.
+    if(p->last_move > 0 && now - p->last_move < 10)
+        p->interval = prefetch_ewma(p->interval, now - p->last_move);
+    p->last_move = now;
+}
+
+static inline
+void
+prefetch_record_render(PrefetchPolicy* p, double seconds, size_t bytes){
+    p->cost = prefetch_ewma(p->cost, seconds);
+    p->bytes = prefetch_ewma(p->bytes, (double)bytes);
+}
+
+static inline
+void
+prefetch_record_read(PrefetchPolicy* p, double seconds){
+    p->read = prefetch_ewma(p->read, seconds);
+}
+
+static inline
+PrefetchWindow
+prefetch_window(const PrefetchPolicy* p){
+    PrefetchWindow w = {.direction = 1, .ahead = 2, .behind = 1};
+    int n = p->nmoves;
+    // Whether the user is going one way, so there's a way to read ahead.
+    _Bool paging = 1;
+    if(n){
+        int last = p->moves[n-1];
+        w.direction = last > 0? 1 : -1;
+        if(n >= 3 && p->moves[n-2] == -last && p->moves[n-3] == last){
+            // Comparing two images.
+            w.ahead = 1;
+            w.behind = 1;
+            w.partner = -last;
+            paging = 0;
+        }
+        else if(last != 1 && last != -1){
+            w.ahead = 1;
+            w.behind = 1;
+            paging = 0;
+        }
+        else {
+            int streak = 0;
+            while(streak < n && p->moves[n-1-streak] == last)
+                streak++;
+            w.ahead = 1 + streak;
+            if(p->interval > 0){
+                int reached = (int)ceil(PREFETCH_HORIZON / p->interval);
+                if(w.ahead > reached) w.ahead = reached;
+            }
+            if(w.ahead > PREFETCH_MAX_AHEAD) w.ahead = PREFETCH_MAX_AHEAD;
+        }
+    }
+    if(p->cost > 0){
+        int affordable = (int)(PREFETCH_HORIZON * p->workers / p->cost);
+        if(affordable < 1) affordable = 1;
+        if(w.ahead > affordable) w.ahead = affordable;
+    }
+    if(p->bytes > 0){
+        int fits = (int)((double)p->budget / p->bytes);
+        // Give up the partner and what's behind first.
+        if(w.partner && w.ahead + w.behind + 1 > fits) w.partner = 0;
+        if(w.ahead + w.behind > fits){
+            w.ahead = fits > 1? fits - 1 : fits;
+            w.behind = fits - w.ahead;
+        }
+    }
+    if(paging && p->read > PREFETCH_SLOW_READ){
+        // The user moves one further on in `interval`, the file should be
+        // read by the time it's in the window.
+        double interval = p->interval > 0? p->interval : 1.0;
+        w.warm = 1 + (int)(p->read / interval);
+        if(w.warm > PREFETCH_MAX_WARM) w.warm = PREFETCH_MAX_WARM;
+    }
+    return w;
+}
+
+// A prefetched result was put in the caches.
+static inline
+void
+prefetch_mark_ready(PrefetchPolicy* p, uint64_t hash){
+    if(p->nready == PREFETCH_READY){
+        p->wasted++;
+        for(int i = 1; i < PREFETCH_READY; i++)
+            p->ready[i-1] = p->ready[i];
+        p->nready--;
+    }
+    p->ready[p->nready++] = hash;
+}
+
+//
+// Forgets a prefetched result because it's being shown.
+// Returns non-zero if it was one.
+//
+static inline
+int
+prefetch_take_ready(PrefetchPolicy* p, uint64_t hash){
+    for(int i = 0; i < p->nready; i++){
+        if(p->ready[i] != hash) continue;
+        p->ready[i] = p->ready[--p->nready];
+        return 1;
+    }
+    return 0;
+}
+
+static inline
+void
+prefetch_print_stats(const PrefetchPolicy* p, FILE* fp){
+    size_t shown = p->hits + p->late + p->misses;
+    fprintf(fp, "prefetch: %zu issued, %zu hits, %zu late, %zu misses, %zu wasted",
+        p->issued, p->hits, p->late, p->misses, p->wasted + (size_t)p->nready);
+    if(shown)
+        fprintf(fp, " (%.0f%% hit rate)", 100.0*(double)p->hits/(double)shown);
+    fputc('\n', fp);
+    if(p->cost > 0)
+        fprintf(fp, "render: %.1fms and %.1fMB an image, %.2fs between moves\n",
+            p->cost*1000, p->bytes/(1024.*1024.), p->interval);
+    if(p->read > 0)
+        fprintf(fp, "readahead: %zu files, %.1fms a read\n", p->warmed, p->read*1000);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef QOI_H
+#define QOI_H
+// qoi.h
+// -----
+// A fast lossless image codec, following the "Quite OK Image" format.
+//
+// Every pixel is one of: a run of the previous pixel, an index into a
+// 64-entry table of recently seen pixels (hashed), a small difference from
+// the previous pixel, or the pixel itself. There's no entropy coding, so it
+// compresses worse than png but encodes and decodes an order of magnitude
+// faster, which is what matters for keeping images around in memory.
+//
+// The encoder hashes pixels and finds the ends of runs several at a time
+// (with SSE2 where there is, otherwise loops the compiler can vectorise).
+// The decoder can stop and resume anywhere, so the pixels can be turned
+// into something else a chunk at a time without decoding the whole image.
+//
+// The stream is standard QOI for 3 and 4 channels. 1 and 2 channel images
+// (grey, grey + alpha) are coded as if the grey were in r, g and b, with the
+// channel count in the header saying so.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF  = 0x40,
+    QOI_OP_LUMA  = 0x80,
+    QOI_OP_RUN   = 0xc0,
+    QOI_OP_RGB   = 0xfe,
+    QOI_OP_RGBA  = 0xff,
+    QOI_MASK_2   = 0xc0,
+};
+enum {QOI_HEADER_SIZE = 14, QOI_PADDING = 8};
+static const uint8_t qoi_padding[QOI_PADDING] = {0,0,0,0,0,0,0,1};
+
+typedef union QoiPixel QoiPixel;
+union QoiPixel {
+    struct { uint8_t r, g, b, a; } rgba;
+    uint32_t v;
+};
+
+static inline
+unsigned
+qoi_hash(QoiPixel p){
+    return (p.rgba.r*3u + p.rgba.g*5u + p.rgba.b*7u + p.rgba.a*11u) & 63u;
+}
+
+static inline
+void
+qoi_write32(uint8_t* p, uint32_t v){
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline
+uint32_t
+qoi_read32(const uint8_t* p){
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// The most an image can take encoded.
+static inline
+size_t
+qoi_max_size(int w, int h){
+    return (size_t)w*(size_t)h*5 + QOI_HEADER_SIZE + QOI_PADDING;
+}
+
+static inline
+void
+qoi_store(uint8_t* dst, QoiPixel p, int n){
+    switch(n){
+        case 1: dst[0] = p.rgba.r; break;
+        case 2: dst[0] = p.rgba.r; dst[1] = p.rgba.a; break;
+        case 3: dst[0] = p.rgba.r; dst[1] = p.rgba.g; dst[2] = p.rgba.b; break;
+        default: memcpy(dst, &p, 4); break;
+    }
+}
+
+// Codes one pixel that differs from the previous one, h being its hash.
+static inline
+uint8_t*
+qoi_put_pixel(uint8_t* o, QoiPixel px, QoiPixel prev, QoiPixel index[64], unsigned h){
+    if(index[h].v == px.v){
+        *o++ = (uint8_t)(QOI_OP_INDEX | h);
+        return o;
+    }
+    index[h] = px;
+    if(px.rgba.a != prev.rgba.a){
+        *o++ = QOI_OP_RGBA;
+        memcpy(o, &px, 4);
+        return o+4;
+    }
+    int8_t vr = (int8_t)(px.rgba.r - prev.rgba.r);
+    int8_t vg = (int8_t)(px.rgba.g - prev.rgba.g);
+    int8_t vb = (int8_t)(px.rgba.b - prev.rgba.b);
+    int8_t vg_r = (int8_t)(vr - vg);
+    int8_t vg_b = (int8_t)(vb - vg);
+    if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+        *o++ = (uint8_t)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+    else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8){
+        *o++ = (uint8_t)(QOI_OP_LUMA | (vg + 32));
+        *o++ = (uint8_t)((vg_r + 8) << 4 | (vg_b + 8));
+    }
+    else {
+        *o++ = QOI_OP_RGB;
+        *o++ = px.rgba.r;
+        *o++ = px.rgba.g;
+        *o++ = px.rgba.b;
+    }
+    return o;
+}
+
+//
+// The encoder works through the image a block at a time. Expanding the
+// pixels to rgba, hashing them and finding where runs end are done for the
+// whole block up front, several pixels at once, which leaves the loop
+// that writes the ops with only the branching that can't be vectorised.
+//
+enum {QOI_BLOCK = 256};
+
+static inline
+void
+qoi_load_block(const uint8_t* src, int n, size_t count, QoiPixel* px){
+    // Separate loops so the compiler can vectorise each.
+    switch(n){
+        case 1:
+            for(size_t i = 0; i < count; i++){
+                px[i].rgba.r = px[i].rgba.g = px[i].rgba.b = src[i];
+                px[i].rgba.a = 255;
+            }
+            break;
+        case 2:
+            for(size_t i = 0; i < count; i++){
+                px[i].rgba.r = px[i].rgba.g = px[i].rgba.b = src[2*i];
+                px[i].rgba.a = src[2*i+1];
+            }
+            break;
+        case 3:
+            for(size_t i = 0; i < count; i++){
+                px[i].rgba.r = src[3*i];
+                px[i].rgba.g = src[3*i+1];
+                px[i].rgba.b = src[3*i+2];
+                px[i].rgba.a = 255;
+            }
+            break;
+        default:
+            memcpy(px, src, count*4);
+            break;
+    }
+}
+
+static inline
+void
+qoi_hash_block(const QoiPixel* px, size_t count, uint8_t* hashes){
+    size_t i = 0;
+    #ifdef __SSE2__
+    // Widen to 16 bits, multiply-add the weights pairwise (r*3+g*5 and
+    // b*7+a*11) and add the pairs.
+    const __m128i weights = _mm_setr_epi16(3, 5, 7, 11, 3, 5, 7, 11);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi32(63);
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i*)(px+i));
+        __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights));
+        __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i h = _mm_and_si128(_mm_add_epi32(even, odd), mask);
+        h = _mm_packs_epi32(h, h);
+        h = _mm_packus_epi16(h, h);
+        uint32_t four = (uint32_t)_mm_cvtsi128_si32(h);
+        memcpy(hashes+i, &four, 4);
+    }
+    #endif
+    for(; i < count; i++)
+        hashes[i] = (uint8_t)qoi_hash(px[i]);
+}
+
+// How many of the pixels, from the first, are `prev`.
+static inline
+size_t
+qoi_run_length(const QoiPixel* px, size_t count, QoiPixel prev){
+    size_t i = 0;
+    #ifdef __SSE2__
+    const __m128i p = _mm_set1_epi32((int)prev.v);
+    for(; i + 4 <= count; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i*)(px+i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi32(v, p)) != 0xffff) break;
+    }
+    #endif
+    while(i < count && px[i].v == prev.v)
+        i++;
+    return i;
+}
+
+//
+// Encodes n-channel pixels into `out`, which must hold `qoi_max_size`.
+// Returns the encoded size.
+//
+static inline
+size_t
+qoi_encode_into(const uint8_t* pixels, int w, int h, int n, uint8_t* out){
+    uint8_t* o = out;
+    memcpy(o, "qoif", 4);
+    qoi_write32(o+4, (uint32_t)w);
+    qoi_write32(o+8, (uint32_t)h);
+    o[12] = (uint8_t)n;
+    o[13] = 0;
+    o += QOI_HEADER_SIZE;
+    QoiPixel index[64];
+    memset(index, 0, sizeof index);
+    QoiPixel prev = {.rgba = {0, 0, 0, 255}};
+    size_t total = (size_t)w*(size_t)h;
+    size_t run = 0;
+    QoiPixel px[QOI_BLOCK];
+    uint8_t hashes[QOI_BLOCK];
+    for(size_t start = 0; start < total; start += QOI_BLOCK){
+        size_t count = total - start < QOI_BLOCK? total - start : QOI_BLOCK;
+        qoi_load_block(pixels + start*(size_t)n, n, count, px);
+        qoi_hash_block(px, count, hashes);
+        for(size_t i = 0; i < count;){
+            if(px[i].v == prev.v){
+                size_t r = qoi_run_length(px+i, count-i, prev);
+                i += r;
+                for(run += r; run >= 62; run -= 62)
+                    *o++ = QOI_OP_RUN | 61;
+                continue;
+            }
+            if(run){
+                *o++ = (uint8_t)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            o = qoi_put_pixel(o, px[i], prev, index, hashes[i]);
+            prev = px[i];
+            i++;
+        }
+    }
+    if(run) *o++ = (uint8_t)(QOI_OP_RUN | (run - 1));
+    memcpy(o, qoi_padding, QOI_PADDING);
+    o += QOI_PADDING;
+    return (size_t)(o - out);
+}
+
+//
+// Encodes into a malloced buffer, trimmed to size.
+// Returns non-zero on allocation failure.
+//
+static inline
+int
+qoi_encode(const uint8_t* pixels, int w, int h, int n, uint8_t*_Nullable* out, size_t* length){
+    uint8_t* buf = malloc(qoi_max_size(w, h));
+    if(!buf) return 1;
+    size_t len = qoi_encode_into(pixels, w, h, n, buf);
+    uint8_t* p = realloc(buf, len);
+    *out = p? p : buf;
+    *length = len;
+    return 0;
+}
+
+//
+// Reads the header.
+// Returns non-zero if it isn't one.
+//
+static inline
+int
+qoi_info(const uint8_t* data, size_t length, int* w, int* h, int* n){
+    if(length < QOI_HEADER_SIZE + QOI_PADDING || memcmp(data, "qoif", 4) != 0) return 1;
+    uint32_t uw = qoi_read32(data+4), uh = qoi_read32(data+8);
+    if(!uw || !uh || uw > 1u<<24 || uh > 1u<<24 || data[12] < 1 || data[12] > 4) return 1;
+    *w = (int)uw;
+    *h = (int)uh;
+    *n = data[12];
+    return 0;
+}
+
+//
+// Decodes a few pixels at a time, for turning the data into something else
+// without holding all of the pixels.
+//
+typedef struct QoiDecoder QoiDecoder;
+struct QoiDecoder {
+    const uint8_t* p;
+    const uint8_t* end;
+    QoiPixel index[64];
+    QoiPixel px;
+    // What's left of the current run, and of the image.
+    size_t run, remaining;
+    int w, h, n;
+    _Bool bad;
+};
+
+// Returns non-zero if the data doesn't start with a header.
+static inline
+int
+qoi_decoder_init(QoiDecoder* d, const uint8_t* data, size_t length){
+    int w, h, n;
+    if(qoi_info(data, length, &w, &h, &n)) return 1;
+    *d = (QoiDecoder){
+        .p = data + QOI_HEADER_SIZE,
+        .end = data + length - QOI_PADDING,
+        .px = {.rgba = {0, 0, 0, 255}},
+        .remaining = (size_t)w*(size_t)h,
+        .w = w,
+        .h = h,
+        .n = n,
+    };
+    return 0;
+}
+
+static inline
+size_t
+qoi_decode_channels(QoiDecoder* d, uint8_t* out, size_t count, int channels){
+    if(count > d->remaining) count = d->remaining;
+    const uint8_t* p = d->p;
+    const uint8_t* end = d->end;
+    QoiPixel px = d->px;
+    size_t run = d->run;
+    uint8_t* dst = out;
+    size_t i = 0;
+    while(i < count){
+        if(!run){
+            if(p >= end) goto bad;
+            uint8_t b1 = *p++;
+            run = 1;
+            if(b1 == QOI_OP_RGB){
+                if(end - p < 3) goto bad;
+                px.rgba.r = p[0];
+                px.rgba.g = p[1];
+                px.rgba.b = p[2];
+                p += 3;
+            }
+            else if(b1 == QOI_OP_RGBA){
+                if(end - p < 4) goto bad;
+                memcpy(&px, p, 4);
+                p += 4;
+            }
+            else switch(b1 & QOI_MASK_2){
+                case QOI_OP_INDEX:
+                    px = d->index[b1];
+                    break;
+                case QOI_OP_DIFF:
+                    px.rgba.r += (uint8_t)((b1 >> 4 & 3) - 2);
+                    px.rgba.g += (uint8_t)((b1 >> 2 & 3) - 2);
+                    px.rgba.b += (uint8_t)((b1 & 3) - 2);
+                    break;
+                case QOI_OP_LUMA: {
+                    if(p >= end) goto bad;
+                    uint8_t b2 = *p++;
+                    int vg = (b1 & 0x3f) - 32;
+                    px.rgba.r += (uint8_t)(vg - 8 + (b2 >> 4 & 0x0f));
+                    px.rgba.g += (uint8_t)vg;
+                    px.rgba.b += (uint8_t)(vg - 8 + (b2 & 0x0f));
+                }break;
+                case QOI_OP_RUN:
+                    run = (size_t)(b1 & 0x3f) + 1;
+                    if(run > d->remaining - i) goto bad;
+                    break;
+            }
+            d->index[qoi_hash(px)] = px;
+            if(run == 1){
+                qoi_store(dst, px, channels);
+                dst += channels;
+                run = 0;
+                i++;
+                continue;
+            }
+        }
+        size_t r = run < count - i? run : count - i;
+        for(size_t k = 0; k < r; k++, dst += channels)
+            qoi_store(dst, px, channels);
+        run -= r;
+        i += r;
+    }
+    d->p = p;
+    d->px = px;
+    d->run = run;
+    d->remaining -= i;
+    return i;
+
+    bad:
+    d->bad = 1;
+    d->p = p;
+    d->px = px;
+    d->run = 0;
+    d->remaining -= i;
+    return i;
+}
+
+//
+// Decodes up to `count` pixels into `out` as `channels`-channel pixels
+// (grey from r, the way they were loaded).
+// Returns how many were decoded, fewer only at the end of the image or if
+// the data is bad, which sets `bad`.
+//
+static inline
+size_t
+qoi_decode_some(QoiDecoder* d, uint8_t* out, size_t count, int channels){
+    // A constant channel count for each, so storing a pixel isn't a switch.
+    switch(channels){
+        case 1: return qoi_decode_channels(d, out, count, 1);
+        case 2: return qoi_decode_channels(d, out, count, 2);
+        case 3: return qoi_decode_channels(d, out, count, 3);
+        default: return qoi_decode_channels(d, out, count, 4);
+    }
+}
+
+//
+// Decodes into `pixels`, which must hold w*h*n bytes, the size and channel
+// count the header says.
+// Returns non-zero if the data is bad.
+//
+static inline
+int
+qoi_decode_into(const uint8_t* data, size_t length, uint8_t* pixels){
+    QoiDecoder d;
+    if(qoi_decoder_init(&d, data, length)) return 1;
+    size_t total = d.remaining;
+    return qoi_decode_some(&d, pixels, total, d.n) != total || d.bad;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
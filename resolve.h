@@ -0,0 +1,176 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+// resolve.h
+// ---------
+// Resolves paths (realpath and stat) on background threads.
+//
+// One after another, tens of thousands of paths take seconds on a network
+// filesystem. Instead a few threads work through them in order, one per
+// RESOLVE_PER_THREAD paths up to RESOLVE_MAX_THREADS. They're waiting on the
+// filesystem, not using the cpu, so there can be more of them than cpus.
+//
+// Whoever needs a path before a thread has got to it resolves it then and
+// there rather than waiting its turn, so the first image is shown without
+// waiting on the rest.
+//
+// A path that can't be resolved is kept as given. Either way `error` says
+// what's wrong with it, if anything (a directory isn't an image). What the
+// stat found is kept, so the file needn't be stat'd again to key it.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {RESOLVE_MAX_THREADS = 8};
+enum {RESOLVE_PER_THREAD = 64};
+
+typedef enum ResolveState {
+    RESOLVE_PENDING,
+    RESOLVE_CLAIMED,
+    RESOLVE_DONE,
+} ResolveState;
+
+typedef struct ResolvedPath ResolvedPath;
+struct ResolvedPath {
+    // Set before resolving starts.
+    const char* given;
+    _Atomic int state;
+    // Never freed, `given` if it can't be resolved.
+    const char*_Nullable path;
+    size_t length;
+    // errno of what went wrong, 0 if nothing did.
+    int error;
+    // From the stat, if there was no error.
+    _Bool regular;
+    int64_t file_size, mtime_ns;
+};
+
+typedef struct PathResolver PathResolver;
+struct PathResolver {
+    ResolvedPath* paths;
+    int count;
+    atomic_int next;
+    // Waiters for a path another thread is resolving sleep on `done`.
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int nthreads;
+    pthread_t threads[RESOLVE_MAX_THREADS];
+};
+
+static inline
+void
+resolve_path(ResolvedPath* r){
+    char* path = realpath(r->given, NULL);
+    struct stat st;
+    if(!path)
+        r->error = errno;
+    else if(stat(path, &st) != 0)
+        r->error = errno;
+    else if(S_ISDIR(st.st_mode))
+        r->error = EISDIR;
+    else {
+        r->regular = S_ISREG(st.st_mode);
+        r->file_size = (int64_t)st.st_size;
+        #if defined(__APPLE__)
+            r->mtime_ns = (int64_t)st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+        #elif defined(__linux__)
+            r->mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+        #else
+            r->mtime_ns = (int64_t)st.st_mtime*1000000000;
+        #endif
+    }
+    r->path = path? path : r->given;
+    r->length = strlen(r->path);
+}
+
+//
+// Resolves path `i` if nobody has started on it.
+// Returns non-zero if somebody had.
+//
+static inline
+int
+resolve_claim(PathResolver* res, int i){
+    ResolvedPath* r = &res->paths[i];
+    int expected = RESOLVE_PENDING;
+    if(!atomic_compare_exchange_strong(&r->state, &expected, RESOLVE_CLAIMED))
+        return 1;
+    resolve_path(r);
+    pthread_mutex_lock(&res->lock);
+    atomic_store(&r->state, RESOLVE_DONE);
+    pthread_cond_broadcast(&res->done);
+    pthread_mutex_unlock(&res->lock);
+    return 0;
+}
+
+static inline
+void*_Nullable
+resolve_thread(void* p){
+    PathResolver* res = p;
+    for(;;){
+        int i = atomic_fetch_add(&res->next, 1);
+        if(i >= res->count) break;
+        resolve_claim(res, i);
+    }
+    return NULL;
+}
+
+//
+// Starts resolving `count` paths, each with `given` set. If no threads can
+// be started they're resolved as they're asked for.
+//
+static inline
+void
+resolve_start(PathResolver* res, ResolvedPath* paths, int count){
+    res->paths = paths;
+    res->count = count;
+    atomic_init(&res->next, 0);
+    pthread_mutex_init(&res->lock, NULL);
+    pthread_cond_init(&res->done, NULL);
+    for(int i = 0; i < count; i++)
+        atomic_init(&paths[i].state, RESOLVE_PENDING);
+    int nthreads = (count + RESOLVE_PER_THREAD - 1) / RESOLVE_PER_THREAD;
+    if(nthreads > RESOLVE_MAX_THREADS) nthreads = RESOLVE_MAX_THREADS;
+    res->nthreads = 0;
+    for(int i = 0; i < nthreads; i++){
+        if(pthread_create(&res->threads[i], NULL, resolve_thread, res) != 0)
+            break;
+        // Nobody waits for them, they're done when they run out of paths.
+        pthread_detach(res->threads[i]);
+        res->nthreads++;
+    }
+}
+
+//
+// Path `i`, resolving it now unless another thread is already on it, in
+// which case this waits for that.
+//
+static inline
+const ResolvedPath*
+resolve_get(PathResolver* res, int i){
+    ResolvedPath* r = &res->paths[i];
+    if(atomic_load(&r->state) == RESOLVE_DONE) return r;
+    if(resolve_claim(res, i) == 0) return r;
+    pthread_mutex_lock(&res->lock);
+    while(atomic_load(&r->state) != RESOLVE_DONE)
+        pthread_cond_wait(&res->done, &res->lock);
+    pthread_mutex_unlock(&res->lock);
+    return r;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
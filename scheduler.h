@@ -0,0 +1,601 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+// scheduler.h
+// -----------
+// A pool of worker threads running prioritized jobs.
+//
+// Each worker has its own deques, one per priority. A worker runs the most
+// urgent job it can find: from the back of its own deques first, otherwise
+// stolen from the front of another worker's. Jobs submitted from outside the
+// pool are spread over the workers round robin.
+//
+// A job runs as a series of steps (stages). Between steps, a job yields its
+// worker back if something more urgent is waiting and no worker is idle to
+// take it, so a background job can't hold up the one the user is waiting
+// for by more than one stage.
+//
+// A queued job can be boosted to a more urgent priority, which moves its
+// entry to that priority's deque. A job is only ever in one deque, which
+// holds a reference, so a job is freed by the last of its owner and the
+// deque to let go of it.
+//
+// A job can split its work with `sched_for`, which runs the parts as jobs
+// of their own rather than starting threads, and runs whichever nobody has
+// taken yet itself.
+//
+// `sched_shutdown` stops the workers, each at the end of the stage it's on.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+// Most urgent first.
+typedef enum SchedPriority {
+    // What's on screen, or about to be.
+    SCHED_VISIBLE,
+    // The next image in the direction the user is going.
+    SCHED_NEXT,
+    // The other way.
+    SCHED_PREV,
+    // Anything else, like images further out.
+    SCHED_THUMBNAIL,
+    SCHED_NPRIORITIES,
+} SchedPriority;
+
+enum {SCHED_MAX_WORKERS = 16};
+
+typedef enum SchedState {
+    SCHED_QUEUED,
+    SCHED_RUNNING,
+    SCHED_DONE,
+} SchedState;
+
+typedef enum SchedStep {
+    SCHED_STEP_MORE,
+    SCHED_STEP_DONE,
+} SchedStep;
+
+typedef struct SchedJob SchedJob;
+struct SchedJob {
+    // Runs the next stage.
+    SchedStep (*step)(SchedJob*);
+    // Called once the last reference is released.
+    void (*destroy)(SchedJob*);
+    _Atomic int priority;
+    _Atomic int state;
+    _Atomic int refs;
+    // Set to make the job stop at the next stage boundary.
+    atomic_bool cancelled;
+    // If set, run once instead of the next stage when the job is cancelled,
+    // to keep what it can of the work done so far.
+    void (*_Nullable salvage)(SchedJob*);
+    // The worker whose deque it was last put on. Changed under that
+    // worker's lock.
+    _Atomic(struct SchedWorker*_Nullable) home;
+};
+
+typedef struct SchedDeque SchedDeque;
+struct SchedDeque {
+    SchedJob*_Nullable* _Nullable items;
+    size_t head, count, capacity;
+};
+
+typedef struct SchedWorker SchedWorker;
+struct SchedWorker {
+    pthread_mutex_t lock;
+    SchedDeque deques[SCHED_NPRIORITIES];
+    pthread_t thread;
+    struct Scheduler* sched;
+    int id;
+};
+
+typedef struct Scheduler Scheduler;
+struct Scheduler {
+    SchedWorker workers[SCHED_MAX_WORKERS];
+    int nworkers;
+    atomic_uint next_worker;
+    // Entries in the deques, in total and by priority.
+    _Atomic int queued;
+    _Atomic int waiting[SCHED_NPRIORITIES];
+    _Atomic int idle;
+    // Workers sleep on `work`, waiters on `done`.
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    atomic_bool stop;
+    // Which of the workers have a thread.
+    _Bool started[SCHED_MAX_WORKERS];
+    // For seeing what the scheduler is doing.
+    _Atomic int steals, yields;
+    // If set (after sched_init, before submitting anything), called on the
+    // worker as each job finishes, just before sched_wait returns for it.
+    // Takes a reference if it hangs on to the job.
+    void (*_Nullable finished)(SchedJob*, void*_Nullable ctx);
+    void*_Nullable finished_ctx;
+};
+
+static _Thread_local SchedWorker*_Nullable sched_current_worker;
+// What the worker is running.
+static _Thread_local SchedJob*_Nullable sched_current_job;
+
+static inline
+void
+sched_job_init(SchedJob* job, SchedStep (*step)(SchedJob*), void (*destroy)(SchedJob*), SchedPriority priority){
+    job->step = step;
+    job->destroy = destroy;
+    atomic_init(&job->priority, priority);
+    atomic_init(&job->state, SCHED_QUEUED);
+    atomic_init(&job->refs, 1);
+    atomic_init(&job->cancelled, 0);
+    job->salvage = NULL;
+    atomic_init(&job->home, NULL);
+}
+
+static inline
+void
+sched_job_retain(SchedJob* job){
+    atomic_fetch_add(&job->refs, 1);
+}
+
+static inline
+void
+sched_job_release(SchedJob* job){
+    if(atomic_fetch_sub(&job->refs, 1) == 1)
+        job->destroy(job);
+}
+
+static inline
+_Bool
+sched_job_done(SchedJob* job){
+    return atomic_load(&job->state) == SCHED_DONE;
+}
+
+//
+// Makes room for one more.
+// Returns non-zero if there's no memory for it.
+//
+static inline
+int
+sched_deque_reserve(SchedDeque* d){
+    if(d->count < d->capacity) return 0;
+    size_t cap = d->capacity? d->capacity*2 : 16;
+    SchedJob** items = malloc(cap * sizeof *items);
+    if(!items) return 1;
+    for(size_t i = 0; i < d->count; i++)
+        items[i] = d->items[(d->head+i) % d->capacity];
+    free(d->items);
+    d->items = items;
+    d->head = 0;
+    d->capacity = cap;
+    return 0;
+}
+
+static inline
+int
+sched_deque_push(SchedDeque* d, SchedJob* job){
+    if(sched_deque_reserve(d)) return 1;
+    d->items[(d->head+d->count) % d->capacity] = job;
+    d->count++;
+    return 0;
+}
+
+//
+// Takes the job out from wherever it is in the deque.
+// Returns whether it was there.
+//
+static inline
+_Bool
+sched_deque_remove(SchedDeque* d, SchedJob* job){
+    for(size_t i = 0; i < d->count; i++){
+        if(d->items[(d->head+i) % d->capacity] != job) continue;
+        for(size_t j = i; j+1 < d->count; j++)
+            d->items[(d->head+j) % d->capacity] = d->items[(d->head+j+1) % d->capacity];
+        d->count--;
+        return 1;
+    }
+    return 0;
+}
+
+static inline
+SchedJob*_Nullable
+sched_deque_pop_back(SchedDeque* d){
+    if(!d->count) return NULL;
+    d->count--;
+    return d->items[(d->head+d->count) % d->capacity];
+}
+
+static inline
+SchedJob*_Nullable
+sched_deque_pop_front(SchedDeque* d){
+    if(!d->count) return NULL;
+    SchedJob* job = d->items[d->head];
+    d->head = (d->head+1) % d->capacity;
+    d->count--;
+    return job;
+}
+
+//
+// Puts a reference to the job on a worker's deque for its current priority
+// and wakes a worker.
+// Returns non-zero on failure.
+//
+static inline
+int
+sched_enqueue(Scheduler* s, SchedWorker* w, SchedJob* job){
+    sched_job_retain(job);
+    pthread_mutex_lock(&w->lock);
+    int prio = atomic_load(&job->priority);
+    int err = sched_deque_push(&w->deques[prio], job);
+    if(!err){
+        atomic_store(&job->home, w);
+        atomic_fetch_add(&s->waiting[prio], 1);
+        atomic_fetch_add(&s->queued, 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if(err){
+        sched_job_release(job);
+        return 1;
+    }
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+//
+// Queues a job. The caller keeps its reference.
+// Returns non-zero on failure.
+//
+static inline
+int
+sched_submit(Scheduler* s, SchedJob* job){
+    SchedWorker* w = sched_current_worker;
+    if(!w || w->sched != s)
+        w = &s->workers[atomic_fetch_add(&s->next_worker, 1) % (unsigned)s->nworkers];
+    return sched_enqueue(s, w, job);
+}
+
+//
+// Makes a job at least as urgent as `priority`.
+//
+static inline
+void
+sched_boost(Scheduler* s, SchedJob* job, SchedPriority priority){
+    int prio = atomic_load(&job->priority);
+    for(;;){
+        if((int)priority >= prio) return;
+        if(atomic_compare_exchange_weak(&job->priority, &prio, (int)priority)) break;
+    }
+    // Running jobs pick up the new priority at their next stage, a queued
+    // one has its entry moved.
+    SchedWorker* w;
+    while((w = atomic_load(&job->home))){
+        pthread_mutex_lock(&w->lock);
+        if(atomic_load(&job->home) != w){
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        // If there's no room it stays where it is, it still runs.
+        if(sched_deque_reserve(&w->deques[priority]) == 0){
+            for(int p = (int)priority+1; p < SCHED_NPRIORITIES; p++){
+                if(!sched_deque_remove(&w->deques[p], job)) continue;
+                sched_deque_push(&w->deques[priority], job);
+                atomic_fetch_sub(&s->waiting[p], 1);
+                atomic_fetch_add(&s->waiting[priority], 1);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+        return;
+    }
+}
+
+//
+// Takes a queued job off its deque, so the caller can run it instead.
+// Returns whether it did, in which case the caller has the deque's
+// reference.
+//
+static inline
+_Bool
+sched_claim(Scheduler* s, SchedJob* job){
+    SchedWorker* w;
+    while((w = atomic_load(&job->home))){
+        pthread_mutex_lock(&w->lock);
+        if(atomic_load(&job->home) != w){
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+        _Bool found = 0;
+        for(int p = 0; p < SCHED_NPRIORITIES && !found; p++){
+            found = sched_deque_remove(&w->deques[p], job);
+            if(found){
+                atomic_fetch_sub(&s->waiting[p], 1);
+                atomic_fetch_sub(&s->queued, 1);
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+        return found;
+    }
+    return 0;
+}
+
+static inline
+void
+sched_cancel(SchedJob* job){
+    atomic_store(&job->cancelled, 1);
+}
+
+// Takes the most urgent entry from w's deque, from the back if it's ours.
+static inline
+SchedJob*_Nullable
+sched_take(Scheduler* s, SchedWorker* w, int max_prio, _Bool own){
+    SchedJob* job = NULL;
+    pthread_mutex_lock(&w->lock);
+    for(int p = 0; p <= max_prio && !job; p++){
+        job = own? sched_deque_pop_back(&w->deques[p]) : sched_deque_pop_front(&w->deques[p]);
+        if(job){
+            atomic_fetch_sub(&s->waiting[p], 1);
+            atomic_fetch_sub(&s->queued, 1);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static inline
+SchedJob*_Nullable
+sched_find(Scheduler* s, SchedWorker* self){
+    SchedJob* job = sched_take(s, self, SCHED_NPRIORITIES-1, 1);
+    if(job) return job;
+    for(int i = 1; i < s->nworkers; i++){
+        SchedWorker* victim = &s->workers[(self->id+i) % s->nworkers];
+        job = sched_take(s, victim, SCHED_NPRIORITIES-1, 0);
+        if(job){
+            atomic_fetch_add(&s->steals, 1);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Whether a job at `prio` should give its worker to something more urgent.
+static inline
+_Bool
+sched_should_yield(Scheduler* s, int prio){
+    if(atomic_load(&s->idle)) return 0;
+    for(int p = 0; p < prio; p++)
+        if(atomic_load(&s->waiting[p])) return 1;
+    return 0;
+}
+
+static inline
+void
+sched_finish(Scheduler* s, SchedJob* job){
+    if(s->finished) s->finished(job, s->finished_ctx);
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&job->state, SCHED_DONE);
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Runs a job we popped, until it's done or it yields.
+static inline
+void
+sched_run(Scheduler* s, SchedWorker* w, SchedJob* job){
+    atomic_store(&job->state, SCHED_RUNNING);
+    sched_current_job = job;
+    for(;;){
+        if(atomic_load(&job->cancelled)){
+            if(job->salvage) job->salvage(job);
+            break;
+        }
+        if(atomic_load(&s->stop)) break;
+        if(job->step(job) == SCHED_STEP_DONE) break;
+        if(sched_should_yield(s, atomic_load(&job->priority))){
+            atomic_fetch_add(&s->yields, 1);
+            atomic_store(&job->state, SCHED_QUEUED);
+            if(sched_enqueue(s, w, job) == 0) goto release;
+            // Couldn't requeue it, keep going.
+            atomic_store(&job->state, SCHED_RUNNING);
+        }
+    }
+    sched_finish(s, job);
+    release:
+    sched_current_job = NULL;
+    sched_job_release(job);
+}
+
+static inline
+void*_Nullable
+sched_worker_main(void* p){
+    SchedWorker* w = p;
+    Scheduler* s = w->sched;
+    sched_current_worker = w;
+    while(!atomic_load(&s->stop)){
+        SchedJob* job = sched_find(s, w);
+        if(job){
+            sched_run(s, w, job);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        if(!atomic_load(&s->queued) && !atomic_load(&s->stop)){
+            atomic_fetch_add(&s->idle, 1);
+            pthread_cond_wait(&s->work, &s->lock);
+            atomic_fetch_sub(&s->idle, 1);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+//
+// Starts the workers, one per cpu if nworkers is 0.
+// Returns non-zero if none could be started.
+//
+static inline
+int
+sched_init(Scheduler* s, int nworkers){
+    if(nworkers <= 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0? (int)ncpu : 1;
+    }
+    if(nworkers > SCHED_MAX_WORKERS) nworkers = SCHED_MAX_WORKERS;
+    memset(s, 0, sizeof *s);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->done, NULL);
+    for(int i = 0; i < nworkers; i++){
+        SchedWorker* w = &s->workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->sched = s;
+        w->id = i;
+    }
+    // Workers look at each other's deques, set the count before any start.
+    s->nworkers = nworkers;
+    int started = 0;
+    for(int i = 0; i < nworkers; i++){
+        if(pthread_create(&s->workers[i].thread, NULL, sched_worker_main, &s->workers[i]) != 0)
+            break;
+        s->started[i] = 1;
+        started++;
+    }
+    // The rest get stolen from.
+    return started == 0;
+}
+
+//
+// Waits for a job to finish.
+//
+static inline
+void
+sched_wait(Scheduler* s, SchedJob* job){
+    pthread_mutex_lock(&s->lock);
+    while(atomic_load(&job->state) != SCHED_DONE)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+typedef struct SchedForPart SchedForPart;
+struct SchedForPart {
+    SchedJob job;
+    struct SchedFor* group;
+    int index;
+};
+
+typedef struct SchedFor SchedFor;
+struct SchedFor {
+    Scheduler* sched;
+    void (*fn)(void*, int);
+    void* ctx;
+    // Parts not yet released, under the scheduler's lock.
+    int remaining;
+};
+
+static inline
+SchedStep
+sched_for_step(SchedJob* job){
+    SchedForPart* part = (SchedForPart*)job;
+    part->group->fn(part->group->ctx, part->index);
+    return SCHED_STEP_DONE;
+}
+
+static inline
+void
+sched_for_destroy(SchedJob* job){
+    SchedFor* group = ((SchedForPart*)job)->group;
+    Scheduler* s = group->sched;
+    pthread_mutex_lock(&s->lock);
+    group->remaining--;
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->lock);
+}
+
+//
+// Runs fn(ctx, i) for each i below count, on the workers, and returns once
+// they've all run. The parts are as urgent as the job calling this, or
+// SCHED_VISIBLE from outside the pool. The caller runs the first part, and
+// any others no worker has started by then, so a worker calling this
+// doesn't wait on its own deque.
+//
+static inline
+void
+sched_for(Scheduler* s, int count, void (*fn)(void*, int), void* ctx){
+    if(count <= 0) return;
+    SchedForPart* parts = count > 1? malloc((size_t)(count-1) * sizeof *parts) : NULL;
+    if(!parts){
+        for(int i = 0; i < count; i++) fn(ctx, i);
+        return;
+    }
+    SchedPriority priority = sched_current_job? (SchedPriority)atomic_load(&sched_current_job->priority) : SCHED_VISIBLE;
+    SchedFor group = {s, fn, ctx, count-1};
+    for(int i = 1; i < count; i++){
+        SchedForPart* part = &parts[i-1];
+        part->group = &group;
+        part->index = i;
+        sched_job_init(&part->job, sched_for_step, sched_for_destroy, priority);
+        if(sched_submit(s, &part->job))
+            fn(ctx, i);
+        // The deque has it now, if anything.
+        sched_job_release(&part->job);
+    }
+    fn(ctx, 0);
+    // The last submitted were the first put back on our own deque, take
+    // them back from there.
+    for(int i = count-1; i >= 1; i--){
+        SchedForPart* part = &parts[i-1];
+        if(!sched_claim(s, &part->job)) continue;
+        fn(ctx, i);
+        atomic_store(&part->job.state, SCHED_DONE);
+        sched_job_release(&part->job);
+    }
+    pthread_mutex_lock(&s->lock);
+    while(group.remaining)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    free(parts);
+}
+
+//
+// Stops the workers once they're through the stage they're on and waits
+// for them. Jobs still queued are dropped without running, don't wait on
+// them after this.
+//
+static inline
+void
+sched_shutdown(Scheduler* s){
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->stop, 1);
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    for(int i = 0; i < s->nworkers; i++)
+        if(s->started[i]) pthread_join(s->workers[i].thread, NULL);
+    for(int i = 0; i < s->nworkers; i++){
+        SchedWorker* w = &s->workers[i];
+        for(int p = 0; p < SCHED_NPRIORITIES; p++){
+            SchedJob* job;
+            while((job = sched_deque_pop_front(&w->deques[p]))){
+                atomic_fetch_sub(&s->waiting[p], 1);
+                atomic_fetch_sub(&s->queued, 1);
+                sched_job_release(job);
+            }
+            free(w->deques[p].items);
+            w->deques[p] = (SchedDeque){0};
+        }
+    }
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef TERMPROBE_H
+#define TERMPROBE_H
+// termprobe.h
+// -----------
+// Asks the terminal what it can do: kitty graphics (a=q), sixel (DA1
+// attribute 4), cell size in pixels (CSI 16 t) and window size in pixels
+// (CSI 14 t).
+//
+// DA1 is sent last. Every terminal answers it and answers in order, so its
+// reply means there is nothing more to wait for, and reading up to it means
+// nothing is left over to turn up as keys later.
+//
+// The protocols are cached in $XDG_CACHE_HOME/imgpgr/termcaps (or
+// ~/.cache/imgpgr/termcaps), keyed by $TERM and $TERM_PROGRAM. The cell size
+// isn't, it changes with the font, so it's asked for every time.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+typedef struct TermCaps TermCaps;
+struct TermCaps {
+    _Bool kitty;
+    _Bool sixel;
+    // OSC 1337 inline images.
+    _Bool iterm;
+    // 0 if unknown.
+    int cell_width, cell_height;
+};
+
+// Whether the pty knows its own size in pixels. If it does, there's no
+// point asking the terminal for the cell size.
+static inline
+_Bool
+termcaps_have_pixel_size(void){
+    struct winsize w;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) return 0;
+    return w.ws_col && w.ws_row && w.ws_xpixel && w.ws_ypixel && w.ws_xpixel != 65535;
+}
+
+// The iterm protocol has no query, so go by what the terminal says it is.
+static inline
+_Bool
+termcaps_env_iterm(void){
+    const char* prog = getenv("TERM_PROGRAM");
+    const char* lc = getenv("LC_TERMINAL");
+    if(prog && (!strcmp(prog, "iTerm.app") || !strcmp(prog, "WezTerm")))
+        return 1;
+    if(lc && !strcmp(lc, "iTerm2"))
+        return 1;
+    return 0;
+}
+
+// Inside tmux, kitty's reply to a=q doesn't always make it back to us, but
+// tmux keeps the environment of the terminal it was started from.
+static inline
+_Bool
+termcaps_env_kitty(void){
+    return getenv("KITTY_WINDOW_ID") != NULL;
+}
+
+// Parses the "a;b;c" params of a CSI reply starting at p, up to max of them.
+static inline
+int
+termcaps_parse_params(const char* p, const char* end, int* params, int max, char* final){
+    int n = 0;
+    int cur = 0;
+    _Bool have = 0;
+    for(; p < end; p++){
+        if(*p >= '0' && *p <= '9'){
+            cur = cur*10 + (*p - '0');
+            have = 1;
+        }
+        else if(*p == ';'){
+            if(n < max) params[n++] = cur;
+            cur = 0;
+            have = 0;
+        }
+        else if(*p >= 0x40 && *p <= 0x7e){
+            if(have && n < max) params[n++] = cur;
+            *final = *p;
+            return n;
+        }
+        else if(*p != '?')
+            break;
+    }
+    *final = 0;
+    return -1;
+}
+
+//
+// Parses replies to our queries out of buff.
+// Returns whether the DA1 reply was seen.
+//
+static inline
+_Bool
+termcaps_parse_replies(TermCaps* caps, const char* buff, size_t len){
+    _Bool done = 0;
+    const char* end = buff+len;
+    for(const char* p = buff; p < end; p++){
+        if(*p != '\033' || p+2 >= end) continue;
+        if(p[1] == '_' && p[2] == 'G'){
+            // \033_Gi=31;OK\033\\ or an error message.
+            const char* semi = memchr(p, ';', (size_t)(end-p));
+            if(semi && end - semi >= 3 && !memcmp(semi+1, "OK", 2))
+                caps->kitty = 1;
+            continue;
+        }
+        if(p[1] != '[') continue;
+        int params[16];
+        char final;
+        int n = termcaps_parse_params(p+2, end, params, 16, &final);
+        if(n < 0) continue;
+        if(final == 'c' && p[2] == '?'){
+            for(int i = 1; i < n; i++)
+                if(params[i] == 4) caps->sixel = 1;
+            done = 1;
+        }
+        else if(final == 't' && n == 3 && params[0] == 6){
+            if(params[1] > 0 && params[2] > 0){
+                caps->cell_height = params[1];
+                caps->cell_width = params[2];
+            }
+        }
+        else if(final == 't' && n == 3 && params[0] == 4){
+            // Prefer the cell size if we got it, the window can have padding.
+            if(!caps->cell_width && params[1] > 0 && params[2] > 0){
+                struct winsize w;
+                if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) != -1 && w.ws_col && w.ws_row){
+                    caps->cell_height = params[1] / w.ws_row;
+                    caps->cell_width = params[2] / w.ws_col;
+                }
+            }
+        }
+    }
+    return done;
+}
+
+//
+// Queries the terminal, waiting for the DA1 reply at most timeout_ms.
+// Unless `protocols` is set, only the cell size is asked for.
+// If in_tmux is set, the kitty query is wrapped in a tmux passthrough so it
+// reaches the real terminal.
+// Returns non-zero if the terminal couldn't be queried at all (not a tty).
+//
+static inline
+int
+termcaps_probe(TermCaps* caps, int timeout_ms, _Bool protocols, _Bool in_tmux){
+    *caps = (TermCaps){0};
+    caps->iterm = termcaps_env_iterm();
+    if(!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) return 1;
+    struct termios orig, raw;
+    if(tcgetattr(STDIN_FILENO, &orig) == -1) return 1;
+    raw = orig;
+    raw.c_lflag &= ~(tcflag_t)(ECHO | ICANON);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    // TCSANOW so we don't throw away typeahead.
+    if(tcsetattr(STDIN_FILENO, TCSANOW, &raw) == -1) return 1;
+    static const char kitty_query[] = "\033_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\033\\";
+    static const char tmux_kitty_query[] = "\033Ptmux;\033\033_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\033\033\\\033\\";
+    static const char query[] =
+        "\033[16t"
+        "\033[14t"
+        "\033[c";
+    ssize_t unused;
+    if(protocols && in_tmux)
+        unused = write(STDOUT_FILENO, tmux_kitty_query, sizeof tmux_kitty_query - 1);
+    else if(protocols)
+        unused = write(STDOUT_FILENO, kitty_query, sizeof kitty_query - 1);
+    unused = write(STDOUT_FILENO, query, sizeof query - 1);
+    (void)unused;
+    char buff[1024];
+    size_t len = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(;;){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000;
+        if(elapsed >= timeout_ms) break;
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        int err = poll(&pfd, 1, (int)(timeout_ms - elapsed));
+        if(err < 0 && errno == EINTR) continue;
+        if(err <= 0) break;
+        ssize_t nread = read(STDIN_FILENO, buff+len, sizeof buff - len);
+        if(nread <= 0) break;
+        len += (size_t)nread;
+        if(termcaps_parse_replies(caps, buff, len)) break;
+        if(len == sizeof buff){
+            // Whatever's filling it isn't ours, but the DA1 reply is still
+            // coming. Keep the end in case a reply is cut off there.
+            enum {KEEP = 64};
+            memmove(buff, buff + len - KEEP, KEEP);
+            len = KEEP;
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &orig);
+    return 0;
+}
+
+//
+// Asks for the cell size again, for after the window changes. Goes through
+// fp so it doesn't land in the middle of something else being written. The
+// replies come in with the keys, see `termcaps_parse_replies`.
+//
+static inline
+void
+termcaps_request_cell_size(FILE* fp){
+    fputs("\033[16t\033[14t", fp);
+}
+
+static inline
+int
+termcaps_cache_path(char* buff, size_t bufflen, _Bool create_dir){
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    int n;
+    if(xdg && *xdg)
+        n = snprintf(buff, bufflen, "%s/imgpgr", xdg);
+    else if(home && *home)
+        n = snprintf(buff, bufflen, "%s/.cache/imgpgr", home);
+    else
+        return 1;
+    if(n < 0 || (size_t)n >= bufflen) return 1;
+    if(create_dir){
+        // Parent might not exist either.
+        char* slash = strrchr(buff, '/');
+        if(slash){
+            *slash = 0;
+            mkdir(buff, 0755);
+            *slash = '/';
+        }
+        mkdir(buff, 0755);
+    }
+    int n2 = snprintf(buff+n, bufflen-(size_t)n, "/termcaps");
+    if(n2 < 0 || (size_t)(n+n2) >= bufflen) return 1;
+    return 0;
+}
+
+static inline
+void
+termcaps_cache_key(char* buff, size_t bufflen){
+    const char* term = getenv("TERM");
+    const char* prog = getenv("TERM_PROGRAM");
+    snprintf(buff, bufflen, "%s\t%s", term?term:"", prog?prog:"");
+}
+
+//
+// Looks up the cached protocols for this terminal.
+// Returns non-zero if there is no entry.
+//
+static inline
+int
+termcaps_load_cached(TermCaps* caps){
+    char path[1024];
+    if(termcaps_cache_path(path, sizeof path, 0)) return 1;
+    FILE* fp = fopen(path, "r");
+    if(!fp) return 1;
+    char key[512];
+    termcaps_cache_key(key, sizeof key);
+    size_t keylen = strlen(key);
+    char line[1024];
+    int result = 1;
+    while(fgets(line, sizeof line, fp)){
+        if(strncmp(line, key, keylen) != 0 || line[keylen] != '\t') continue;
+        // Older entries have the cell size after, which is ignored.
+        int kitty, sixel, iterm;
+        if(sscanf(line+keylen+1, "%d %d %d", &kitty, &sixel, &iterm) != 3)
+            continue;
+        *caps = (TermCaps){
+            .kitty = !!kitty,
+            .sixel = !!sixel,
+            .iterm = !!iterm,
+        };
+        result = 0;
+    }
+    fclose(fp);
+    return result;
+}
+
+//
+// Records the protocols for this terminal, replacing any previous entry.
+//
+static inline
+void
+termcaps_store_cached(const TermCaps* caps){
+    char path[1024];
+    if(termcaps_cache_path(path, sizeof path, 1)) return;
+    char key[512];
+    termcaps_cache_key(key, sizeof key);
+    size_t keylen = strlen(key);
+    // Small file, just rewrite the whole thing.
+    char* old = NULL;
+    size_t oldlen = 0;
+    FILE* fp = fopen(path, "r");
+    if(fp){
+        char line[1024];
+        while(fgets(line, sizeof line, fp)){
+            if(!strncmp(line, key, keylen) && line[keylen] == '\t') continue;
+            size_t l = strlen(line);
+            char* p = realloc(old, oldlen+l);
+            if(!p) break;
+            old = p;
+            memcpy(old+oldlen, line, l);
+            oldlen += l;
+        }
+        fclose(fp);
+    }
+    char tmppath[1040];
+    snprintf(tmppath, sizeof tmppath, "%s.%d", path, (int)getpid());
+    fp = fopen(tmppath, "w");
+    if(!fp){
+        free(old);
+        return;
+    }
+    if(oldlen) fwrite(old, oldlen, 1, fp);
+    fprintf(fp, "%s\t%d %d %d\n", key, caps->kitty, caps->sixel, caps->iterm);
+    fclose(fp);
+    rename(tmppath, path);
+    free(old);
+}
+
+#endif
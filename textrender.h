@@ -0,0 +1,225 @@
+#ifndef TEXTRENDER_H
+#define TEXTRENDER_H
+// textrender.h
+// ------------
+// Renders pixels as truecolor text for terminals without a graphics
+// protocol. Either as upper half blocks (1x2 pixels per cell) or as braille
+// (2x4 pixels per cell, with a foreground and background color per cell).
+//
+// A frame is a grid of cells. Emitting a frame against the previously emitted
+// one only redraws the cells that changed and only changes the SGR colors when
+// they differ from the last ones written.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+typedef enum TextMode {
+    TEXT_HALFBLOCK,
+    TEXT_BRAILLE,
+} TextMode;
+
+typedef struct TextCell TextCell;
+struct TextCell {
+    // Codepoint to display. A space means only the bg is meaningful.
+    uint32_t glyph;
+    // 0x00RRGGBB
+    uint32_t fg, bg;
+};
+
+typedef struct TextFrame TextFrame;
+struct TextFrame {
+    int cols, rows;
+    TextCell* cells;
+};
+
+// Pixels per cell for the given mode.
+static inline
+void
+text_cell_pixels(TextMode mode, int* px, int* py){
+    if(mode == TEXT_BRAILLE){
+        *px = 2;
+        *py = 4;
+    }
+    else {
+        *px = 1;
+        *py = 2;
+    }
+}
+
+// Reads a pixel as 0x00RRGGBB, compositing onto black.
+static inline
+uint32_t
+text_get_rgb(const uint8_t* p, int n){
+    uint32_t r, g, b, a = 255;
+    switch(n){
+        case 1: r = g = b = p[0]; break;
+        case 2: r = g = b = p[0]; a = p[1]; break;
+        case 3: r = p[0]; g = p[1]; b = p[2]; break;
+        default: r = p[0]; g = p[1]; b = p[2]; a = p[3]; break;
+    }
+    if(a != 255){
+        r = r*a/255;
+        g = g*a/255;
+        b = b*a/255;
+    }
+    return r << 16 | g << 8 | b;
+}
+
+static inline
+uint32_t
+text_luma(uint32_t c){
+    return ((c>>16&0xff)*77 + (c>>8&0xff)*150 + (c&0xff)*29) >> 8;
+}
+
+//
+// Converts pixels that have already been resized to exactly
+// cols*px by rows*py (see `text_cell_pixels`) into a frame.
+// Returns non-zero on allocation failure.
+//
+static inline
+int
+text_frame_build(TextFrame* frame, TextMode mode, const uint8_t* pixels, int w, int h, int n){
+    int px, py;
+    text_cell_pixels(mode, &px, &py);
+    int cols = w / px, rows = h / py;
+    TextCell* cells = malloc(sizeof(*cells)*(size_t)(cols*rows > 0 ? cols*rows : 1));
+    if(!cells) return 1;
+    for(int r = 0; r < rows; r++){
+        for(int c = 0; c < cols; c++){
+            TextCell* cell = &cells[r*cols+c];
+            if(mode == TEXT_HALFBLOCK){
+                uint32_t top = text_get_rgb(pixels + ((size_t)(r*2)*w + c)*n, n);
+                uint32_t bot = text_get_rgb(pixels + ((size_t)(r*2+1)*w + c)*n, n);
+                if(top == bot)
+                    *cell = (TextCell){' ', 0, bot};
+                else
+                    *cell = (TextCell){0x2580, top, bot};
+                continue;
+            }
+            // Braille dot numbering, indexed by [y][x] within the cell.
+            static const uint8_t dots[4][2] = {
+                {0x01, 0x08},
+                {0x02, 0x10},
+                {0x04, 0x20},
+                {0x40, 0x80},
+            };
+            uint32_t rgb[4][2];
+            uint32_t luma[4][2];
+            uint32_t total = 0;
+            for(int dy = 0; dy < 4; dy++){
+                for(int dx = 0; dx < 2; dx++){
+                    rgb[dy][dx] = text_get_rgb(pixels + ((size_t)(r*4+dy)*w + c*2+dx)*n, n);
+                    luma[dy][dx] = text_luma(rgb[dy][dx]);
+                    total += luma[dy][dx];
+                }
+            }
+            uint32_t mean = total / 8;
+            uint32_t sums[2][4] = {0};
+            unsigned bits = 0;
+            for(int dy = 0; dy < 4; dy++){
+                for(int dx = 0; dx < 2; dx++){
+                    int on = luma[dy][dx] > mean;
+                    if(on) bits |= dots[dy][dx];
+                    uint32_t v = rgb[dy][dx];
+                    sums[on][0] += v>>16&0xff;
+                    sums[on][1] += v>>8&0xff;
+                    sums[on][2] += v&0xff;
+                    sums[on][3]++;
+                }
+            }
+            uint32_t avg[2] = {0};
+            for(int i = 0; i < 2; i++){
+                uint32_t cnt = sums[i][3];
+                if(!cnt) continue;
+                avg[i] = (sums[i][0]/cnt) << 16 | (sums[i][1]/cnt) << 8 | sums[i][2]/cnt;
+            }
+            if(!bits)
+                *cell = (TextCell){' ', 0, avg[0]};
+            else
+                *cell = (TextCell){0x2800+bits, avg[1], avg[0]};
+        }
+    }
+    free(frame->cells);
+    *frame = (TextFrame){cols, rows, cells};
+    return 0;
+}
+
+static inline
+void
+text_frame_destroy(TextFrame* frame){
+    free(frame->cells);
+    *frame = (TextFrame){0};
+}
+
+static inline
+void
+text_put_utf8(FILE* fp, uint32_t cp){
+    if(cp < 0x80){
+        putc((int)cp, fp);
+        return;
+    }
+    // Everything we emit is in the BMP.
+    putc((int)(0xe0 | cp >> 12), fp);
+    putc((int)(0x80 | (cp >> 6 & 0x3f)), fp);
+    putc((int)(0x80 | (cp & 0x3f)), fp);
+}
+
+//
+// Writes `cur` with its top left corner at cell x, y of the screen (from
+// 0). If `prev` has the same dimensions, it is assumed to be what is currently on
+// screen and only cells that differ are written.
+//
+// Leaves the SGR state reset.
+//
+static inline
+void
+text_frame_emit(FILE* fp, const TextFrame* cur, const TextFrame*_Nullable prev, int x, int y){
+    _Bool diff = prev && prev->cells && prev->cols == cur->cols && prev->rows == cur->rows;
+    // -1 means unknown.
+    int64_t fg = -1, bg = -1;
+    // Where the terminal's cursor is.
+    int cx = -1, cy = -1;
+    for(int r = 0; r < cur->rows; r++){
+        for(int c = 0; c < cur->cols; c++){
+            const TextCell* cell = &cur->cells[r*cur->cols+c];
+            if(diff && !memcmp(cell, &prev->cells[r*cur->cols+c], sizeof *cell))
+                continue;
+            if(cx != c || cy != r){
+                fprintf(fp, "\033[%d;%dH", y+r+1, x+c+1);
+                cx = c;
+                cy = r;
+            }
+            _Bool need_fg = cell->glyph != ' ' && fg != cell->fg;
+            _Bool need_bg = bg != cell->bg;
+            if(need_fg && need_bg)
+                fprintf(fp, "\033[38;2;%u;%u;%u;48;2;%u;%u;%um",
+                    cell->fg>>16&0xff, cell->fg>>8&0xff, cell->fg&0xff,
+                    cell->bg>>16&0xff, cell->bg>>8&0xff, cell->bg&0xff);
+            else if(need_fg)
+                fprintf(fp, "\033[38;2;%u;%u;%um", cell->fg>>16&0xff, cell->fg>>8&0xff, cell->fg&0xff);
+            else if(need_bg)
+                fprintf(fp, "\033[48;2;%u;%u;%um", cell->bg>>16&0xff, cell->bg>>8&0xff, cell->bg&0xff);
+            if(need_fg) fg = cell->fg;
+            if(need_bg) bg = cell->bg;
+            text_put_utf8(fp, cell->glyph);
+            cx++;
+        }
+    }
+    fputs("\033[0m", fp);
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif
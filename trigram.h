@@ -0,0 +1,295 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+// trigram.h
+// ---------
+// An index of the paths by the three byte sequences (trigrams) in them, for
+// finding images by bits of their names as the name is typed.
+//
+// Each trigram, lowercased, is hashed to one of TRIGRAM_BUCKETS buckets,
+// which lists the paths containing it in ascending order. A path can only
+// match if it's in the bucket of every trigram of the query, so the
+// shortest of those is walked and the others searched for each path in it,
+// galloping forward from the last. Only what gets through that is compared
+// against the query itself.
+//
+// A thread builds the index when the paths are loaded, TRIGRAM_BATCH at a
+// time under the lock, so a search can come in while it's going. Paths not
+// indexed yet are scanned directly, so a search finds the same either way,
+// just slower at first.
+//
+// A query of three or more bytes matches the paths containing all of its
+// trigrams, in any order. Shorter ones have to be in the path as they are.
+// Either way case is ignored, for ascii. What matches is ranked:
+//
+//   - the query in the file name, the earlier and the closer the name is
+//     to the query the better
+//   - then in a directory name
+//   - then the trigrams only, shorter paths first
+//
+// and by index among equals.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "DrpLib/stringview.h"
+
+#ifdef __clang__
+#pragma clang assume_nonnull begin
+#else
+#ifndef _Nullable
+#define _Nullable
+#endif
+#endif
+
+enum {TRIGRAM_BUCKET_BITS = 14, TRIGRAM_BUCKETS = 1 << TRIGRAM_BUCKET_BITS};
+enum {TRIGRAM_BATCH = 256};
+// Longer queries are cut short.
+enum {TRIGRAM_MAX_QUERY = 256};
+
+typedef struct TrigramBucket TrigramBucket;
+struct TrigramBucket {
+    int*_Nullable items;
+    int count, capacity;
+};
+
+typedef struct TrigramMatch TrigramMatch;
+struct TrigramMatch {
+    int index;
+    int score;
+};
+
+typedef struct TrigramIndex TrigramIndex;
+struct TrigramIndex {
+    const StringView* paths;
+    int count;
+    // Everything below is under the lock.
+    pthread_mutex_t lock;
+    // Paths [0, indexed) are in the buckets.
+    int indexed;
+    // Ran out of memory, searches scan everything.
+    _Bool failed;
+    TrigramBucket buckets[TRIGRAM_BUCKETS];
+};
+
+static inline
+int
+trigram_lower(int c){
+    return c >= 'A' && c <= 'Z'? c - 'A' + 'a' : c;
+}
+
+static inline
+unsigned
+trigram_hash(const char* s){
+    uint32_t t = (uint32_t)trigram_lower((unsigned char)s[0]) << 16
+               | (uint32_t)trigram_lower((unsigned char)s[1]) << 8
+               | (uint32_t)trigram_lower((unsigned char)s[2]);
+    return (t * 2654435761u) >> (32 - TRIGRAM_BUCKET_BITS);
+}
+
+//
+// Returns non-zero if there's no memory for it.
+//
+static inline
+int
+trigram_bucket_add(TrigramBucket* b, int index){
+    // Paths go in in order, so it's only a repeat if it's the last one.
+    if(b->count && b->items[b->count-1] == index) return 0;
+    if(b->count == b->capacity){
+        int capacity = b->capacity? b->capacity * 2 : 8;
+        int* items = realloc(b->items, (size_t)capacity * sizeof *items);
+        if(!items) return 1;
+        b->items = items;
+        b->capacity = capacity;
+    }
+    b->items[b->count++] = index;
+    return 0;
+}
+
+//
+// Moves `at` forward to `index` in the bucket, or to past it.
+// Returns whether the bucket has it.
+//
+static inline
+_Bool
+trigram_bucket_seek(const TrigramBucket* b, int* at, int index){
+    int i = *at;
+    // Candidates come in order, so this only goes forward. Gallop, then
+    // binary search what's left.
+    int step = 1;
+    while(i + step < b->count && b->items[i + step] < index){
+        i += step;
+        step *= 2;
+    }
+    int lo = i, hi = i + step < b->count? i + step + 1 : b->count;
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if(b->items[mid] < index) lo = mid + 1;
+        else hi = mid;
+    }
+    *at = lo;
+    return lo < b->count && b->items[lo] == index;
+}
+
+//
+// Where the (lowercase) query is in s, ignoring case, -1 if it isn't.
+//
+static inline
+ptrdiff_t
+trigram_find(const char* s, size_t length, const char* query, size_t query_length){
+    if(query_length > length) return -1;
+    for(size_t i = 0; i + query_length <= length; i++){
+        if(trigram_lower((unsigned char)s[i]) != (unsigned char)query[0]) continue;
+        size_t j = 1;
+        while(j < query_length && trigram_lower((unsigned char)s[i+j]) == (unsigned char)query[j])
+            j++;
+        if(j == query_length) return (ptrdiff_t)i;
+    }
+    return -1;
+}
+
+//
+// How well path matches the (lowercase) query, higher is better.
+// Returns -1 if it doesn't.
+//
+static inline
+int
+trigram_score(StringView path, const char* query, size_t length){
+    size_t name = path.length;
+    while(name && path.text[name-1] != '/') name--;
+    size_t name_length = path.length - name;
+    ptrdiff_t at = trigram_find(path.text + name, name_length, query, length);
+    if(at >= 0){
+        size_t penalty = (size_t)at * 16 + name_length - length;
+        return 30000 - (int)(penalty < 9999? penalty : 9999);
+    }
+    size_t penalty = path.length < 9999? path.length : 9999;
+    if(trigram_find(path.text, path.length, query, length) >= 0)
+        return 20000 - (int)penalty;
+    if(length < 3) return -1;
+    for(size_t i = 0; i + 3 <= length; i++)
+        if(trigram_find(path.text, path.length, query + i, 3) < 0)
+            return -1;
+    return 10000 - (int)penalty;
+}
+
+//
+// Adds a match to the best so far, which are kept sorted.
+//
+static inline
+void
+trigram_rank(TrigramMatch* best, int max, int* nbest, int index, int score){
+    int n = *nbest;
+    if(n == max){
+        // Ties go to the earlier index, which this can't be.
+        if(score <= best[n-1].score) return;
+        n--;
+    }
+    int i = n;
+    for(; i > 0 && best[i-1].score < score; i--)
+        best[i] = best[i-1];
+    best[i] = (TrigramMatch){index, score};
+    *nbest = n + 1;
+}
+
+static inline
+void*_Nullable
+trigram_thread(void* p){
+    TrigramIndex* t = p;
+    for(int done = 0; done < t->count; ){
+        int end = done + TRIGRAM_BATCH < t->count? done + TRIGRAM_BATCH : t->count;
+        pthread_mutex_lock(&t->lock);
+        for(int i = done; i < end && !t->failed; i++){
+            StringView path = t->paths[i];
+            for(size_t j = 0; j + 3 <= path.length; j++){
+                if(trigram_bucket_add(&t->buckets[trigram_hash(path.text + j)], i)){
+                    t->failed = 1;
+                    break;
+                }
+            }
+        }
+        t->indexed = end;
+        _Bool failed = t->failed;
+        pthread_mutex_unlock(&t->lock);
+        if(failed) break;
+        done = end;
+    }
+    return NULL;
+}
+
+//
+// Starts indexing `count` paths, which mustn't change after. If no thread
+// can be started, searches scan them instead.
+//
+static inline
+void
+trigram_start(TrigramIndex* t, const StringView* paths, int count){
+    t->paths = paths;
+    t->count = count;
+    t->indexed = 0;
+    t->failed = 0;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, trigram_thread, t) != 0) return;
+    // Nobody waits for it, it's done when it's been through them all.
+    pthread_detach(thread);
+}
+
+//
+// Finds the paths matching `query`, the best `max` of them in order into
+// `best`, and how many that is into `nbest`.
+// Returns how many match in all.
+//
+static inline
+int
+trigram_search(TrigramIndex* t, const char* query, size_t length, TrigramMatch* best, int max, int* nbest){
+    *nbest = 0;
+    if(!length || max <= 0) return 0;
+    if(length > TRIGRAM_MAX_QUERY) length = TRIGRAM_MAX_QUERY;
+    char q[TRIGRAM_MAX_QUERY];
+    for(size_t i = 0; i < length; i++)
+        q[i] = (char)trigram_lower((unsigned char)query[i]);
+    int total = 0;
+    pthread_mutex_lock(&t->lock);
+    int scan_from = 0;
+    if(length >= 3 && !t->failed){
+        const TrigramBucket* lists[TRIGRAM_MAX_QUERY];
+        int nlists = 0, shortest = 0;
+        for(size_t i = 0; i + 3 <= length; i++){
+            lists[nlists] = &t->buckets[trigram_hash(q + i)];
+            if(lists[nlists]->count < lists[shortest]->count)
+                shortest = nlists;
+            nlists++;
+        }
+        int at[TRIGRAM_MAX_QUERY] = {0};
+        const TrigramBucket* walk = lists[shortest];
+        for(int k = 0; k < walk->count; k++){
+            int index = walk->items[k];
+            int l = 0;
+            for(; l < nlists; l++)
+                if(l != shortest && !trigram_bucket_seek(lists[l], &at[l], index))
+                    break;
+            if(l != nlists) continue;
+            // Hashes collide, this says if it really matches.
+            int score = trigram_score(t->paths[index], q, length);
+            if(score < 0) continue;
+            total++;
+            trigram_rank(best, max, nbest, index, score);
+        }
+        scan_from = t->indexed;
+    }
+    for(int index = scan_from; index < t->count; index++){
+        int score = trigram_score(t->paths[index], q, length);
+        if(score < 0) continue;
+        total++;
+        trigram_rank(best, max, nbest, index, score);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return total;
+}
+
+#ifdef __clang__
+#pragma clang assume_nonnull end
+#endif
+
+#endif